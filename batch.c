@@ -0,0 +1,441 @@
+/*
+ * batch.c - Run many independent scripts in parallel, one VM per script.
+ *
+ * Jobs are dealt round-robin onto per-worker deques. A worker takes jobs from
+ * the tail of its own deque and, once that is empty, steals from the head of
+ * a randomly chosen victim, so a few slow scripts do not leave other cores
+ * idle. No job creates further jobs, so a worker that finds every deque
+ * empty is done. With several lanes a worker takes that many jobs at a time
+ * and runs their VMs in lockstep with vm_run_lanes(). Workers keep their
+ * VMs from job to job and reset them to a snapshot of the template, which
+ * only restores the pages the previous job wrote.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+
+/* Most jobs a worker runs in lockstep */
+#define BATCH_MAX_LANES 64
+
+/* One manifest entry and its outcome */
+typedef struct {
+    char *input;   /* Input script path */
+    char *pattern; /* Expected output pattern (basic regex) */
+    bool passed;   /* Output matched the pattern */
+    double wall;   /* Wall time in seconds */
+} job_t;
+
+/* Per-worker double-ended queue of job indices */
+typedef struct {
+    pthread_mutex_t lock;
+    size_t *jobs; /* Job indices, live between head and tail */
+    size_t head;  /* Next job to steal */
+    size_t tail;  /* One past the next job to pop */
+} deque_t;
+
+/* Job I/O: input from a file descriptor, output captured in memory */
+typedef struct {
+    int fd;
+    char *out;
+    size_t len, cap;
+} job_io_t;
+
+typedef struct batch batch_t;
+
+typedef struct {
+    batch_t *batch;
+    pthread_t thread;
+    deque_t dq;
+    unsigned seed; /* Victim selection state */
+    vm_t *vms[BATCH_MAX_LANES];    /* Reused VMs, reset between jobs */
+    job_io_t jio[BATCH_MAX_LANES]; /* I/O of the job on each VM */
+} worker_t;
+
+struct batch {
+    const vm_t *tmpl;   /* Loaded and decoded template VM */
+    uint64_t max_insns; /* Per-job instruction budget, 0 for none */
+    unsigned lanes;     /* Jobs run together in lockstep */
+    job_t *jobs;
+    size_t njobs;
+    worker_t *workers;
+    unsigned nworkers;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long job_read(void *ctx, void *buf, size_t len)
+{
+    job_io_t *io = ctx;
+    ssize_t n;
+    while ((n = read(io->fd, buf, len)) < 0 && errno == EINTR)
+        ;
+    return (long) n;
+}
+
+static int job_write(void *ctx, const void *buf, size_t len)
+{
+    job_io_t *io = ctx;
+
+    if (len > io->cap - io->len) {
+        size_t cap = io->cap ? io->cap : 4096;
+        while (len > cap - io->len)
+            cap *= 2;
+        char *out = realloc(io->out, cap);
+        if (!out)
+            return -1;
+        io->out = out;
+        io->cap = cap;
+    }
+    memcpy(io->out + io->len, buf, len);
+    io->len += len;
+    return 0;
+}
+
+/* Match @re against each line of @buf, like "grep -q" */
+static bool output_matches(const regex_t *re, char *buf, size_t len)
+{
+    size_t start = 0;
+    while (start <= len) {
+        char *nl = memchr(buf + start, '\n', len - start);
+        size_t end = nl ? (size_t) (nl - buf) : len;
+        char saved = end < len ? buf[end] : '\0';
+
+        /* The capture buffer always has room for the terminator */
+        buf[end] = '\0';
+        int r = regexec(re, buf + start, 0, NULL, 0);
+        if (end < len)
+            buf[end] = saved;
+        if (r == 0)
+            return true;
+        if (!nl)
+            break;
+        start = end + 1;
+    }
+    return false;
+}
+
+/* Prepare @job's pattern, input and VM. The VM in @vm is reset to the
+ * template's state, or cloned and snapshotted on first use; either way it
+ * does its I/O through @jio. Returns 0, or -1 if it fails.
+ */
+static int job_setup(batch_t *b,
+                     job_t *job,
+                     job_io_t *jio,
+                     regex_t *re,
+                     vm_t **vm)
+{
+    vm_io_t io = {
+        .read = job_read,
+        .write = job_write,
+        .ctx = jio,
+        .unbuffered = false,
+    };
+
+    *jio = (job_io_t){.fd = -1};
+    job->passed = false;
+
+    if (regcomp(re, job->pattern, REG_NOSUB) != 0) {
+        fprintf(stderr, "Error: Invalid pattern '%s'\n", job->pattern);
+        return -1;
+    }
+
+    jio->fd = open(job->input, O_RDONLY);
+    if (jio->fd < 0) {
+        fprintf(stderr, "Error: Failed to open file '%s'\n", job->input);
+        regfree(re);
+        return -1;
+    }
+
+    if (*vm && vm_reset(*vm) < 0) {
+        vm_destroy(*vm);
+        *vm = NULL;
+    }
+    if (!*vm) {
+        *vm = vm_clone(b->tmpl, &io);
+        if (*vm)
+            vm_snapshot(*vm); /* Without one, the next job gets a clone */
+    }
+    if (!*vm) {
+        close(jio->fd);
+        regfree(re);
+        return -1;
+    }
+    return 0;
+}
+
+/* Judge @job's output once its VM stopped with @status, and clean up */
+static void job_finish(job_t *job, job_io_t *jio, regex_t *re, int status)
+{
+    /* A job that ran out of budget fails. Otherwise reserve a byte so lines
+     * can be terminated in place while matching.
+     */
+    if (status == VM_YIELD) {
+        fprintf(stderr, "Error: '%s' exceeded its instruction budget\n",
+                job->input);
+    } else if (job_write(jio, "", 1) == 0) {
+        jio->len--;
+        job->passed = output_matches(re, jio->out, jio->len);
+    }
+
+    close(jio->fd);
+    free(jio->out);
+    regfree(re);
+}
+
+/* Run the @n jobs of @group, in lockstep if there are several. They share
+ * one wall time.
+ */
+static void run_jobs(worker_t *w, job_t *const *group, size_t n)
+{
+    double start = now();
+    batch_t *b = w->batch;
+    job_io_t *jio = w->jio;
+    vm_t **vms = w->vms;
+    regex_t re[BATCH_MAX_LANES];
+    job_t *ready[BATCH_MAX_LANES];
+    int status[BATCH_MAX_LANES];
+    size_t nready = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        size_t r = nready;
+        if (job_setup(b, group[i], &jio[r], &re[r], &vms[r]) == 0)
+            ready[nready++] = group[i];
+    }
+
+    if (nready > 1)
+        vm_run_lanes(vms, nready, b->max_insns, status);
+    else if (nready == 1)
+        status[0] = vm_run(vms[0], b->max_insns);
+
+    for (size_t i = 0; i < nready; i++) {
+        job_finish(ready[i], &jio[i], &re[i], status[i]);
+    }
+
+    double wall = now() - start;
+    for (size_t i = 0; i < n; i++)
+        group[i]->wall = wall;
+}
+
+static bool deque_pop(deque_t *dq, size_t *job)
+{
+    bool found = false;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head != dq->tail) {
+        *job = dq->jobs[--dq->tail];
+        found = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static bool deque_steal(deque_t *dq, size_t *job)
+{
+    bool found = false;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head != dq->tail) {
+        *job = dq->jobs[dq->head++];
+        found = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+/* Steal one job from any other worker, starting at a random victim */
+static bool steal_any(worker_t *w, size_t *job)
+{
+    batch_t *b = w->batch;
+    unsigned n = b->nworkers;
+
+    w->seed = w->seed * 1103515245u + 12345u;
+    unsigned first = (w->seed >> 16) % n;
+    for (unsigned i = 0; i < n; i++) {
+        worker_t *victim = &b->workers[(first + i) % n];
+        if (victim != w && deque_steal(&victim->dq, job))
+            return true;
+    }
+    return false;
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *w = arg;
+    batch_t *b = w->batch;
+    job_t *group[BATCH_MAX_LANES];
+    size_t job;
+
+    for (;;) {
+        size_t n = 0;
+        while (n < b->lanes && (deque_pop(&w->dq, &job) || steal_any(w, &job)))
+            group[n++] = &b->jobs[job];
+        if (n == 0)
+            break;
+        run_jobs(w, group, n);
+    }
+
+    for (unsigned i = 0; i < b->lanes; i++)
+        vm_destroy(w->vms[i]);
+    return NULL;
+}
+
+/* Parse @path into b->jobs. Returns 0 or -1. */
+static int load_manifest(batch_t *b, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Error: Failed to open file '%s'\n", path);
+        return -1;
+    }
+
+    char line[4096];
+    size_t cap = 0;
+    while (fgets(line, sizeof(line), file)) {
+        char *p = line, *input, *pattern;
+
+        line[strcspn(line, "\r\n")] = '\0';
+        while (isspace((unsigned char) *p))
+            p++;
+        if (*p == '\0' || *p == '#')
+            continue;
+
+        input = p;
+        while (*p && !isspace((unsigned char) *p))
+            p++;
+        if (*p)
+            *p++ = '\0';
+        while (isspace((unsigned char) *p))
+            p++;
+        pattern = p;
+        for (char *e = p + strlen(p); e > p && isspace((unsigned char) e[-1]);)
+            *--e = '\0';
+
+        if (b->njobs == cap) {
+            cap = cap ? 2 * cap : 64;
+            job_t *jobs = realloc(b->jobs, cap * sizeof(*jobs));
+            if (!jobs)
+                goto fail;
+            b->jobs = jobs;
+        }
+
+        job_t *job = &b->jobs[b->njobs];
+        job->input = strdup(input);
+        job->pattern = strdup(pattern);
+        if (!job->input || !job->pattern) {
+            free(job->input);
+            free(job->pattern);
+            goto fail;
+        }
+        b->njobs++;
+    }
+
+    if (ferror(file))
+        goto fail;
+    fclose(file);
+    return 0;
+
+fail:
+    fprintf(stderr, "Error: Failed to read manifest '%s'\n", path);
+    fclose(file);
+    return -1;
+}
+
+int batch_run(const vm_t *tmpl,
+              const char *manifest,
+              unsigned threads,
+              uint64_t max_insns,
+              unsigned lanes)
+{
+    batch_t b = {.tmpl = tmpl, .max_insns = max_insns, .lanes = lanes};
+    int status = -1;
+
+    if (load_manifest(&b, manifest) < 0)
+        goto out;
+
+    if (b.lanes < 1)
+        b.lanes = 1;
+    if (b.lanes > BATCH_MAX_LANES)
+        b.lanes = BATCH_MAX_LANES;
+
+    if (threads == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = ncpu > 0 ? (unsigned) ncpu : 1;
+    }
+    if (threads > b.njobs)
+        threads = b.njobs ? (unsigned) b.njobs : 1;
+
+    b.nworkers = threads;
+    b.workers = calloc(threads, sizeof(*b.workers));
+    if (!b.workers)
+        goto out;
+
+    /* Deal jobs round-robin so every worker starts with local work */
+    for (unsigned i = 0; i < threads; i++) {
+        worker_t *w = &b.workers[i];
+        w->batch = &b;
+        w->seed = i + 1;
+        w->dq.jobs = malloc((b.njobs / threads + 1) * sizeof(size_t));
+        if (!w->dq.jobs)
+            goto out;
+        pthread_mutex_init(&w->dq.lock, NULL);
+    }
+    for (size_t j = 0; j < b.njobs; j++) {
+        deque_t *dq = &b.workers[j % threads].dq;
+        dq->jobs[dq->tail++] = j;
+    }
+
+    double start = now();
+    unsigned started = 0;
+    for (; started < threads; started++) {
+        worker_t *w = &b.workers[started];
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0)
+            break;
+    }
+    if (started == 0) /* No pool at all: run everything here */
+        worker_main(&b.workers[0]);
+    for (unsigned i = 0; i < started; i++)
+        pthread_join(b.workers[i].thread, NULL);
+    double wall = now() - start;
+
+    size_t passed = 0;
+    for (size_t j = 0; j < b.njobs; j++) {
+        job_t *job = &b.jobs[j];
+        printf("Running %s ... %s %9.3f ms\n", job->input,
+               job->passed ? "[OK]  " : "[FAIL]", job->wall * 1e3);
+        passed += job->passed;
+    }
+    printf("%zu/%zu passed in %.3f ms on %u threads\n", passed, b.njobs,
+           wall * 1e3, threads);
+    status = passed == b.njobs ? 0 : 1;
+
+out:
+    if (b.workers) {
+        for (unsigned i = 0; i < b.nworkers; i++) {
+            if (b.workers[i].dq.jobs)
+                pthread_mutex_destroy(&b.workers[i].dq.lock);
+            free(b.workers[i].dq.jobs);
+        }
+        free(b.workers);
+    }
+    for (size_t j = 0; j < b.njobs; j++) {
+        free(b.jobs[j].input);
+        free(b.jobs[j].pattern);
+    }
+    free(b.jobs);
+    return status;
+}
@@ -0,0 +1,30 @@
+/*
+ * batch.h - Parallel batch runner for the SUBLEQ virtual machine.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "subleq.h"
+
+/* Run every job listed in @manifest against clones of @tmpl, a loaded and
+ * decoded VM, on a work-stealing pool of @threads threads (0 picks one per
+ * online CPU). A job still running after @max_insns instructions (0 for no
+ * limit) is stopped and fails. Each worker runs @lanes jobs at a time (at
+ * most 64) in SIMD lockstep; 0 or 1 runs them one by one.
+ *
+ * Each manifest line names an input file followed by a pattern. A job
+ * passes when any line of its output matches the pattern as a POSIX basic
+ * regular expression, as "grep -q" would. Blank lines and lines starting
+ * with '#' are ignored.
+ *
+ * Per-job results and wall times are printed to stdout in manifest order.
+ * Returns 0 if every job passed, 1 if any failed, or -1 on setup errors.
+ */
+int batch_run(const vm_t *tmpl,
+              const char *manifest,
+              unsigned threads,
+              uint64_t max_insns,
+              unsigned lanes);
+
+#endif /* BATCH_H */
@@ -0,0 +1,216 @@
+/*
+ * main.c - Command line front end for the SUBLEQ virtual machine.
+ *
+ * Loads an eForth image, decodes it and runs it on standard input and
+ * output using libsubleq.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "batch.h"
+#include "server.h"
+#include "subleq.h"
+
+/* Wall clock in seconds, for timing what the VM cannot time itself */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s <subleq.dec> [-O] [-s] [-p] [-D] [-b file]\n",
+            prog);
+    fprintf(stderr, "       %s <subleq.dec> --batch manifest [-j threads]\n",
+            prog);
+    fprintf(stderr, "       %s <subleq.dec> -S socket\n", prog);
+    fprintf(stderr, "       %s --trace-stats trace.bin\n", prog);
+    fprintf(stderr, "  -O    Disable optimization\n");
+    fprintf(stderr, "  --opt-threads  Threads for the optimizer pass\n");
+    fprintf(stderr, "  -s    Enable statistics\n");
+    fprintf(stderr, "  -p    Enable lightweight profiler\n");
+    fprintf(stderr, "  -P    Enable sampling profiler (replaces -p)\n");
+    fprintf(stderr, "  --folded  Write Forth call stacks for flamegraph.pl"
+                    " (implies -P unless -p)\n");
+    fprintf(stderr, "  --stats-json  Write statistics to file as JSON\n");
+    fprintf(stderr, "  --perf  Sample hardware counters per opcode"
+                    " (implies -s)\n");
+    fprintf(stderr, "  --mine  Report the N hottest unfused SUBLEQ runs"
+                    " (implies -s)\n");
+    fprintf(stderr, "  --live  Print live counters to stderr on SIGUSR1\n");
+    fprintf(stderr, "  -t    Record executed branches to file\n");
+    fprintf(stderr, "  -D    Enable memory-mapped devices\n");
+    fprintf(stderr, "  --max-insns  Stop after about this many instructions\n");
+    fprintf(stderr, "  -b    Back the block device with file (implies -D)\n");
+    fprintf(stderr, "  --batch  Run each 'input pattern' manifest entry\n");
+    fprintf(stderr, "  -j    Batch worker threads (default: one per CPU)\n");
+    fprintf(stderr, "  --lanes  Batch jobs per worker run in lockstep\n");
+    fprintf(stderr, "  -S    Serve a VM per connection on a UNIX socket\n");
+    fprintf(stderr, "  --cpus  Run on N CPUs sharing memory (experimental)\n");
+}
+
+int main(int argc, char **argv)
+{
+    vm_config_t cfg = {
+        .optimize = true,
+        .opt_threads = 1,
+        .stats = false,
+        .profiler = false,
+        .sampler = false,
+        .perf = false,
+        .mine = 0,
+        .live = false,
+        .devices = false,
+        .block_file = NULL,
+        .trace_file = NULL,
+        .io = NULL,
+    };
+
+    const char *image_file = NULL;
+    const char *manifest = NULL;
+    const char *socket_path = NULL;
+    const char *folded_file = NULL;
+    const char *json_file = NULL;
+    const char *trace_stats = NULL;
+    unsigned threads = 0;
+    unsigned lanes = 1;
+    unsigned cpus = 1;
+    uint64_t max_insns = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-O")) /* Disable optimization */
+            cfg.optimize = false;
+        else if (!strcmp(argv[i], "--opt-threads") && i + 1 < argc)
+            cfg.opt_threads = (unsigned) strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-s")) /* Enable statistics */
+            cfg.stats = true;
+        else if (!strcmp(argv[i], "-p")) /* Enable lightweight profiler */
+            cfg.profiler = true;
+        else if (!strcmp(argv[i], "-P")) /* Enable sampling profiler */
+            cfg.sampler = true;
+        else if (!strcmp(argv[i], "--folded") && i + 1 < argc) /* Stacks */
+            folded_file = argv[++i];
+        else if (!strcmp(argv[i], "--stats-json") && i + 1 < argc) /* JSON */
+            json_file = argv[++i];
+        else if (!strcmp(argv[i], "--perf")) /* Hardware counters */
+            cfg.stats = cfg.perf = true;
+        else if (!strcmp(argv[i], "--mine") && i + 1 < argc) { /* Miner */
+            cfg.mine = (unsigned) strtoul(argv[++i], NULL, 0);
+            cfg.stats |= cfg.mine > 0;
+        } else if (!strcmp(argv[i], "--live")) /* Dump on SIGUSR1 */
+            cfg.live = true;
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc) /* Trace file */
+            cfg.trace_file = argv[++i];
+        else if (!strcmp(argv[i], "--trace-stats") && i + 1 < argc)
+            trace_stats = argv[++i];
+        else if (!strcmp(argv[i], "-D")) /* Enable memory-mapped devices */
+            cfg.devices = true;
+        else if (!strcmp(argv[i], "--max-insns") && i + 1 < argc)
+            max_insns = strtoull(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-b") && i + 1 < argc) /* Block file */
+            cfg.block_file = argv[++i];
+        else if (!strcmp(argv[i], "--batch") && i + 1 < argc) /* Manifest */
+            manifest = argv[++i];
+        else if (!strcmp(argv[i], "-S") && i + 1 < argc) /* Server socket */
+            socket_path = argv[++i];
+        else if (!strcmp(argv[i], "-j") && i + 1 < argc) /* Batch threads */
+            threads = (unsigned) strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "--lanes") && i + 1 < argc) /* Lockstep */
+            lanes = (unsigned) strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "--cpus") && i + 1 < argc) /* SMP mode */
+            cpus = (unsigned) strtoul(argv[++i], NULL, 0);
+        else if (!image_file) /* Image file path */
+            image_file = argv[i];
+        else
+            fprintf(stderr, "Warning: Ignoring extra argument '%s'\n", argv[i]);
+    }
+
+    if (trace_stats) /* Offline: no image to run */
+        return vm_trace_stats(trace_stats, stdout) < 0 ? 1 : 0;
+
+    if (!image_file) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (cpus > 1 && max_insns) {
+        fprintf(stderr, "Error: --max-insns does not apply with --cpus\n");
+        return 1;
+    }
+
+    if (folded_file && !cfg.profiler)
+        cfg.sampler = true;
+
+    vm_t *vm = vm_create(&cfg);
+    if (!vm)
+        return 1;
+
+    int load = vm_load_image(vm, image_file);
+    if (load < 0) {
+        vm_destroy(vm);
+        return load == -2 ? 2 : 1;
+    }
+
+    if (!cfg.optimize)
+        fprintf(stderr,
+                "Optimizations disabled. Running as basic interpreter.\n");
+    if (vm_optimize(vm) < 0) {
+        vm_destroy(vm);
+        return 1;
+    }
+
+    if (socket_path) {
+        server_run(vm, socket_path, 0, max_insns);
+        vm_destroy(vm);
+        return 1;
+    }
+
+    if (manifest) {
+        int status = batch_run(vm, manifest, threads, max_insns, lanes);
+        vm_destroy(vm);
+        return status < 0 ? 1 : status;
+    }
+
+    int status = cpus > 1 ? vm_run_smp(vm, cpus) : vm_run(vm, max_insns);
+    if (status == VM_YIELD) {
+        fprintf(stderr, "Error: Stopped after %" PRIu64 " instructions\n",
+                max_insns);
+        status = VM_ERROR;
+    }
+    if (cfg.stats && vm_report_stats(vm, stderr) < 0)
+        status = -1; /* Indicate error if stats reporting fails */
+    if (json_file) {
+        FILE *out = fopen(json_file, "w");
+        if (!out)
+            fprintf(stderr, "Error: Failed to open '%s'\n", json_file);
+        if (!out || vm_report_json(vm, out) < 0)
+            status = -1;
+        if (out && fclose(out) < 0)
+            status = -1;
+    }
+    if (folded_file) {
+        FILE *out = fopen(folded_file, "w");
+        if (!out)
+            fprintf(stderr, "Error: Failed to open '%s'\n", folded_file);
+        if (!out || vm_report_folded(vm, out) < 0)
+            status = -1;
+        if (out && fclose(out) < 0)
+            status = -1;
+    }
+
+    double wall = now();
+    clock_t cpu = clock();
+    vm_destroy(vm);
+    if (cfg.stats)
+        fprintf(stderr, "Teardown: %.3f ms wall, %.3f ms CPU\n",
+                1e3 * (now() - wall),
+                1e3 * (double) (clock() - cpu) / CLOCKS_PER_SEC);
+    return status;
+}
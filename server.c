@@ -0,0 +1,314 @@
+/*
+ * server.c - Serve one VM per connection on a UNIX domain socket.
+ *
+ * Everything runs on one thread around poll(). Each connection owns a VM
+ * cloned from a template booted up to its first read, so a new session
+ * costs a clone rather than a load, optimize and boot. VMs read from their
+ * socket without blocking: with nothing to read they suspend and leave the
+ * loop until poll() reports input. Output is queued per connection and
+ * drained as the socket accepts it; a VM whose client falls behind is not
+ * run until the queue shrinks. Runnable VMs are served round-robin in
+ * bounded slices, so a busy session cannot starve the others.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.h"
+
+/* Default instructions per turn of a runnable VM */
+#define SERVER_SLICE 100000
+
+/* A VM is not run while more output than this is waiting to be sent */
+#define SERVER_OUT_MAX 65536
+
+typedef struct {
+    int fd;      /* Connection, -1 for the boot VM */
+    vm_t *vm;    /* Session VM */
+    char *out;   /* Queued output; unsent bytes are out[off..len) */
+    size_t off, len, cap;
+    uint64_t ran; /* Instructions run since the VM last waited for input */
+    bool waiting; /* VM is suspended until input arrives */
+    bool done;    /* VM has finished; close once output is sent */
+} client_t;
+
+/* Input callback of the boot VM: there never is any */
+static long boot_read(void *ctx, void *buf, size_t len)
+{
+    (void) ctx;
+    (void) buf;
+    (void) len;
+    return VM_IO_AGAIN;
+}
+
+static long client_read(void *ctx, void *buf, size_t len)
+{
+    client_t *c = ctx;
+    ssize_t n;
+    while ((n = recv(c->fd, buf, len, 0)) < 0 && errno == EINTR)
+        ;
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? VM_IO_AGAIN : -1;
+    return (long) n;
+}
+
+/* Output callback: queue the bytes, the event loop sends them */
+static int client_write(void *ctx, const void *buf, size_t len)
+{
+    client_t *c = ctx;
+
+    if (c->off > 0 && len > c->cap - c->len) { /* Reclaim sent bytes */
+        memmove(c->out, c->out + c->off, c->len - c->off);
+        c->len -= c->off;
+        c->off = 0;
+    }
+    if (len > c->cap - c->len) {
+        size_t cap = c->cap ? c->cap : 4096;
+        while (len > cap - c->len)
+            cap *= 2;
+        char *out = realloc(c->out, cap);
+        if (!out)
+            return -1;
+        c->out = out;
+        c->cap = cap;
+    }
+    memcpy(c->out + c->len, buf, len);
+    c->len += len;
+    return 0;
+}
+
+/* Send as much queued output as the socket takes. Returns 0 or -1. */
+static int client_flush(client_t *c)
+{
+    while (c->off < c->len) {
+        ssize_t n = send(c->fd, c->out + c->off, c->len - c->off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        c->off += (size_t) n;
+    }
+    c->off = c->len = 0;
+    return 0;
+}
+
+static void client_free(client_t *c)
+{
+    if (c->fd >= 0)
+        close(c->fd);
+    vm_destroy(c->vm);
+    free(c->out);
+    free(c);
+}
+
+static bool client_runnable(const client_t *c)
+{
+    return !c->done && !c->waiting && c->len - c->off <= SERVER_OUT_MAX;
+}
+
+/* Accept a connection on @lfd and give it a session cloned from @booted,
+ * greeted with @boot's output. Returns the client or NULL.
+ */
+static client_t *client_accept(int lfd, const client_t *boot)
+{
+    int fd = accept(lfd, NULL, NULL);
+    if (fd < 0)
+        return NULL;
+
+    client_t *c = calloc(1, sizeof(*c));
+    if (!c) {
+        close(fd);
+        return NULL;
+    }
+    c->fd = fd;
+
+    vm_io_t io = {
+        .read = client_read,
+        .write = client_write,
+        .ctx = c,
+        .unbuffered = false,
+    };
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0 ||
+        client_write(c, boot->out, boot->len) < 0 ||
+        !(c->vm = vm_clone(boot->vm, &io))) {
+        client_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+/* Create the listening socket at @path, replacing a stale socket there */
+static int server_listen(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct stat st;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path too long '%s'\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0 ||
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        fprintf(stderr, "Error: Failed to listen on '%s'\n", path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int server_run(const vm_t *tmpl, const char *path, uint64_t slice,
+               uint64_t limit)
+{
+    client_t boot = {.fd = -1};
+    client_t **clients = NULL;
+    struct pollfd *pfds = NULL;
+    size_t nclients = 0, cap = 0;
+    int lfd = -1;
+
+    if (slice == 0)
+        slice = SERVER_SLICE;
+
+    /* Boot once, up to the first read, and keep what it printed */
+    vm_io_t io = {
+        .read = boot_read,
+        .write = client_write,
+        .ctx = &boot,
+        .unbuffered = false,
+    };
+    boot.vm = vm_clone(tmpl, &io);
+    if (!boot.vm)
+        goto out;
+    if (vm_run(boot.vm, 0) != VM_NEED_INPUT) {
+        fprintf(stderr, "Error: Image stopped before reading input\n");
+        goto out;
+    }
+
+    lfd = server_listen(path);
+    if (lfd < 0)
+        goto out;
+
+    for (;;) {
+        /* Make room for the listener, every client and one more client */
+        if (nclients + 1 >= cap) {
+            size_t ncap = cap ? 2 * cap : 64;
+            client_t **nc = realloc(clients, ncap * sizeof(*nc));
+            if (nc)
+                clients = nc;
+            struct pollfd *np = realloc(pfds, (ncap + 1) * sizeof(*np));
+            if (np)
+                pfds = np;
+            if (!nc || !np) {
+                fprintf(stderr, "Error: Out of memory\n");
+                goto out;
+            }
+            cap = ncap;
+        }
+
+        bool busy = false;
+        pfds[0] = (struct pollfd){.fd = lfd, .events = POLLIN};
+        for (size_t i = 0; i < nclients; i++) {
+            client_t *c = clients[i];
+            short events = 0;
+            if (c->waiting)
+                events |= POLLIN;
+            if (c->off < c->len)
+                events |= POLLOUT;
+            pfds[i + 1] = (struct pollfd){.fd = c->fd, .events = events};
+            busy |= client_runnable(c);
+        }
+
+        if (poll(pfds, nclients + 1, busy ? 0 : -1) < 0 && errno != EINTR) {
+            fprintf(stderr, "Error: poll failed\n");
+            goto out;
+        }
+
+        /* Deliver readiness, then give every runnable VM one slice */
+        for (size_t i = 0; i < nclients; i++) {
+            client_t *c = clients[i];
+            short rev = pfds[i + 1].revents;
+            bool failed = false;
+
+            if (c->waiting && (rev & (POLLIN | POLLHUP | POLLERR)))
+                c->waiting = false;
+            if (rev & (POLLOUT | POLLERR))
+                failed = client_flush(c) < 0;
+
+            if (!failed && client_runnable(c)) {
+                uint64_t budget = slice;
+                if (limit && limit - c->ran < budget)
+                    budget = limit - c->ran;
+                switch (vm_run(c->vm, budget)) {
+                case VM_YIELD:
+                    c->ran += budget;
+                    if (limit && c->ran >= limit) {
+                        fprintf(stderr, "Error: Session ran %" PRIu64
+                                " instructions without reading, closing it\n",
+                                c->ran);
+                        c->done = true;
+                    }
+                    break;
+                case VM_NEED_INPUT:
+                    c->waiting = true;
+                    c->ran = 0;
+                    break;
+                default: /* Halted, failed or the client hung up */
+                    c->done = true;
+                    break;
+                }
+                failed = client_flush(c) < 0;
+            }
+
+            if (failed || (c->done && c->off == c->len)) {
+                client_free(c);
+                clients[i] = NULL;
+            }
+        }
+
+        /* Drop closed connections, keeping the rest in order */
+        size_t kept = 0;
+        for (size_t i = 0; i < nclients; i++) {
+            if (clients[i])
+                clients[kept++] = clients[i];
+        }
+        nclients = kept;
+
+        if (pfds[0].revents & POLLIN) {
+            client_t *c = client_accept(lfd, &boot);
+            if (c)
+                clients[nclients++] = c;
+        }
+    }
+
+out:
+    for (size_t i = 0; i < nclients; i++)
+        client_free(clients[i]);
+    free(clients);
+    free(pfds);
+    if (lfd >= 0) {
+        close(lfd);
+        unlink(path);
+    }
+    vm_destroy(boot.vm);
+    free(boot.out);
+    return -1;
+}
@@ -0,0 +1,29 @@
+/*
+ * server.h - UNIX domain socket server for the SUBLEQ virtual machine.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "subleq.h"
+
+/* Serve interactive sessions on a UNIX domain socket bound at @path.
+ *
+ * @tmpl, a loaded and decoded VM, is first booted on a clone until it waits
+ * for input; whatever it printed meanwhile is kept as the greeting. Every
+ * connection then gets its own VM cloned from that booted state, with input
+ * and output wired to the socket, and starts by receiving the greeting.
+ *
+ * A single thread multiplexes all connections with poll(). Runnable VMs take
+ * turns of at most @slice instructions (0 picks a default), and a VM that
+ * waits for input or whose client is slow to read costs nothing until its
+ * socket is ready. A connection is closed once its VM halts or fails, which
+ * includes the client closing its end, or, if @limit is not 0, once it runs
+ * about @limit instructions without waiting for input.
+ *
+ * Only returns on setup errors, with -1.
+ */
+int server_run(const vm_t *tmpl, const char *path, uint64_t slice,
+               uint64_t limit);
+
+#endif /* SERVER_H */
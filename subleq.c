@@ -5,7 +5,16 @@
  * Branch if Less than or Equal to zero) machine. It includes an optimizer
  * to convert common SUBLEQ instruction sequences into single, faster
  * extended operations for improved performance with programs like eForth.
+ *
+ * It builds as libsubleq; see subleq.h for the embedding API and main.c for
+ * the command line front end.
+ */
+
+/* Expose POSIX interfaces (fileno, poll, read) under -std=c99, and
+ * madvise() hints on glibc
  */
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
 
 #include <assert.h>
 #include <ctype.h>
@@ -20,6 +29,8 @@
 #include <string.h>
 #include <time.h>
 
+#include "subleq.h"
+
 /* Platform detection for POSIX systems (Unix, macOS, etc.) */
 #if defined(unix) || defined(__unix__) || defined(__unix) || \
     (defined(__APPLE__) && defined(__MACH__))
@@ -28,11 +39,25 @@
 
 /* Include POSIX-specific headers for terminal control */
 #ifdef PLAT_POSIX
+#include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <termios.h>
 #include <unistd.h>
 #endif
 
+/* Hardware performance counters (--perf) need perf_event_open() */
+#ifdef __linux__
+#define PLAT_LINUX
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
 /* Tail-call optimization attribute */
 #if defined(__has_attribute) && __has_attribute(musttail)
 #define MUST_TAIL __attribute__((musttail))
@@ -43,11 +68,13 @@
 /* Compiler-specific attributes for optimization */
 #if defined(__clang__) || defined(__GNUC__)
 #define HOT_PATH __attribute__((hot))
+#define COLD_PATH __attribute__((cold, noinline))
 #define UNLIKELY(x) __builtin_expect(!!(x), 0)
 #define LIKELY(x) __builtin_expect(!!(x), 1)
 #define UNREACHABLE __builtin_unreachable()
 #else
 #define HOT_PATH
+#define COLD_PATH
 #define UNLIKELY(x) (x)
 #define LIKELY(x) (x)
 #define UNREACHABLE \
@@ -55,6 +82,16 @@
     } while (0)
 #endif
 
+/* Instruction handlers share a section, so the host pcs --perf samples
+ * can be told apart from the rest of the program
+ */
+#ifdef PLAT_LINUX
+#define HANDLER_SECTION __attribute__((section("subleq_handlers")))
+extern const char __start_subleq_handlers[], __stop_subleq_handlers[];
+#else
+#define HANDLER_SECTION
+#endif
+
 #if defined(__GNUC__) || defined(__clang__)
 #define HAS_BUILTIN_CONSTANT_P 1
 #define IS_COMPILE_TIME_CONSTANT(x) __builtin_constant_p(x)
@@ -76,79 +113,118 @@
 /* Maximum depth for optimizer pattern scanning */
 #define OPTIMIZER_SCAN_DEPTH (3 * 64)
 
+/* Smallest address range worth giving its own optimizer thread */
+#define OPTIMIZER_MIN_CHUNK 4096
+
 /* Profiler constants */
 #define MAX_HOT_SPOTS 64
 
-/* Pattern analysis constants - these represent the structure of specific
- * SUBLEQ instruction sequences that the optimizer recognizes */
-#define SUBLEQ_INSN_SIZE 3 /* Each SUBLEQ instruction uses 3 memory words */
+/* Sampling profiler period in microseconds of CPU time */
+#define SAMPLE_USEC 1000
 
-/* Calculate pattern-specific jump target offsets based on instruction structure
+/* Forth word profile: return addresses kept per stack sample, instructions
+ * between the counting profiler's stack samples (prime, so loops do not
+ * alias with it), distinct stacks kept, and the shortest dictionary chain
+ * taken for real headers rather than stray data
  */
-#define ILOAD_PATTERN_JUMP_OFFSET 15 /* Original: i + 15 */
-#define IJMP_PATTERN_JUMP_OFFSET 14  /* Original: i + (3 * 4) + 2 = i + 14 */
-#define LDINC_INCREMENT_OFFSET 24    /* Original: 24 (ILOAD pattern size) */
+#define WORDS_MAX_DEPTH 32
+#define WORDS_STRIDE 1009
+#define WORDS_MAX_STACKS 65536
+#define WORDS_MIN_CHAIN 8
 
-#ifdef PLAT_POSIX
-/* Read a character from input. For interactive terminals, this function uses
- * poll() to block indefinitely until input is available.
+/* Unfused-sequence miner: longest run of plain SUBLEQ instructions mined
+ * as one sequence, and distinct sequences kept
  */
-static int vm_getch(FILE *in)
-{
-    int fd = fileno(in);
-    if (!isatty(fd))
-        return fgetc(in);
+#define MINE_MAX_LEN 8
+#define MINE_SLOTS 4096
 
-    struct pollfd pfd = {.fd = fd, .events = POLLIN};
-    int n;
+/* SMP mode: CPUs per machine, and instructions between checks for
+ * shutdown on the secondary CPUs
+ */
+#define SMP_MAX_CPUS 64
+#define SMP_SLICE 10000
 
-    /* Use poll with a timeout of -1 to wait indefinitely for input. */
-    while ((n = poll(&pfd, 1, -1)) < 0) {
-        if (errno != EAGAIN && errno != EINTR)
-            return -1; /* A real error occurred */
-        /* If interrupted by a signal, just poll again. */
-    }
+/* Hardware counters sampled per opcode, and the pages of their shared
+ * sample buffer (a power of two), drained whenever it is half full
+ */
+#define PERF_EVENTS 4
+#define PERF_RING_PAGES 64
 
-    if (n == 0)
-        return -1; /* Timeout (shouldn't happen with -1) */
+/* Execution trace: bytes buffered before they are written, instructions
+ * between memory checkpoints, and the file's magic number
+ */
+#define TRACE_BUF_SIZE 65536
+#define TRACE_MEM_INSNS (1ULL << 24)
+#define TRACE_MAGIC "SQTR"
+#define TRACE_VERSION 1
 
-    /* If we are here, poll() returned > 0, so data is ready. */
-    unsigned char ch;
-    ssize_t bytes_read = read(fd, &ch, 1);
-    if (bytes_read == 1)
-        return ch;
-    if (bytes_read == 0)
-        return EOF; /* EOF */
+/* Trace records. A record opens with a varint: even for a taken branch,
+ * else one of these.
+ */
+#define TRACE_RUN 1 /* vm_run() starts: pc, instructions so far */
+#define TRACE_MEM 3 /* Memory checkpoint: instructions, pc, changed cells */
+#define TRACE_END 5 /* vm_run() ends: pc, instructions since last branch */
+#define TRACE_REPEAT 7 /* The last branch, as often again as given */
 
-    return -1; /* Read error */
-}
+/* Input ring buffer capacity in bytes (must be a power of two) */
+#define INPUT_BUF_SIZE 4096
+#define INPUT_BUF_MASK (INPUT_BUF_SIZE - 1)
 
-/* Write a character to output stream, flushing for TTY */
-static int vm_putch(int ch, FILE *out)
-{
-    if (fputc(ch, out) < 0)
-        return -1;
-    if (isatty(fileno(out)))
-        fflush(out);
-    return ch;
-}
-#else
-/* Fallback for non-POSIX systems */
-static int vm_getch(FILE *in)
-{
-    int ch = fgetc(in);
-    return (ch == EOF) ? -1 : ch;
-}
+/* Output buffer capacity in bytes */
+#define OUTPUT_BUF_SIZE 4096
 
-static int vm_putch(int ch, FILE *out)
-{
-    if (fputc(ch, out) < 0)
-        return -1;
-    if (fflush(out) < 0)
-        return -1;
-    return ch;
-}
-#endif
+/* Decoded code is tracked in pages of 512 entries (4 KiB) */
+#define CODE_PAGE_BITS 9
+#define CODE_PAGE_SIZE (1U << CODE_PAGE_BITS)
+#define CODE_PAGES (SZ >> CODE_PAGE_BITS)
+
+/* Pattern analysis constants - these represent the structure of specific
+ * SUBLEQ instruction sequences that the optimizer recognizes */
+#define SUBLEQ_INSN_SIZE 3 /* Each SUBLEQ instruction uses 3 memory words */
+
+/* Calculate pattern-specific jump target offsets based on instruction structure
+ */
+#define ILOAD_PATTERN_JUMP_OFFSET 15 /* Original: i + 15 */
+#define IJMP_PATTERN_JUMP_OFFSET 14  /* Original: i + (3 * 4) + 2 = i + 14 */
+#define LDINC_INCREMENT_OFFSET 24    /* Original: 24 (ILOAD pattern size) */
+
+/* Memory-mapped devices occupy the top page of memory, above anything the
+ * eForth image loads or executes. Outputting a device command cell
+ * (SUBLEQ CMD, -1) runs the device operation instead of printing a byte.
+ */
+#define DEV_BASE 0xFF00
+#define DEV_LINE_CMD (DEV_BASE + 0x00)   /* Read one line of input */
+#define DEV_LINE_ADDR (DEV_BASE + 0x01)  /* Destination buffer address */
+#define DEV_LINE_SIZE (DEV_BASE + 0x02)  /* Buffer capacity in characters */
+#define DEV_LINE_LEN (DEV_BASE + 0x03)   /* Characters stored, -1 on EOF */
+#define DEV_LINE_FLAGS (DEV_BASE + 0x04) /* DEV_F_* transfer flags */
+#define DEV_TYPE_CMD (DEV_BASE + 0x08)   /* Write a string to output */
+#define DEV_TYPE_ADDR (DEV_BASE + 0x09)  /* Source buffer address */
+#define DEV_TYPE_LEN (DEV_BASE + 0x0A)   /* String length in characters */
+#define DEV_TYPE_FLAGS (DEV_BASE + 0x0B) /* DEV_F_* transfer flags */
+#define DEV_BLK_CMD (DEV_BASE + 0x10)    /* Block operation (DEV_BLK_*) */
+#define DEV_BLK_NUM (DEV_BASE + 0x11)    /* Block number */
+#define DEV_BLK_ADDR (DEV_BASE + 0x12)   /* Block buffer address */
+#define DEV_BLK_STATUS (DEV_BASE + 0x13) /* 0 on success, -1 on failure */
+#define DEV_CPU_CMD (DEV_BASE + 0x18)    /* Start a secondary CPU */
+#define DEV_CPU_ID (DEV_BASE + 0x19)     /* Reads as the running CPU */
+#define DEV_CPU_COUNT (DEV_BASE + 0x1A)  /* Number of CPUs */
+#define DEV_CPU_NUM (DEV_BASE + 0x1B)    /* CPU to start */
+#define DEV_CPU_PC (DEV_BASE + 0x1C)     /* Its entry point */
+#define DEV_CPU_STATUS (DEV_BASE + 0x1D) /* 0 on success, -1 on failure */
+
+#define DEV_F_PACKED 0x1 /* Two characters per cell, low byte first */
+
+/* Block device operations, stored in DEV_BLK_CMD before it is output */
+#define DEV_BLK_READ 1  /* Copy block into buffer */
+#define DEV_BLK_WRITE 2 /* Copy buffer into block */
+#define DEV_BLK_FLUSH 3 /* Write the backing file to disk */
+
+/* A block holds 1024 characters, two per cell, stored as little-endian
+ * 16-bit cells in the backing file.
+ */
+#define BLOCK_CELLS 512
+#define BLOCK_BYTES (2 * BLOCK_CELLS)
 
 /* Extended instruction set with increment values */
 #define INSN_LIST \
@@ -172,7 +248,9 @@ static int vm_putch(int ch, FILE *out)
     _(NEG, 6)     \
     _(LSHIFT, 9)  \
     _(DOUBLE, 9)  \
-    _(LDINC, 27)
+    _(LDINC, 27)  \
+    _(DEV, 3)     \
+    _(ATOMIC, 3)
 
 /* clang-format off */
 enum {
@@ -195,6 +273,12 @@ static const char *insn_names[] = {
 #undef _
 };
 
+static const uint8_t insn_incr[] = {
+#define _(inst, inc) inc,
+    INSN_LIST
+#undef _
+};
+
 /* Optimized instruction structure */
 typedef struct {
     uint8_t opcode; /* Instruction opcode (from INSN_LIST) */
@@ -204,6 +288,16 @@ typedef struct {
     uint16_t aux;   /* Auxiliary operand (e.g., SUBLEQ jump target) */
 } insn_t;
 
+/* Decoded program, shared by every VM cloned from the same template. Each
+ * VM executes from its own copy-on-write view of it, so a VM that changes an
+ * entry only ever copies the page holding it.
+ */
+typedef struct {
+    unsigned refs; /* VMs referencing this code */
+    int fd;        /* Shared memory object backing @insn, -1 if none */
+    insn_t *insn;  /* One decoded entry per memory word */
+} code_t;
+
 /* Hot spot tracking for profiler */
 typedef struct {
     uint64_t pc;         /* Program counter address */
@@ -212,24 +306,91 @@ typedef struct {
     uint8_t _pad[7];     /* Padding for 64-byte cache line alignment */
 } hot_spot_t;
 
+/* A distinct Forth call stack: the instruction pointer, then the return
+ * addresses under it, innermost first, as raw cell values
+ */
+typedef struct {
+    uint64_t count; /* Times it was sampled */
+    uint32_t off;   /* First cell in forth_prof_t.cells */
+    uint32_t depth; /* Cells, the instruction pointer included */
+} fstack_t;
+
+/* Forth-level profile. The image's inner interpreter keeps its instruction
+ * and return stack pointers in memory cells; once those are located, each
+ * sample records the stack they describe, and the dictionary names its
+ * cells at report time, when every word the program defined is in memory.
+ */
+typedef struct {
+    bool searched;      /* words_locate() ran */
+    bool located;       /* @ip and @rp were found in the decoded code */
+    bool push_first;    /* A call moves rp before storing through it */
+    int rdir;           /* 1 if the return stack grows upward, else -1 */
+    uint16_t ip, rp;    /* Cells holding the two pointers */
+    uint16_t rp0;       /* Return stack pointer when located */
+    uint64_t countdown; /* Instructions to the next stack sample */
+    fstack_t *stacks;   /* Distinct stacks seen */
+    size_t nstacks, stacks_cap;
+    uint32_t *index;    /* Open hash of @stacks, entries are index + 1 */
+    size_t index_cap;
+    uint16_t *cells;    /* Cells of every stack in @stacks */
+    size_t ncells, cells_cap;
+    uint64_t dropped;   /* Samples of stacks past WORDS_MAX_STACKS */
+} forth_prof_t;
+
+/* A distinct run of plain SUBLEQ instructions in pattern DSL form */
+typedef struct {
+    char pattern[4 * MINE_MAX_LEN]; /* "0Z> 11> ...", empty if unused */
+    unsigned len;                   /* Instructions */
+    uint64_t count;                 /* Times the run executed */
+} mine_seq_t;
+
+/* Unfused-sequence miner state */
+typedef struct {
+    unsigned top;               /* Sequences to report */
+    uint64_t run[MINE_MAX_LEN]; /* Plain SUBLEQ pcs executed in a row */
+    unsigned len;               /* Entries in @run */
+    mine_seq_t *seqs;           /* Open hash of MINE_SLOTS sequences */
+    uint64_t dropped;           /* Runs that found the table full */
+} miner_t;
+
 /* Lightweight profiler state */
 typedef struct {
     bool enabled;                        /* Profiler enabled flag */
+    bool mining;                         /* Unfused-sequence miner on */
+    bool hooked;                         /* Either of the two above */
     uint64_t total_instructions;         /* Total instruction count */
-    uint64_t memory_accesses;            /* Total memory access count */
+    uint64_t memory_accesses;            /* Total, summed from @op_heat */
+    uint64_t op_accesses[IMAX];          /* Per opcode, from @op_heat */
+    uint8_t opcode;                      /* Opcode being executed */
+    uint64_t *op_heat;                   /* Reads, writes per opcode, addr */
     uint64_t *pc_heat_map;               /* PC execution heat map */
     hot_spot_t hot_spots[MAX_HOT_SPOTS]; /* Top hot spots */
     size_t hot_spot_count;               /* Number of valid hot spots */
     clock_t start_time;                  /* Profiling start time */
     clock_t end_time;                    /* Profiling end time */
+    bool sampling;                       /* Heat map counts timer samples */
+    bool sample_pending;                 /* Timer fired, take a sample */
+    bool sample_busy;                    /* Another VM had the timer */
+    uint64_t samples;                    /* Samples taken */
+    forth_prof_t forth;                  /* Samples by Forth word */
+    miner_t mine;                        /* Unfused SUBLEQ runs */
 } profiler_t;
 
+/* Start of the row of op_heat counting @write accesses by opcode @op */
+#define OP_HEAT_ROW(op, write) ((size_t) ((op) * 2 + (write)) * SZ)
+
+/* Pattern matcher scratch. Each optimizer thread has its own. */
+typedef struct {
+    unsigned set[10];   /* Tracks set variables ('0'-'9') */
+    uint16_t vars[10];  /* Captured variable values */
+    unsigned version;   /* Version counter for variable reset */
+    int matches[IMAX];  /* Count of matched instructions */
+} match_scratch_t;
+
 /* Optimizer state */
 typedef struct {
     int matches[IMAX];        /* Count of matched instructions */
-    unsigned set[10];         /* Tracks set variables ('0'-'9') */
-    uint16_t vars[10];        /* Captured variable values */
-    unsigned version;         /* Version counter for variable reset */
+    unsigned threads;         /* Threads for the matching pass */
     int64_t exec_count[IMAX]; /* Execution count per instruction */
     uint8_t zero_reg[SZ];     /* Tracks memory locations holding 0 */
     uint8_t one_reg[SZ];      /* Tracks memory locations holding 1 */
@@ -237,1202 +398,5214 @@ typedef struct {
     clock_t start, end;       /* Timers for performance measurement */
 } optimizer_t;
 
-/* Main VM context */
+/* Input ring buffer. It is refilled with as many bytes as the host has
+ * ready in a single read, so GET, ILOAD and LDINC are normally served from
+ * memory instead of issuing a system call per character.
+ */
+typedef struct {
+    unsigned char buf[INPUT_BUF_SIZE]; /* Ring storage */
+    uint32_t head;                     /* Next byte to consume */
+    uint32_t tail;                     /* Next byte to fill */
+} input_buf_t;
+
+/* Output buffer, handed to the write callback when full, before the VM
+ * waits for input, and when a run ends.
+ */
+typedef struct {
+    unsigned char buf[OUTPUT_BUF_SIZE]; /* Pending output */
+    size_t len;                         /* Bytes pending */
+} output_buf_t;
+
+/* File-backed block storage, mapped into the host address space */
+typedef struct {
+    int fd;       /* Backing file descriptor, -1 if none */
+    uint8_t *map; /* Mapping of the whole file */
+    size_t size;  /* Mapped size in bytes */
+} block_dev_t;
+
+/* State vm_reset() returns to. With mmap() the memory lives in a shared
+ * memory object the VM maps copy-on-write, so the kernel copies exactly the
+ * pages the program writes, and mapping the object again drops them.
+ */
 typedef struct {
+    bool taken;         /* vm_snapshot() succeeded */
+    int fd;             /* Shared memory object behind vm->mem, -1 if none */
+    uint16_t *mem;      /* Plain copy to restore from, or NULL */
+    uint64_t pc;        /* Program counter */
+    uint64_t load_size; /* Loaded memory size */
+    uint64_t max_addr;  /* Highest address written */
+} snapshot_t;
+
+/* Hardware counters sampled per opcode. Each event counts this thread
+ * and overflows every @period occurrences, recording the host pc it
+ * overflowed at; that pc lies in the handler of the opcode being run.
+ */
+typedef struct {
+    bool enabled;                /* Requested with vm_config_t.perf */
+    bool opened;                 /* perf_open() ran */
+    bool pending;                /* Sample buffer reached its watermark */
+    bool busy;                   /* Another VM had the counters */
+    unsigned nevents;            /* Events opened, 0 if unavailable */
+    int fd[PERF_EVENTS];         /* Event descriptors; fd[0] leads */
+    uint64_t id[PERF_EVENTS];    /* Kernel ids tagging their samples */
+    const char *name[PERF_EVENTS];
+    uint64_t period[PERF_EVENTS];
+    void *ring;                  /* Sample buffer shared by the events */
+    size_t ring_size;            /* Its mapped size in bytes */
+    uint64_t count[PERF_EVENTS][IMAX + 1]; /* Samples per opcode; IMAX
+                                            * for host code outside the
+                                            * handlers */
+    uint64_t lost;               /* Samples the kernel dropped */
+} perf_t;
+
+/* Execution trace being written. Each taken branch adds the distance from
+ * the start of its basic block to the branch, the distance to its target
+ * and the instructions the block ran, as varints, so a loop costs a few
+ * bytes per iteration, and a block that loops onto itself a count. Memory
+ * checkpoints store the cells changed since the previous one.
+ */
+typedef struct {
+    FILE *out;         /* Trace file, NULL if none */
+    bool on;           /* Recording; cleared when a write fails */
+    uint8_t *buf;      /* Bytes not yet written */
+    size_t len;        /* Bytes in @buf */
+    uint64_t block;    /* Start of the running basic block */
+    uint64_t insns;    /* vm->insns when it started */
+    uint64_t next_mem; /* vm->insns due for the next memory checkpoint */
+    uint16_t *mem;     /* Memory as of the last checkpoint */
+    uint64_t last[3];  /* Block start, branch and instructions, last time */
+    uint64_t repeats;  /* Times it repeated since, not yet written */
+} trace_t;
+
+/* Phases of a VM's life timed for the statistics */
+enum {
+    PHASE_CREATE,   /* vm_create() up to the profiler */
+    PHASE_PARSE,    /* Loading the image */
+    PHASE_OPTIMIZE, /* Decoding it */
+    PHASE_PROFILER, /* Setting up the profiler */
+    PHASE_EXECUTE,  /* Running it, over every call */
+    PHASES
+};
+
+static const char *const phase_names[PHASES] = {
+    "Create", "Parse", "Optimize", "Profiler init", "Execute",
+};
+
+/* Keys of the phases in vm_report_json() */
+static const char *const phase_keys[PHASES] = {
+    "create", "parse", "optimize", "profiler_init", "execute",
+};
+
+/* A point in time, or the time between two, in seconds */
+typedef struct {
+    double wall; /* Monotonic wall clock */
+    double cpu;  /* Processor time of the whole process */
+} stamp_t;
+
+/* Main VM context */
+struct vm {
     uint16_t *mem;         /* Main memory (16-bit words) */
-    insn_t *insn_mem;      /* Optimized instruction memory */
+    insn_t *insn;          /* This VM's view of the decoded code */
+    code_t *code;          /* Shared decoded instructions */
+    bool code_dirty[CODE_PAGES]; /* Page of @insn differs from @code */
     uint64_t nbits;        /* Word size in bits (e.g., 16) */
     uint16_t mask;         /* Bitmask for N-bit values */
     uint64_t mem_size;     /* Total memory size in words */
     uint64_t pc;           /* Program counter */
+    uint64_t insns;        /* Instructions executed */
+    uint64_t insn_end;     /* Yield at the first taken branch past this */
+    uint64_t insn_limit;   /* @insn_end, or 0 to stop at the next branch */
     uint64_t load_size;    /* Loaded memory size */
     uint64_t max_addr;     /* Highest address written */
     optimizer_t opt;       /* Optimizer state */
     profiler_t prof;       /* Profiler state */
-    FILE *in, *out;        /* Input/output streams */
+    vm_io_t io;            /* Host I/O callbacks */
+    input_buf_t input;     /* Buffered input */
+    uint16_t line_done;    /* Characters stored by a suspended line read */
+    bool need_input;       /* Suspended until the host has input */
+    output_buf_t output;   /* Buffered output */
+    block_dev_t blk;       /* Block device backing file */
+    snapshot_t snap;       /* Last snapshot */
+    perf_t perf;           /* Hardware counters */
+    trace_t trace;         /* Execution trace */
+    stamp_t phase[PHASES]; /* Time spent in each phase */
+    stamp_t run_start;     /* When the current vm_run() began */
+    bool live_enabled;     /* Dump counters on SIGUSR1 */
+    bool live_busy;        /* Another VM had the signal */
+    uint64_t live_insns;   /* Instructions at the last live dump */
+    double live_wall;      /* Execution wall time at the last live dump */
     int error;             /* Error flag (0 = no error, -1 = error) */
     bool stats_enabled;    /* Enable performance statistics */
     bool optimize_enabled; /* Enable instruction optimization */
     bool profiler_enabled; /* Enable lightweight profiler */
-} vm_t;
+    bool sampler_enabled;  /* Enable sampling profiler */
+    bool devices_enabled;  /* Enable memory-mapped devices */
+    struct smp *smp;       /* Machine this CPU belongs to, NULL if none */
+    unsigned cpu_id;       /* CPU number within @smp */
+};
 
-/* Forward declaration for the dispatcher with the unified signature */
-static void dispatch(vm_t *vm, uint64_t pc, const insn_t *insn);
+/* Per-VM storage comes from pools of equal slots carved out of 2 MiB
+ * chunks. A chunk is aligned so the kernel can back it with one huge page,
+ * which keeps a VM's state, memory and heat map under few TLB entries, and
+ * the slots of destroyed VMs are kept on a free list for the next VM.
+ */
+#define POOL_CHUNK (2U << 20)
 
-/* Pattern analysis helper functions */
+typedef struct pool_slot {
+    struct pool_slot *next; /* Next free slot */
+} pool_slot_t;
 
-/* Validate that a captured jump target matches the expected pattern structure.
- * This ensures that the SUBLEQ sequences we're optimizing have the correct
- * control flow relationships between instructions.
+typedef struct {
+    size_t size;       /* Slot size in bytes, a multiple of 4 KiB */
+    pool_slot_t *free; /* Free slots */
+    bool locked;       /* Spinlock over @free */
+} pool_t;
+
+/* A VM's slot holds the vm_t followed by its main memory */
+#define VM_MEM_OFFSET ((sizeof(vm_t) + 4095) & ~(size_t) 4095)
+
+static pool_t vm_pool = {.size = VM_MEM_OFFSET + SZ * sizeof(uint16_t)};
+static pool_t heat_pool = {.size = SZ * sizeof(uint64_t)};
+
+static void *chunk_alloc(void)
+{
+#ifdef PLAT_POSIX
+    void *chunk;
+    if (posix_memalign(&chunk, POOL_CHUNK, POOL_CHUNK) != 0)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise(chunk, POOL_CHUNK, MADV_HUGEPAGE);
+#endif
+    return chunk;
+#else
+    return malloc(POOL_CHUNK);
+#endif
+}
+
+/* Take a zeroed slot from @pool. Returns NULL if out of memory. */
+static void *pool_get(pool_t *pool)
+{
+    while (__atomic_test_and_set(&pool->locked, __ATOMIC_ACQUIRE))
+        ;
+    if (!pool->free) {
+        uint8_t *chunk = chunk_alloc();
+        for (size_t off = 0; chunk && off + pool->size <= POOL_CHUNK;
+             off += pool->size) {
+            pool_slot_t *slot = (pool_slot_t *) (chunk + off);
+            slot->next = pool->free;
+            pool->free = slot;
+        }
+    }
+    pool_slot_t *slot = pool->free;
+    if (slot)
+        pool->free = slot->next;
+    __atomic_clear(&pool->locked, __ATOMIC_RELEASE);
+
+    if (slot)
+        memset(slot, 0, pool->size);
+    return slot;
+}
+
+static stamp_t stamp_now(void)
+{
+    stamp_t t = {.cpu = (double) clock() / CLOCKS_PER_SEC};
+#ifdef PLAT_POSIX
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    t.wall = (double) ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    t.wall = t.cpu; /* C99 has no wall clock finer than a second */
+#endif
+    return t;
+}
+
+/* Charge the time since @start to @phase of @vm */
+static void phase_add(vm_t *vm, int phase, stamp_t start)
+{
+    stamp_t now = stamp_now();
+    vm->phase[phase].wall += now.wall - start.wall;
+    vm->phase[phase].cpu += now.cpu - start.cpu;
+}
+
+/* Return @ptr, a slot taken from @pool, for reuse */
+static void pool_put(pool_t *pool, void *ptr)
+{
+    pool_slot_t *slot = ptr;
+    while (__atomic_test_and_set(&pool->locked, __ATOMIC_ACQUIRE))
+        ;
+    slot->next = pool->free;
+    pool->free = slot;
+    __atomic_clear(&pool->locked, __ATOMIC_RELEASE);
+}
+
+/* SIGUSR1 asked for a live dump of the counters. The running VM takes it
+ * at its next taken branch, or, while it waits for input, when the signal
+ * interrupts the read.
  */
-static inline bool validate_jump_target(uint16_t target,
-                                        uint64_t base_pc,
-                                        int offset)
+static bool live_pending;
+static vm_t *live_vm; /* The VM that dumps when waiting for input */
+static void live_dump(vm_t *vm);
+
+/* The signal interrupted a blocking call: dump the VM waiting on it */
+static void live_idle(void)
 {
-    return target == (uint16_t) (base_pc + offset);
+    vm_t *vm = __atomic_load_n(&live_vm, __ATOMIC_ACQUIRE);
+    if (vm && __atomic_exchange_n(&live_pending, false, __ATOMIC_RELAXED))
+        live_dump(vm);
 }
 
-/* Profiler helper functions */
-static void profiler_init(vm_t *vm)
+#ifdef PLAT_POSIX
+/* Default I/O callbacks on the process's standard input and output. Reads
+ * take everything the host has ready, up to @len, in one read().
+ */
+static long stdio_read(void *ctx, void *buf, size_t len)
 {
-    profiler_t *prof = &vm->prof;
+    (void) ctx;
+
+    for (;;) {
+        ssize_t n = read(STDIN_FILENO, buf, len);
+        if (n >= 0)
+            return (long) n;
+        if (errno == EINTR) {
+            live_idle();
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1; /* A real error occurred */
 
-    if (!vm->profiler_enabled) {
-        prof->enabled = false;
-        return;
+        /* Non-blocking descriptor: poll with a timeout of -1 to wait
+         * indefinitely for input, then read again.
+         */
+        struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+        while (poll(&pfd, 1, -1) < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                return -1;
+            live_idle();
+        }
     }
+}
 
-    prof->enabled = true;
-    prof->total_instructions = 0;
-    prof->memory_accesses = 0;
-    prof->hot_spot_count = 0;
-    prof->start_time = clock();
-
-    /* Allocate PC heat map if profiling enabled */
-    prof->pc_heat_map = calloc(vm->mem_size, sizeof(uint64_t));
-    if (!prof->pc_heat_map) {
-        fprintf(stderr, "Warning: Failed to allocate profiler memory\n");
-        prof->enabled = false;
-        return;
+static int stdio_write(void *ctx, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    (void) ctx;
+
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, p, len);
+        if (n > 0) {
+            p += n;
+            len -= (size_t) n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = {.fd = STDOUT_FILENO, .events = POLLOUT};
+            if (poll(&pfd, 1, -1) >= 0 || errno == EINTR)
+                continue;
+        }
+        return -1;
     }
+    return 0;
 }
 
-static void profiler_cleanup(vm_t *vm)
+static bool stdio_is_tty(void)
 {
-    profiler_t *prof = &vm->prof;
-    free(prof->pc_heat_map);
-    prof->pc_heat_map = NULL;
-    prof->enabled = false;
+    return isatty(STDOUT_FILENO);
+}
+#else
+/* Fallback for non-POSIX systems: no way to tell how much input is ready, so
+ * each read returns the next character, and output is always flushed as if
+ * it were a terminal.
+ */
+static long stdio_read(void *ctx, void *buf, size_t len)
+{
+    (void) ctx;
+    (void) len;
+    int ch = fgetc(stdin);
+    if (ch == EOF)
+        return ferror(stdin) ? -1 : 0;
+    *(unsigned char *) buf = (unsigned char) ch;
+    return 1;
 }
 
-static inline void profiler_record_pc(vm_t *vm, uint64_t pc)
+static int stdio_write(void *ctx, const void *buf, size_t len)
 {
-    profiler_t *prof = &vm->prof;
+    (void) ctx;
+    if (fwrite(buf, 1, len, stdout) != len)
+        return -1;
+    return fflush(stdout) < 0 ? -1 : 0;
+}
 
-    if (!prof->enabled)
-        return;
+static bool stdio_is_tty(void)
+{
+    return true;
+}
+#endif
 
-    prof->total_instructions++;
+/* Hand all pending output to the write callback */
+static int output_flush(vm_t *vm)
+{
+    output_buf_t *ob = &vm->output;
+    if (ob->len == 0)
+        return 0;
 
-    /* Record PC heat map every instruction */
-    if (prof->pc_heat_map)
-        prof->pc_heat_map[pc]++;
+    int r = vm->io.write(vm->io.ctx, ob->buf, ob->len);
+    ob->len = 0;
+    return r;
 }
 
-static inline void profiler_record_memory_access(vm_t *vm)
+/* Refill the empty input ring. Pending output is flushed first so a prompt
+ * is visible before the VM waits. Blocks until at least one byte is
+ * available, then takes as much as the host has ready, up to the whole
+ * ring: being empty, it restarts at its first byte. Returns the number of
+ * bytes added, 0 at EOF, -1 on error, or VM_IO_AGAIN if the host has no
+ * input ready.
+ */
+static int input_fill(vm_t *vm)
 {
-    profiler_t *prof = &vm->prof;
-    if (prof->enabled)
-        prof->memory_accesses++;
+    input_buf_t *ib = &vm->input;
+
+    if (output_flush(vm) < 0)
+        return -1;
+
+    ib->head = ib->tail = 0;
+    long n = vm->io.read(vm->io.ctx, ib->buf, INPUT_BUF_SIZE);
+    if (n < 0)
+        return n == VM_IO_AGAIN ? VM_IO_AGAIN : -1;
+    ib->tail = (uint32_t) n;
+    return (int) n;
 }
 
-/* Define instruction handlers.
- * It accepts a pointer to the current instruction (@insn) to avoid redundant
- * memory lookups for its operands. The tail call to dispatch passes NULL for
- * the unused @insn parameter to maintain signature compatibility, which is
- * required for the 'musttail' attribute.
- */
-#define HANDLE(inst, body)                                    \
-    HOT_PATH static void handle_##inst(vm_t *vm, uint64_t pc, \
-                                       const insn_t *insn)    \
-    {                                                         \
-        (void) pc;                                            \
-        (void) insn;                                          \
-                                                              \
-        /* Profiler hook - record PC execution */             \
-        profiler_record_pc(vm, pc);                           \
-                                                              \
-        uint64_t next_pc = pc + INSN_INCR_##inst;             \
-        do                                                    \
-            body while (0);                                   \
-        if (UNLIKELY(vm->error))                              \
-            return;                                           \
-        MUST_TAIL return dispatch(vm, next_pc, NULL);         \
+/* Write a character to output buffer, flushing for TTY */
+static inline int vm_putch(vm_t *vm, int ch)
+{
+    output_buf_t *ob = &vm->output;
+    ob->buf[ob->len++] = (unsigned char) ch;
+    if (UNLIKELY(ob->len == OUTPUT_BUF_SIZE || vm->io.unbuffered)) {
+        if (output_flush(vm) < 0)
+            return -1;
     }
+    return ch;
+}
 
-/* SUBLEQ: Subtract and branch if less than or equal to zero */
-HANDLE(SUBLEQ, {
-    /* Operands are pre-fetched from memory by the optimizer */
-    uint16_t a = insn->src;
-    uint16_t b = insn->dst;
-    uint16_t c = insn->aux;
+/* Write a run of bytes to output, flushing once for TTY */
+static int vm_write(vm_t *vm, const void *buf, size_t len)
+{
+    output_buf_t *ob = &vm->output;
 
-    if (UNLIKELY(a == vm->mask)) { /* Input */
-        int ch = vm_getch(vm->in);
-        if (UNLIKELY(ch == EOF || ch == -1)) {
-            vm->error = -1;
-            return;
-        }
-        vm->mem[MASK_ADDR(b)] = (uint16_t) ch;
-        profiler_record_memory_access(vm);
-    } else if (UNLIKELY(b == vm->mask)) { /* Output */
-        profiler_record_memory_access(vm);
-        if (UNLIKELY(vm_putch(vm->mem[MASK_ADDR(a)], vm->out) < 0)) {
-            vm->error = -1;
-            return;
-        }
-    } else { /* Standard SUBLEQ */
-        uint16_t la = MASK_ADDR(a);
-        uint16_t lb = MASK_ADDR(b);
-        profiler_record_memory_access(vm); /* Read from la */
-        profiler_record_memory_access(vm); /* Read from lb */
-        uint16_t result = vm->mem[lb] - vm->mem[la];
-        vm->mem[lb] = result;
-        profiler_record_memory_access(vm); /* Write to lb */
-        if (UNLIKELY(lb > vm->max_addr))
-            vm->max_addr = lb;
-        if (result == 0 || (result & (1U << (vm->nbits - 1))))
-            next_pc = c;
+    if (len > OUTPUT_BUF_SIZE - ob->len) {
+        if (output_flush(vm) < 0)
+            return -1;
+        if (len > OUTPUT_BUF_SIZE)
+            return vm->io.write(vm->io.ctx, buf, len);
     }
-})
+    memcpy(&ob->buf[ob->len], buf, len);
+    ob->len += len;
+    return vm->io.unbuffered ? output_flush(vm) : 0;
+}
 
-/* JMP: Unconditional jump */
-HANDLE(JMP, {
-    uint16_t dst = insn->dst;
-    /* Often the address cleared to 0 by the JMP sequence */
-    uint16_t src = insn->src;
-    vm->mem[MASK_ADDR(src)] = 0;
-    profiler_record_memory_access(vm);
-    next_pc = dst;
-})
+/* Read a character from input, served from the ring buffer when possible.
+ * Returns -1 at end of input or on error, or VM_IO_AGAIN if the host has
+ * nothing ready yet.
+ */
+static inline int vm_getch(vm_t *vm)
+{
+    input_buf_t *ib = &vm->input;
+    if (LIKELY(ib->head != ib->tail))
+        return ib->buf[ib->head++ & INPUT_BUF_MASK];
+    int n = input_fill(vm);
+    if (n <= 0)
+        return n == VM_IO_AGAIN ? VM_IO_AGAIN : -1;
+    return ib->buf[ib->head++ & INPUT_BUF_MASK];
+}
 
-/* MOV: Move data */
-HANDLE(MOV, {
-    uint16_t dst = MASK_ADDR(insn->dst);
-    uint16_t src = MASK_ADDR(insn->src);
-    profiler_record_memory_access(vm); /* Read from src */
-    /* Avoid redundant move */
-    if (LIKELY(src != dst))
-        vm->mem[dst] = vm->mem[src];
-    profiler_record_memory_access(vm); /* Write to dst */
-})
-
-/* ADD: Addition */
-HANDLE(ADD, {
-    uint16_t dst = MASK_ADDR(insn->dst);
-    uint16_t src = MASK_ADDR(insn->src);
-    profiler_record_memory_access(vm); /* Read from src */
-    profiler_record_memory_access(vm); /* Read from dst */
+#ifdef PLAT_POSIX
+/* Create an unlinked shared memory object of @size bytes. Returns its file
+ * descriptor or -1.
+ */
+static int shm_create(size_t size)
+{
+    static unsigned serial;
+    char name[64];
+    int fd;
+
+    do {
+        snprintf(name, sizeof(name), "/subleq-%ld-%u", (long) getpid(),
+                 __atomic_fetch_add(&serial, 1, __ATOMIC_RELAXED));
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    } while (fd < 0 && errno == EEXIST);
+    if (fd < 0)
+        return -1;
+    shm_unlink(name);
 
-    /* Fast path for common values */
-    uint16_t src_val = vm->mem[src];
-    if (LIKELY(src_val != 0)) {
-        if (src_val == 1) {
-            vm->mem[dst]++;
-        } else {
-            vm->mem[dst] += src_val;
-        }
+    if (ftruncate(fd, (off_t) size) < 0) {
+        close(fd);
+        return -1;
     }
-    /* src_val == 0: no-op, skip write */
-    profiler_record_memory_access(vm); /* Write to dst */
-})
+    return fd;
+}
+#endif
 
-/* SUB: Subtraction */
-HANDLE(SUB, {
-    uint16_t dst = MASK_ADDR(insn->dst);
-    uint16_t src = MASK_ADDR(insn->src);
-    profiler_record_memory_access(vm); /* Read from src */
-    profiler_record_memory_access(vm); /* Read from dst */
+/* Decoded code lives in an unlinked shared memory object. The decoder
+ * fills a shared mapping of it and every VM then maps it privately, which
+ * leaves the kernel to share untouched pages and copy written ones. Where
+ * no such object can be made, @fd is -1 and each VM runs from a private
+ * copy of the decoded code instead.
+ */
+static code_t *code_alloc(void)
+{
+    code_t *code = calloc(1, sizeof(*code));
+    if (!code)
+        return NULL;
+    code->fd = -1;
+    code->refs = 1;
 
-    /* Fast path for common values */
-    uint16_t src_val = vm->mem[src];
-    if (LIKELY(src_val != 0)) {
-        if (src_val == 1) {
-            vm->mem[dst]--;
-        } else {
-            vm->mem[dst] -= src_val;
+#ifdef PLAT_POSIX
+    size_t size = SZ * sizeof(insn_t);
+    int fd = shm_create(size);
+    if (fd >= 0) {
+        void *map =
+            mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            code->insn = map;
+            code->fd = fd;
+            return code;
         }
+        close(fd);
     }
-    /* src_val == 0: no-op, skip write */
-    profiler_record_memory_access(vm); /* Write to dst */
-})
+#endif
 
-/* ZERO: Clear memory location */
-HANDLE(ZERO, {
-    uint16_t dst = insn->dst;
-    vm->mem[MASK_ADDR(dst)] = 0;
-    profiler_record_memory_access(vm);
-})
+    code->insn = calloc(SZ, sizeof(insn_t));
+    if (!code->insn) {
+        free(code);
+        return NULL;
+    }
+    return code;
+}
 
-/* PUT: Output character */
-HANDLE(PUT, {
-    uint16_t src = insn->src;
-    profiler_record_memory_access(vm);
-    if (UNLIKELY(vm_putch(vm->mem[MASK_ADDR(src)], vm->out) < 0)) {
-        vm->error = -1;
+static void code_free(code_t *code)
+{
+#ifdef PLAT_POSIX
+    if (code->fd >= 0) {
+        munmap(code->insn, SZ * sizeof(insn_t));
+        close(code->fd);
+        free(code);
         return;
     }
-})
+#endif
+    free(code->insn);
+    free(code);
+}
 
-/* GET: Input character */
-HANDLE(GET, {
-    uint16_t dst = insn->dst;
-    int ch = vm_getch(vm->in);
-    if (UNLIKELY(ch == EOF || ch == -1)) {
-        vm->error = -1;
+/* Map a copy-on-write view of @code for a VM */
+static insn_t *code_map(code_t *code)
+{
+#ifdef PLAT_POSIX
+    if (code->fd >= 0) {
+        void *map = mmap(NULL, SZ * sizeof(insn_t), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE, code->fd, 0);
+        return map == MAP_FAILED ? NULL : map;
+    }
+#endif
+    insn_t *view = malloc(SZ * sizeof(insn_t));
+    if (view)
+        memcpy(view, code->insn, SZ * sizeof(insn_t));
+    return view;
+}
+
+static void code_unmap(code_t *code, insn_t *view)
+{
+#ifdef PLAT_POSIX
+    if (code->fd >= 0) {
+        munmap(view, SZ * sizeof(insn_t));
         return;
     }
-    vm->mem[MASK_ADDR(dst)] = (uint16_t) ch;
-    profiler_record_memory_access(vm);
-})
+#endif
+    free(view);
+}
 
-/* HALT: Terminate program */
-HANDLE(HALT, {
-    /* Set PC beyond valid range to stop execution */
-    vm->pc = vm->mem_size / 2;
-    return;
-})
+/* Give @vm a view of @code, taking a reference. Returns 0 or -1. */
+static int code_attach(vm_t *vm, code_t *code)
+{
+    insn_t *view = code_map(code);
+    if (!view)
+        return -1;
 
-/* IADD: Indirect addition */
-HANDLE(IADD, {
-    uint16_t dst = insn->dst;
-    uint16_t src = insn->src;
-    profiler_record_memory_access(vm); /* Read pointer */
-    profiler_record_memory_access(vm); /* Read src */
-    uint16_t addr = MASK_ADDR(vm->mem[MASK_ADDR(dst)]);
-    profiler_record_memory_access(vm); /* Read indirect */
-    vm->mem[addr] += vm->mem[MASK_ADDR(src)];
-    profiler_record_memory_access(vm); /* Write indirect */
-})
+    __atomic_fetch_add(&code->refs, 1, __ATOMIC_RELAXED);
+    vm->code = code;
+    vm->insn = view;
+    memset(vm->code_dirty, 0, sizeof(vm->code_dirty));
+    return 0;
+}
 
-/* ISUB: Indirect subtraction */
-HANDLE(ISUB, {
-    uint16_t dst = insn->dst;
-    uint16_t src = insn->src;
-    profiler_record_memory_access(vm); /* Read pointer */
-    profiler_record_memory_access(vm); /* Read src */
-    uint16_t addr = MASK_ADDR(vm->mem[MASK_ADDR(dst)]);
-    profiler_record_memory_access(vm); /* Read indirect */
-    vm->mem[addr] -= vm->mem[MASK_ADDR(src)];
-    profiler_record_memory_access(vm); /* Write indirect */
-})
+/* Drop @vm's view and its reference to the shared code */
+static void code_detach(vm_t *vm)
+{
+    if (!vm->code)
+        return;
 
-/* IJMP: Indirect jump */
-HANDLE(IJMP, {
-    uint16_t dst = insn->dst;
-    profiler_record_memory_access(vm);
-    next_pc = vm->mem[MASK_ADDR(dst)];
-})
+    code_unmap(vm->code, vm->insn);
+    if (__atomic_sub_fetch(&vm->code->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        code_free(vm->code);
+    vm->code = NULL;
+    vm->insn = NULL;
+}
 
-/* ILOAD: Indirect load */
-HANDLE(ILOAD, {
-    uint16_t src = MASK_ADDR(insn->src);
-    uint16_t dst = MASK_ADDR(insn->dst);
-    profiler_record_memory_access(vm); /* Read pointer */
-    uint16_t addr = vm->mem[src];
+/* Number of memory words the decoded entry was built from */
+static unsigned insn_span(const insn_t *insn)
+{
+    switch (insn->opcode) {
+    case JMP:
+    case HALT:
+        return SUBLEQ_INSN_SIZE;
+    case IJMP:
+        return IJMP_PATTERN_JUMP_OFFSET + 1;
+    case LSHIFT:
+        return insn->src * INSN_INCR_LSHIFT;
+    default:
+        return insn_incr[insn->opcode];
+    }
+}
 
-    /* Special handling for input from I/O address (vm->mask) */
-    if (UNLIKELY(addr == vm->mask)) {
-        int ch = vm_getch(vm->in);
-        if (UNLIKELY(ch == EOF || ch == -1)) {
-            vm->error = -1;
-            return;
-        }
-        vm->mem[dst] = (uint16_t) (-ch); /* Negated input value */
-    } else {
-        /* Optimized: pre-mask address for better performance */
-        profiler_record_memory_access(vm); /* Read indirect */
-        vm->mem[dst] = vm->mem[MASK_ADDR(addr)];
+/* The host wrote @len words at @addr behind the decoder's back. Re-decode,
+ * as plain SUBLEQ, every entry whose source words overlap the write, so no
+ * stale fused or prefetched operands can run. Only this VM sees the change.
+ */
+static int code_invalidate(vm_t *vm, uint16_t addr, uint16_t len)
+{
+    uint64_t limit = vm->mem_size / 2; /* Only this range is executed */
+    uint64_t lo = addr, hi = (uint64_t) addr + len;
+    uint64_t first = lo > OPTIMIZER_SCAN_DEPTH ? lo - OPTIMIZER_SCAN_DEPTH : 0;
+
+    if (hi > vm->mem_size) { /* Wrapped around to address 0 */
+        if (code_invalidate(vm, 0, (uint16_t) (hi - vm->mem_size)) < 0)
+            return -1;
+        hi = vm->mem_size;
     }
-    profiler_record_memory_access(vm); /* Write to dst */
-})
+    if (!vm->code || first >= limit)
+        return 0;
+    if (hi > limit)
+        hi = limit;
+
+    for (uint64_t i = first; i < hi; i++) {
+        insn_t *insn = &vm->insn[i];
+        if (i + insn_span(insn) <= lo)
+            continue;
 
-/* LDINC: D = m[m[S]], then m[S]++ */
-HANDLE(LDINC, {
-    uint16_t src_ptr = MASK_ADDR(insn->src); /* S */
-    uint16_t dst = MASK_ADDR(insn->dst);     /* D */
-    profiler_record_memory_access(vm);       /* Read pointer */
-    uint16_t addr = vm->mem[src_ptr];
+        insn->opcode = vm->smp ? ATOMIC : SUBLEQ;
+        insn->src = vm->mem[MASK_ADDR(i)];
+        insn->dst = vm->mem[MASK_ADDR(i + 1)];
+        insn->aux = vm->mem[MASK_ADDR(i + 2)];
+        vm->code_dirty[i >> CODE_PAGE_BITS] = true;
+    }
+    return 0;
+}
 
-    /* Special handling for input from I/O address (vm->mask) */
-    if (UNLIKELY(addr == vm->mask)) {
-        int ch = vm_getch(vm->in);
-        if (UNLIKELY(ch == EOF || ch == -1)) {
-            vm->error = -1;
-            return;
-        }
-        vm->mem[dst] = (uint16_t) (-ch); /* Negated input value */
-    } else {
-        profiler_record_memory_access(vm); /* Read indirect */
-        vm->mem[dst] = vm->mem[MASK_ADDR(addr)];
+/* Make @vm's view, including the pages it changed, the code it shares so
+ * that it starts out clean. Returns 0 or -1.
+ */
+static int code_rebase(vm_t *vm)
+{
+    bool dirty = false;
+    for (unsigned p = 0; p < CODE_PAGES; p++)
+        dirty |= vm->code_dirty[p];
+    if (!vm->code || !dirty)
+        return 0;
+
+    code_t *code = code_alloc();
+    if (!code)
+        return -1;
+    memcpy(code->insn, vm->insn, SZ * sizeof(insn_t));
+    insn_t *view = code_map(code);
+    if (!view) {
+        code_free(code);
+        return -1;
     }
 
-    /* Post-increment the source pointer */
-    vm->mem[src_ptr]++;
-    profiler_record_memory_access(vm); /* Write to dst */
-    profiler_record_memory_access(vm); /* Write pointer increment */
-})
+    code_detach(vm);
+    vm->code = code; /* Takes over the allocation's reference */
+    vm->insn = view;
+    memset(vm->code_dirty, 0, sizeof(vm->code_dirty));
+    return 0;
+}
 
-/* ISTORE: Indirect store */
-HANDLE(ISTORE, {
-    uint16_t src = MASK_ADDR(insn->src);
-    uint16_t dst = MASK_ADDR(insn->dst);
-    profiler_record_memory_access(vm); /* Read src */
-    profiler_record_memory_access(vm); /* Read pointer */
-    uint16_t addr = MASK_ADDR(vm->mem[dst]);
-    vm->mem[addr] = vm->mem[src];
-    profiler_record_memory_access(vm); /* Write indirect */
-})
+/* Drop @vm's snapshot, and its view of the snapshot if it runs from one */
+static void mem_release(vm_t *vm)
+{
+    free(vm->snap.mem);
+    vm->snap.mem = NULL;
+#ifdef PLAT_POSIX
+    if (vm->snap.fd < 0)
+        return; /* Memory is part of the VM's slot */
+    munmap(vm->mem, SZ * sizeof(uint16_t));
+    close(vm->snap.fd);
+    vm->snap.fd = -1;
+    vm->mem = NULL;
+#endif
+}
 
-/* INC: Increment by 1 */
-HANDLE(INC, {
-    uint16_t dst = MASK_ADDR(insn->dst);
-    profiler_record_memory_access(vm); /* Read */
-    vm->mem[dst]++;
-    profiler_record_memory_access(vm); /* Write */
-})
+/* Keep a plain copy of the memory to restore from. Returns 0 or -1. */
+static int mem_copy(vm_t *vm)
+{
+    uint16_t *copy = malloc(SZ * sizeof(uint16_t));
+    if (!copy)
+        return -1;
+    memcpy(copy, vm->mem, SZ * sizeof(uint16_t));
+    free(vm->snap.mem);
+    vm->snap.mem = copy;
+    return 0;
+}
 
-/* DEC: Decrement by 1 */
-HANDLE(DEC, {
-    uint16_t dst = MASK_ADDR(insn->dst);
-    profiler_record_memory_access(vm); /* Read */
-    vm->mem[dst]--;
-    profiler_record_memory_access(vm); /* Write */
-})
+#ifdef PLAT_POSIX
+/* Copy the memory into a new shared memory object and run from a private
+ * view of it, or keep a plain copy where no such object can be made.
+ * Returns 0 or -1.
+ */
+static int mem_snapshot(vm_t *vm)
+{
+    size_t size = SZ * sizeof(uint16_t);
+    int fd = shm_create(size);
+    if (fd < 0)
+        return mem_copy(vm);
+
+    uint16_t *copy =
+        mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (copy == MAP_FAILED)
+        goto fail;
+    memcpy(copy, vm->mem, size);
+    munmap(copy, size);
+
+    uint16_t *view =
+        mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (view == MAP_FAILED)
+        goto fail;
+    mem_release(vm);
+    vm->mem = view;
+    vm->snap.fd = fd;
+    return 0;
 
-/* INV: Bitwise NOT */
-HANDLE(INV, {
-    uint16_t dst = insn->dst;
-    profiler_record_memory_access(vm); /* Read */
-    vm->mem[MASK_ADDR(dst)] = ~vm->mem[MASK_ADDR(dst)];
-    profiler_record_memory_access(vm); /* Write */
-})
+fail:
+    close(fd);
+    return mem_copy(vm);
+}
+#else
+static int mem_snapshot(vm_t *vm)
+{
+    return mem_copy(vm);
+}
+#endif
 
-/* LSHIFT: Left shift by constant */
-HANDLE(LSHIFT, {
-    uint16_t src = insn->src;          /* Shift count */
-    uint16_t dst = insn->dst;          /* Value to be shifted */
-    profiler_record_memory_access(vm); /* Read */
-    vm->mem[MASK_ADDR(dst)] <<= src;
-    profiler_record_memory_access(vm); /* Write */
-})
+/* Return to the snapshot. A view of it is mapped again in place, which
+ * drops every page written since; a plain copy is copied back.
+ */
+static int mem_restore(vm_t *vm)
+{
+#ifdef PLAT_POSIX
+    if (!vm->snap.mem) {
+        void *view = mmap(vm->mem, SZ * sizeof(uint16_t),
+                          PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                          vm->snap.fd, 0);
+        return view == MAP_FAILED ? -1 : 0;
+    }
+#endif
+    memcpy(vm->mem, vm->snap.mem, SZ * sizeof(uint16_t));
+    return 0;
+}
 
-/* DOUBLE: Multiply by 2 (left shift by 1) */
-HANDLE(DOUBLE, {
-    uint16_t dst = insn->dst;
-    profiler_record_memory_access(vm); /* Read */
-    vm->mem[MASK_ADDR(dst)] <<= 1;
-    profiler_record_memory_access(vm); /* Write */
-})
+/* Undo @vm's changes to the shared code: map it again in place, or copy
+ * back the pages it changed if @vm runs from a private copy
+ */
+static int code_restore(vm_t *vm)
+{
+#ifdef PLAT_POSIX
+    if (vm->code->fd >= 0) {
+        bool dirty = false;
+        for (unsigned p = 0; p < CODE_PAGES; p++)
+            dirty |= vm->code_dirty[p];
+        if (!dirty)
+            return 0;
+
+        void *view = mmap(vm->insn, SZ * sizeof(insn_t),
+                          PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                          vm->code->fd, 0);
+        if (view == MAP_FAILED)
+            return -1;
+        memset(vm->code_dirty, 0, sizeof(vm->code_dirty));
+        return 0;
+    }
+#endif
+    for (unsigned p = 0; p < CODE_PAGES; p++) {
+        if (!vm->code_dirty[p])
+            continue;
+        memcpy(&vm->insn[p << CODE_PAGE_BITS],
+               &vm->code->insn[p << CODE_PAGE_BITS],
+               CODE_PAGE_SIZE * sizeof(insn_t));
+        vm->code_dirty[p] = false;
+    }
+    return 0;
+}
 
-/* NEG: Two's complement negation (dst = 0 - src) */
-HANDLE(NEG, {
-    uint16_t dst = insn->dst;
-    uint16_t src = insn->src;
-    profiler_record_memory_access(vm); /* Read src */
-    vm->mem[MASK_ADDR(dst)] = 0 - vm->mem[MASK_ADDR(src)];
-    profiler_record_memory_access(vm); /* Write dst */
-})
+/* Store character @ch at index @idx of the character buffer at @addr. With
+ * @packed, @addr is a byte address and each cell holds two characters.
+ */
+static inline void dev_store_char(vm_t *vm,
+                                  uint16_t addr,
+                                  uint16_t idx,
+                                  bool packed,
+                                  unsigned char ch)
+{
+    uint16_t pos = (uint16_t) (addr + idx);
+    if (!packed) {
+        vm->mem[MASK_ADDR(pos)] = ch;
+        return;
+    }
 
-/* Pattern matching function for SUBLEQ instruction optimization.
- * Matches instruction sequences against patterns using a compact
- * domain-specific language.
- *
- * Pattern symbols:
- * '0'-'9':
- *   Variable capture/match. These symbols capture the value of the current
- *   memory word (mem[pc + offset]) into a numbered variable. If the variable
- *   is already bound, it asserts that the current value matches the bound
- *   value. Example: '0' captures mem[i], subsequent '0's must match mem[i].
- *
- * 'Z':
- *   Match Zero. Requires the current memory word to be exactly 0.
- *   Example: "Z Z >" matches three consecutive zeros, where the third zero is
- *   also the next PC address.
- *
- * 'N':
- *   Match Negative One (All Bits Set). Requires the current memory word to be
- *   equal to 'vm->mask' (e.g., 0xFFFF for a 16-bit VM). This is often used
- *   for memory-mapped I/O addresses or special constant values.
- *   Example: "N ! >" implies 'SUBLEQ 0xFFFF, addr, next_pc'.
- *
- * '>':
- *   Match Next Program Counter Address. Requires the current memory word to be
- *   '(pc + offset + 1)'. This is the address that SUBLEQ would jump to if the
- *   preceding SUBLEQ instruction's result is zero or negative. Crucial for
- *   matching linear code sequences that do not branch.
- *   Example: "0 1 >" matches a SUBLEQ where the target address is the next
- *   sequential instruction.
- *
- * '%':
- *   Match Specific Constant (from 'va_arg'). Consumes an argument from the
- *   'va_list' (expected to be a 'uint16_t'). Requires the current memory word
- *   to match this provided constant.
- *   Example: 'match_pattern(vm, ..., "%", 100)' would match if the current
- *   memory word is 100.
- *
- * '!':
- *   Capture Value to Pointer (from 'va_arg'). Consumes an argument from the
- *   'va_list' (expected to be a 'uint16_t *'). Stores the value of the
- *   current memory word into the provided pointer. Does not perform a match;
- *   solely for extraction. Example: 'match_pattern(vm, ..., "!", &my_var)'
- *   captures the current memory word into 'my_var'.
- *
- * '?':
- *   Wildcard. Matches any value in the current memory word. Does not capture
- *   or compare the value. Used to skip irrelevant words in a pattern.
- *   Example: "0 ? >" matches '0' followed by any value, then the next PC
- * address.
- *
- * 'P':
- *   Match Positive (non-zero, MSB clear for signed interpretation).
- *
- * 'M':
- *   Match Memory address within valid range.
- *
- * 'R':
- *   Match Register/Variable reference (captured variable).
- *
- * @vm: Virtual machine context
- * @pc: The base program counter for the current instruction sequence
- * being matched (usually 'i' from the optimizer loop)
- * @mem: A pointer to the full main memory array of the VM (vm->mem)
- * @max_len: The maximum number of words available for scanning from 'pc'
- * @pattern: The string containing the DSL pattern to match
- * @...: Variable arguments based on pattern symbols like '%' and '!'
- *
- * Return true if pattern matches, false otherwise
- */
-static bool match_pattern(vm_t *vm,
-                          uint64_t pc,
-                          const uint16_t *mem,
-                          int max_len,
-                          const char *pattern,
-                          ...)
-{
-    va_list args;
-    optimizer_t *opt = &vm->opt;
-    uint64_t offset = 0;
-    unsigned version = ++opt->version;
-    bool result = true;
-
-    /* Early validation of input parameters */
-    if (UNLIKELY(!pattern || !mem || max_len <= 0))
-        return false;
-
-    va_start(args, pattern);
+    uint16_t *cell = &vm->mem[MASK_ADDR(pos >> 1)];
+    if (pos & 1)
+        *cell = (uint16_t) ((*cell & 0x00FF) | (ch << 8));
+    else
+        *cell = (uint16_t) ((*cell & 0xFF00) | ch);
+}
 
-    /* Iterate through each character in the pattern */
-    for (const char *p = pattern; *p && result; ++p) {
-        char sym = *p;
+/* Load the character at index @idx of the character buffer at @addr */
+static inline unsigned char dev_load_char(const vm_t *vm,
+                                          uint16_t addr,
+                                          uint16_t idx,
+                                          bool packed)
+{
+    uint16_t pos = (uint16_t) (addr + idx);
+    if (!packed)
+        return (unsigned char) vm->mem[MASK_ADDR(pos)];
 
-        /* Skip whitespace characters for better pattern readability */
-        if (isspace(sym))
-            continue;
+    uint16_t cell = vm->mem[MASK_ADDR(pos >> 1)];
+    return (unsigned char) ((pos & 1) ? cell >> 8 : cell);
+}
 
-        /* Check if we've exceeded the available memory range */
-        if (UNLIKELY(offset >= (uint64_t) max_len)) {
-            result = false;
-            break;
+/* Line input device: copy one line of input, without its terminating
+ * newline, into the buffer described by the DEV_LINE_* registers. The length
+ * goes to DEV_LINE_LEN, or -1 if input ended before any character arrived.
+ * A line longer than the buffer is split; the rest stays queued.
+ */
+static int dev_line_read(vm_t *vm)
+{
+    input_buf_t *ib = &vm->input;
+    uint16_t addr = vm->mem[DEV_LINE_ADDR];
+    uint16_t size = vm->mem[DEV_LINE_SIZE];
+    bool packed = vm->mem[DEV_LINE_FLAGS] & DEV_F_PACKED;
+    uint16_t len = vm->line_done; /* Resume a suspended read */
+
+    vm->line_done = 0;
+    while (len < size) {
+        if (ib->head == ib->tail) {
+            int n = input_fill(vm);
+            if (n == VM_IO_AGAIN) {
+                vm->line_done = len;
+                return VM_IO_AGAIN;
+            }
+            if (n < 0)
+                return -1;
+            if (n == 0) { /* EOF */
+                if (len == 0)
+                    len = vm->mask;
+                break;
+            }
         }
 
-        uint16_t val = mem[MASK_ADDR(pc + offset)];
-
-        switch (sym) {
-        case '0' ... '9': {
-            /* Variable capture and matching */
-            int var_idx = sym - '0';
-            if (opt->set[var_idx] == version) {
-                /* Variable already bound - verify it matches */
-                if (UNLIKELY(opt->vars[var_idx] != val)) {
-                    result = false;
-                }
-            } else {
-                /* First occurrence - capture the value */
-                opt->set[var_idx] = version;
-                opt->vars[var_idx] = val;
-            }
+        /* Copy the contiguous run of buffered bytes up to the newline */
+        uint32_t off = ib->head & INPUT_BUF_MASK;
+        uint32_t avail = ib->tail - ib->head;
+        if (avail > INPUT_BUF_SIZE - off)
+            avail = INPUT_BUF_SIZE - off;
+        if (avail > (uint32_t) (size - len))
+            avail = size - len;
+
+        const unsigned char *src = &ib->buf[off];
+        const unsigned char *nl = memchr(src, '\n', avail);
+        uint32_t n = nl ? (uint32_t) (nl - src) : avail;
+        for (uint32_t i = 0; i < n; i++)
+            dev_store_char(vm, addr, len++, packed, src[i]);
+        ib->head += n;
+
+        if (nl) {
+            ib->head++; /* Consume the newline */
             break;
         }
+    }
 
-        case 'Z':
-            /* Match zero value */
-            if (UNLIKELY(val != 0)) {
-                result = false;
-            }
-            break;
+    vm->mem[DEV_LINE_LEN] = len;
+    if (len == vm->mask)
+        return 0;
+    if (packed) /* Characters went to the cells from addr >> 1 on */
+        return code_invalidate(vm, (uint16_t) (addr >> 1),
+                               ((addr & 1) + len + 1) / 2);
+    return code_invalidate(vm, addr, len);
+}
 
-        case 'N':
-            /* Match negative one (all bits set) */
-            if (UNLIKELY(val != vm->mask)) {
-                result = false;
-            }
-            break;
+/* String output device: emit the DEV_TYPE_LEN characters at DEV_TYPE_ADDR.
+ * Characters are gathered into chunks so a whole string normally leaves in a
+ * single write.
+ */
+static int dev_type_write(vm_t *vm)
+{
+    uint16_t addr = vm->mem[DEV_TYPE_ADDR];
+    uint16_t len = vm->mem[DEV_TYPE_LEN];
+    bool packed = vm->mem[DEV_TYPE_FLAGS] & DEV_F_PACKED;
+    unsigned char chunk[512];
+
+    for (uint16_t done = 0; done < len;) {
+        size_t n = 0;
+        while (n < sizeof(chunk) && done < len)
+            chunk[n++] = dev_load_char(vm, addr, done++, packed);
+        if (vm_write(vm, chunk, n) < 0)
+            return -1;
+    }
+    return 0;
+}
 
-        case '>':
-            /* Match next program counter address */
-            if (UNLIKELY(val != pc + offset + 1)) {
-                result = false;
-            }
-            break;
+#ifdef PLAT_POSIX
+/* Map the block file as long as it is now, first extending it to @need
+ * bytes if it is shorter. Clones share the file and each grows it, so its
+ * size is read back on every block operation, and it never shrinks: the
+ * extension writes the last byte of the block about to be written rather
+ * than truncating to a size that may be stale.
+ */
+static int blk_remap(vm_t *vm, size_t need)
+{
+    block_dev_t *blk = &vm->blk;
+    struct stat st;
 
-        case '%': {
-            /* Match specific constant from arguments */
-            uint16_t expected = (uint16_t) va_arg(args, int);
-            if (UNLIKELY(val != expected)) {
-                result = false;
-            }
-            break;
-        }
+    if (fstat(blk->fd, &st) < 0)
+        return -1;
+    if ((size_t) st.st_size < need) {
+        if (pwrite(blk->fd, "", 1, (off_t) need - 1) != 1 ||
+            fstat(blk->fd, &st) < 0)
+            return -1;
+    }
 
-        case '!': {
-            /* Capture value to pointer from arguments */
-            uint16_t *ptr = va_arg(args, uint16_t *);
-            if (ptr) {
-                *ptr = val;
-            }
-            break;
-        }
+    size_t size = (size_t) st.st_size;
+    if (size == blk->size)
+        return 0;
+    if (blk->map)
+        munmap(blk->map, blk->size);
+    blk->map = NULL;
+    blk->size = 0;
+    if (size == 0)
+        return 0; /* Mapped on first write */
+
+    blk->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, blk->fd, 0);
+    if (blk->map == MAP_FAILED) {
+        blk->map = NULL;
+        return -1;
+    }
+    blk->size = size;
+    return 0;
+}
 
-        case '?':
-            /* Wildcard - matches any value, no operation needed */
-            break;
+/* Open (creating if needed) and map the block file at @path */
+static int blk_open(vm_t *vm, const char *path)
+{
+    vm->blk.fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (vm->blk.fd < 0)
+        return -1;
+    return blk_remap(vm, 0);
+}
 
-        case 'P':
-            /* Match positive value (non-zero, MSB clear) */
-            if (UNLIKELY(val == 0 || (val & (1U << (vm->nbits - 1))))) {
-                result = false;
-            }
-            break;
+/* Map the block file of @src into @vm as well. MAP_SHARED keeps every
+ * instance's view of the file coherent.
+ */
+static int blk_share(vm_t *vm, const vm_t *src)
+{
+    vm->blk.fd = dup(src->blk.fd);
+    if (vm->blk.fd < 0)
+        return -1;
+    return blk_remap(vm, 0);
+}
 
-        case 'M':
-            /* Match valid memory address */
-            if (UNLIKELY(val >= vm->mem_size && val != vm->mask)) {
-                result = false;
-            }
-            break;
+static void blk_close(vm_t *vm)
+{
+    block_dev_t *blk = &vm->blk;
+    if (blk->map) {
+        msync(blk->map, blk->size, MS_SYNC);
+        munmap(blk->map, blk->size);
+    }
+    if (blk->fd >= 0)
+        close(blk->fd);
+    blk->map = NULL;
+    blk->size = 0;
+    blk->fd = -1;
+}
 
-        case 'R': {
-            /* Match previously captured variable reference */
-            char var_ref = (char) va_arg(args, int);
-            int var_idx = var_ref - '0';
-            if (UNLIKELY(var_idx < 0 || var_idx > 9 ||
-                         opt->set[var_idx] != version ||
-                         opt->vars[var_idx] != val)) {
-                result = false;
-            }
-            break;
+/* Block device: copy a whole block between the mapped file and the buffer at
+ * DEV_BLK_ADDR. Blocks past the end of the file read as spaces; writing one
+ * extends the file.
+ */
+static int dev_block(vm_t *vm)
+{
+    block_dev_t *blk = &vm->blk;
+    uint16_t op = vm->mem[DEV_BLK_CMD];
+    uint16_t num = vm->mem[DEV_BLK_NUM];
+    uint16_t addr = vm->mem[DEV_BLK_ADDR];
+    size_t off = (size_t) num * BLOCK_BYTES;
+    int status = 0;
+
+    if (blk->fd < 0 ||
+        blk_remap(vm, op == DEV_BLK_WRITE ? off + BLOCK_BYTES : 0) < 0) {
+        status = -1;
+    } else if (op == DEV_BLK_READ) {
+        if (off + BLOCK_BYTES > blk->size) {
+            for (uint16_t i = 0; i < BLOCK_CELLS; i++)
+                vm->mem[MASK_ADDR(addr + i)] = 0x2020;
+        } else {
+            const uint8_t *src = blk->map + off;
+            for (uint16_t i = 0; i < BLOCK_CELLS; i++)
+                vm->mem[MASK_ADDR(addr + i)] =
+                    (uint16_t) (src[2 * i] | (src[2 * i + 1] << 8));
         }
-
-        default:
-            /* Unknown pattern symbol */
-            result = false;
-            break;
+        if (code_invalidate(vm, addr, BLOCK_CELLS) < 0)
+            return -1;
+    } else if (op == DEV_BLK_WRITE) {
+        uint8_t *dst = blk->map + off;
+        for (uint16_t i = 0; i < BLOCK_CELLS; i++) {
+            uint16_t cell = vm->mem[MASK_ADDR(addr + i)];
+            dst[2 * i] = (uint8_t) cell;
+            dst[2 * i + 1] = (uint8_t) (cell >> 8);
         }
-
-        /* Move to next memory location */
-        offset++;
+    } else if (op == DEV_BLK_FLUSH) {
+        if (blk->map && msync(blk->map, blk->size, MS_SYNC) < 0)
+            status = -1;
+    } else {
+        status = -1;
     }
 
-    va_end(args);
-    return result;
+    vm->mem[DEV_BLK_STATUS] = (uint16_t) status;
+    return 0;
 }
-
-/* Retrieve variables captured during pattern matching in the optimizer.
- * Variables are identified by single digits '0'-'9' and must be set in the
- * current optimizer version context to be considered valid.
- *
- * @opt: Pointer to optimizer state containing variable bindings
- * @var: Variable identifier character ('0' through '9')
- * Return the captured variable value, or 0xFFFF if variable is invalid/unset
- */
-static inline uint16_t get_var(const optimizer_t *opt, char var)
+#else
+/* Block storage needs mmap(); without it every block operation fails */
+static int blk_open(vm_t *vm, const char *path)
 {
-#if HAS_BUILTIN_CONSTANT_P
-    /* Fast path: compile-time bounds check for literal constants */
-    if (IS_COMPILE_TIME_CONSTANT(var)) {
-        if (var < '0' || var > '9')
-            return (uint16_t) -1;
-        const int idx = var - '0';
-        return (opt->set[idx] == opt->version) ? opt->vars[idx] : (uint16_t) -1;
-    }
-#endif
+    (void) vm;
+    (void) path;
+    return -1;
+}
 
-    /* Runtime path: single bounds check with early return */
-    const unsigned char uvar = (unsigned char) var;
-    if (UNLIKELY(uvar < '0' || uvar > '9'))
-        return (uint16_t) -1;
+static int blk_share(vm_t *vm, const vm_t *src)
+{
+    (void) vm;
+    (void) src;
+    return -1;
+}
 
-    const int idx = (int) (uvar - '0');
+static void blk_close(vm_t *vm)
+{
+    (void) vm;
+}
 
-    /* Branchless version check and value retrieval */
-    const bool is_set = (opt->set[idx] == opt->version);
-    return is_set ? opt->vars[idx] : (uint16_t) -1;
+static int dev_block(vm_t *vm)
+{
+    vm->mem[DEV_BLK_STATUS] = vm->mask;
+    return 0;
 }
+#endif
 
-/* Identifies common SUBLEQ sequences and replaces them with single extended
- * instructions. This optimization is crucial for improving the performance
- * of programs compiled to SUBLEQ, especially for high-level languages like
- * Forth which involve frequent stack, memory, and arithmetic operations that
- * translate into many primitive SUBLEQ instructions.
- *
- * @vm: Virtual machine context
- * @proglen: The total number of loaded SUBLEQ words in memory (vm->m)
+static int smp_start(vm_t *vm, uint16_t num, uint16_t pc);
+
+/* Start the CPU in DEV_CPU_NUM at DEV_CPU_PC. Each secondary CPU can be
+ * started once; a failure is reported in DEV_CPU_STATUS, not to the VM.
  */
-static void optimize(vm_t *vm, uint64_t proglen)
+static int dev_cpu(vm_t *vm)
 {
-    optimizer_t *opt = &vm->opt;
-    const uint16_t *mem = vm->mem;
-    insn_t *insn_mem = vm->insn_mem;
+    int status = smp_start(vm, vm->mem[DEV_CPU_NUM], vm->mem[DEV_CPU_PC]);
+    vm->mem[DEV_CPU_STATUS] = (uint16_t) status;
+    return 0;
+}
 
-    memset(opt->zero_reg, 0, sizeof(opt->zero_reg));
-    memset(opt->one_reg, 0, sizeof(opt->one_reg));
-    memset(opt->neg1_reg, 0, sizeof(opt->neg1_reg));
+/* Run the operation of the device whose command cell @cmd was output.
+ * Unassigned cells in the device page are ignored. Returns 0, -1 on error,
+ * or VM_IO_AGAIN if the operation must be retried once input is ready.
+ */
+static int dev_command(vm_t *vm, uint16_t cmd)
+{
+    switch (cmd) {
+    case DEV_LINE_CMD:
+        return dev_line_read(vm);
+    case DEV_TYPE_CMD:
+        return dev_type_write(vm);
+    case DEV_BLK_CMD:
+        return dev_block(vm);
+    case DEV_CPU_CMD:
+        return dev_cpu(vm);
+    default:
+        return 0;
+    }
+}
 
-    for (uint64_t i = 0; i < proglen; i++) {
-        opt->zero_reg[i] = (mem[i] == 0);
-        opt->one_reg[i] = (mem[i] == 1);
-        opt->neg1_reg[i] = (mem[i] == vm->mask);
+/* Forward declaration for the dispatcher with the unified signature */
+static void dispatch(vm_t *vm, uint64_t pc, const insn_t *insn);
 
-        insn_mem[i].opcode = SUBLEQ;
-        insn_mem[i].src = mem[MASK_ADDR(i)];
-        insn_mem[i].dst = mem[MASK_ADDR(i + 1)];
-        insn_mem[i].aux = mem[MASK_ADDR(i + 2)];
-    }
+/* Pattern analysis helper functions */
 
-    for (uint64_t i = 0; i < proglen; i++) {
-        size_t scan_depth = (i + OPTIMIZER_SCAN_DEPTH > proglen)
-                                ? proglen - i
-                                : OPTIMIZER_SCAN_DEPTH;
-        if (scan_depth == 0)
-            continue;
+/* Validate that a captured jump target matches the expected pattern structure.
+ * This ensures that the SUBLEQ sequences we're optimizing have the correct
+ * control flow relationships between instructions.
+ */
+static inline bool validate_jump_target(uint16_t target,
+                                        uint64_t base_pc,
+                                        int offset)
+{
+    return target == (uint16_t) (base_pc + offset);
+}
 
-        /* ISTORE: m[m[D]] = S */
-        if (match_pattern(vm, i, mem, (int) scan_depth,
-                          "0Z> 11> 22> Z3> Z4> ZZ> 56> 77> Z7> 6Z> ZZ> 66>")) {
-            insn_mem[i].opcode = ISTORE;
-            insn_mem[i].dst = MASK_ADDR(get_var(opt, '0'));
-            insn_mem[i].src = MASK_ADDR(get_var(opt, '5'));
-            opt->matches[ISTORE]++;
-            continue;
-        }
+/* Profiler helper functions */
+static void profiler_init(vm_t *vm)
+{
+    profiler_t *prof = &vm->prof;
 
-        /* ILOAD and LDINC fusion */
-        uint16_t iload_src_ptr = 0;
-        if (match_pattern(vm, i, mem, (int) scan_depth,
-                          "00> !Z> Z0> ZZ> 11> ?Z> Z1> ZZ>", &iload_src_ptr) &&
-            validate_jump_target(get_var(opt, '0'), i,
-                                 ILOAD_PATTERN_JUMP_OFFSET)) {
-            /* ILOAD pattern matched. Save its destination address before the
-             * next match_pattern call invalidates the optimizer version. */
-            uint16_t iload_dst = get_var(opt, '1');
+    if (prof->mine.top > 0) {
+        prof->mine.seqs = calloc(MINE_SLOTS, sizeof(*prof->mine.seqs));
+        prof->mining = prof->mine.seqs != NULL;
+        if (!prof->mining)
+            fprintf(stderr, "Warning: Failed to allocate miner memory\n");
+    }
 
-            uint16_t inc_src = 0, inc_dst = 0;
+    if (vm->sampler_enabled) { /* Takes the place of counting */
+        prof->enabled = false;
+        prof->pc_heat_map = pool_get(&heat_pool);
+        prof->sampling = prof->pc_heat_map != NULL;
+        if (!prof->sampling)
+            fprintf(stderr, "Warning: Failed to allocate profiler memory\n");
+        return;
+    }
 
-            /* Check for a subsequent INC pattern. */
-            if (scan_depth >= INSN_INCR_LDINC &&
-                match_pattern(vm, i + LDINC_INCREMENT_OFFSET, mem,
-                              (int) (scan_depth - LDINC_INCREMENT_OFFSET),
-                              "!!>", &inc_src, &inc_dst) &&
-                inc_src != inc_dst && opt->neg1_reg[MASK_ADDR(inc_src)] &&
-                inc_dst == iload_src_ptr) {
-                /* Success: Fuse into LDINC */
-                insn_mem[i].opcode = LDINC;
-                insn_mem[i].dst = MASK_ADDR(iload_dst);
-                insn_mem[i].src = MASK_ADDR(iload_src_ptr);
-                opt->matches[LDINC]++;
-                continue;
-            }
+    if (!vm->profiler_enabled) {
+        prof->enabled = false;
+        return;
+    }
 
-            /* If not fused, fall back to a regular ILOAD */
-            insn_mem[i].opcode = ILOAD;
-            insn_mem[i].dst = MASK_ADDR(iload_dst);
-            insn_mem[i].src = MASK_ADDR(iload_src_ptr);
-            opt->matches[ILOAD]++;
-            continue;
-        }
+    prof->enabled = true;
+    prof->total_instructions = 0;
+    prof->memory_accesses = 0;
+    memset(prof->op_accesses, 0, sizeof(prof->op_accesses));
+    prof->hot_spot_count = 0;
+    prof->start_time = clock();
 
-        /* LSHIFT: Left shift by constant */
-        uint16_t shift_count = 0;
-        uint16_t shift_dst = 0;
-        uint64_t shift_pos = 0;
-        while (shift_pos < scan_depth) {
-            uint16_t q0 = 0, q1 = 0;
-            if (scan_depth - shift_pos < 9)
-                break;
-            if (match_pattern(vm, i + shift_pos, mem,
-                              (int) (scan_depth - shift_pos), "!Z> Z!> ZZ>",
-                              &q0, &q1) &&
-                q0 == q1) {
-                if (shift_count == 0)
-                    shift_dst = q0;
-                else if (shift_dst != q0)
-                    break;
-                shift_count++;
-                shift_pos += 9;
-            } else {
-                break;
-            }
-        }
-        if (shift_count >= 2) {
-            insn_mem[i].opcode = LSHIFT;
-            insn_mem[i].dst = MASK_ADDR(shift_dst);
-            insn_mem[i].src = shift_count;
-            opt->matches[LSHIFT]++;
-            continue;
-        }
+    /* Allocate PC heat map and access counts if profiling enabled */
+    prof->pc_heat_map = pool_get(&heat_pool);
+    /* Rows of SZ per opcode and kind of access; only the pages an opcode
+     * touches get memory
+     */
+    prof->op_heat = calloc(OP_HEAT_ROW(IMAX, 0), sizeof(*prof->op_heat));
+    if (!prof->pc_heat_map || !prof->op_heat) {
+        fprintf(stderr, "Warning: Failed to allocate profiler memory\n");
+        prof->enabled = false;
+        return;
+    }
+}
 
-        /* IADD: m[m[D]] += S */
-        if (match_pattern(vm, i, mem, (int) scan_depth,
-                          "01> 23> 44> 14> 3Z> 11> 33>")) {
-            insn_mem[i].opcode = IADD;
-            insn_mem[i].dst = MASK_ADDR(get_var(opt, '0'));
-            insn_mem[i].src = MASK_ADDR(get_var(opt, '2'));
-            opt->matches[IADD]++;
-            continue;
-        }
+static void profiler_cleanup(vm_t *vm)
+{
+    profiler_t *prof = &vm->prof;
+    if (prof->pc_heat_map)
+        pool_put(&heat_pool, prof->pc_heat_map);
+    prof->pc_heat_map = NULL;
+    free(prof->op_heat);
+    prof->op_heat = NULL;
+    prof->enabled = false;
+    prof->sampling = false;
+    free(prof->forth.stacks);
+    free(prof->forth.index);
+    free(prof->forth.cells);
+    memset(&prof->forth, 0, sizeof(prof->forth));
+    free(prof->mine.seqs);
+    prof->mine.seqs = NULL;
+    prof->mining = false;
+}
 
-        /* INV: Bitwise NOT */
-        uint16_t inv_temp = 0;
-        if (match_pattern(vm, i, mem, (int) scan_depth,
-                          "00> 10> 11> 2Z> Z1> ZZ> !1>", &inv_temp) &&
-            opt->one_reg[inv_temp]) {
-            insn_mem[i].opcode = INV;
-            insn_mem[i].dst = MASK_ADDR(get_var(opt, '1'));
-            opt->matches[INV]++;
-            continue;
-        }
+/* Find the registers of the image's inner interpreter in the decoded code.
+ * NEXT loads the cell ip points at and steps ip, which decodes to LDINC,
+ * so ip is the pointer most LDINC entries step. A call pushes ip with an
+ * ISTORE through rp, and the INC or DEC of rp next to it tells which way
+ * the return stack grows. Code run undecoded (-O) has neither.
+ */
+static void words_locate(vm_t *vm)
+{
+    forth_prof_t *fp = &vm->prof.forth;
+    const insn_t *insn = vm->insn;
+    uint64_t end = vm->load_size < SZ ? vm->load_size : SZ;
 
-        /* ISUB: m[m[D]] -= S */
-        if (match_pattern(vm, i, mem, (int) scan_depth,
-                          "01> 33> 14> 5Z> 11>")) {
-            insn_mem[i].opcode = ISUB;
-            insn_mem[i].dst = MASK_ADDR(get_var(opt, '0'));
-            insn_mem[i].src = MASK_ADDR(get_var(opt, '5'));
-            opt->matches[ISUB]++;
-            continue;
+    uint32_t *uses = calloc(SZ, sizeof(*uses));
+    if (!uses)
+        return;
+    uint32_t most = 0;
+    for (uint64_t pc = 0; pc < end; pc++) {
+        if (insn[pc].opcode == LDINC && ++uses[insn[pc].src] > most) {
+            most = uses[insn[pc].src];
+            fp->ip = insn[pc].src;
         }
+    }
+    free(uses);
+    if (most == 0)
+        return;
 
-        /* IJMP: PC = m[D] */
-        uint16_t ijmp_temp = 0;
-        if (match_pattern(vm, i, mem, (int) scan_depth, "00> !Z> Z0> ZZ> ZZ>",
-                          &ijmp_temp) &&
-            validate_jump_target(get_var(opt, '0'), i,
-                                 IJMP_PATTERN_JUMP_OFFSET)) {
-            insn_mem[i].opcode = IJMP;
-            insn_mem[i].dst = MASK_ADDR(ijmp_temp);
-            opt->matches[IJMP]++;
+    for (uint64_t pc = 0; pc < end; pc++) {
+        if (insn[pc].opcode != ISTORE || insn[pc].src != fp->ip)
             continue;
+        if (!fp->located) { /* Defaults: pre-increment, growing upward */
+            fp->located = true;
+            fp->rp = insn[pc].dst;
+            fp->rdir = 1;
+            fp->push_first = true;
         }
 
-        /* MOV: Copy data */
-        uint16_t mov_src = 0;
-        if (match_pattern(vm, i, mem, (int) scan_depth, "00> !Z> Z0> ZZ>",
-                          &mov_src)) {
-            uint16_t dst = MASK_ADDR(get_var(opt, '0'));
-            uint16_t src = MASK_ADDR(mov_src);
-            if (dst != src) {
-                insn_mem[i].opcode = MOV;
-                insn_mem[i].dst = dst;
-                insn_mem[i].src = src;
-                opt->matches[MOV]++;
-                continue;
-            }
-        }
-
-        /* DOUBLE or ADD */
-        uint16_t arith_src = 0, arith_dst = 0;
-        if (match_pattern(vm, i, mem, (int) scan_depth, "!Z> Z!> ZZ>",
-                          &arith_src, &arith_dst)) {
-            if (arith_src == arith_dst) {
-                insn_mem[i].opcode = DOUBLE;
-                insn_mem[i].dst = MASK_ADDR(arith_dst);
-                insn_mem[i].src = MASK_ADDR(arith_src);
-                opt->matches[DOUBLE]++;
-            } else {
-                insn_mem[i].opcode = ADD;
-                insn_mem[i].dst = MASK_ADDR(arith_dst);
-                insn_mem[i].src = MASK_ADDR(arith_src);
-                opt->matches[ADD]++;
+        /* Look a few instructions either side of the store */
+        for (unsigned d = 1; d <= 4 * SUBLEQ_INSN_SIZE; d++) {
+            uint64_t at[2] = {pc - d, pc + INSN_INCR_ISTORE - 1 + d};
+            for (int k = 0; k < 2; k++) {
+                const insn_t *in = &insn[MASK_ADDR(at[k])];
+                if ((in->opcode != INC && in->opcode != DEC) ||
+                    in->dst != insn[pc].dst || at[k] >= end)
+                    continue;
+                fp->rp = insn[pc].dst;
+                fp->rdir = in->opcode == INC ? 1 : -1;
+                fp->push_first = k == 0;
+                goto found;
             }
-            continue;
-        }
-
-        /* NEG: Two's complement negation (dst = 0 - src)
-         * Pattern: SUBLEQ DST, DST, PC+3 (DST becomes 0)
-         *          SUBLEQ SRC, DST, PC+6 (DST becomes 0 - SRC)
-         * '0' is DST, '1' is SRC
-         */
-        if (match_pattern(vm, i, mem, (int) scan_depth, "00> 10>")) {
-            insn_mem[i].opcode = NEG;
-            insn_mem[i].dst = MASK_ADDR(get_var(opt, '0'));
-            insn_mem[i].src = MASK_ADDR(get_var(opt, '1'));
-            opt->matches[NEG]++;
-            continue;
         }
+    }
+    if (!fp->located)
+        return;
+found:
+    fp->rp0 = vm->mem[fp->rp];
+    fp->countdown = WORDS_STRIDE;
+}
 
-        /* ZERO: Clear memory */
-        if (match_pattern(vm, i, mem, (int) scan_depth, "00>")) {
-            insn_mem[i].opcode = ZERO;
-            insn_mem[i].dst = MASK_ADDR(get_var(opt, '0'));
-            opt->matches[ZERO]++;
-            continue;
-        }
+static uint32_t words_hash(const uint16_t *cells, uint32_t depth)
+{
+    uint32_t h = 2166136261u; /* FNV-1a */
+    for (uint32_t k = 0; k < depth; k++)
+        h = (h ^ cells[k]) * 16777619u;
+    return h;
+}
 
-        /* HALT: Terminate */
-        uint16_t halt_addr = 0;
-        if (match_pattern(vm, i, mem, (int) scan_depth, "ZZ!", &halt_addr) &&
-            halt_addr == vm->mask) {
-            insn_mem[i].opcode = HALT;
-            opt->matches[HALT]++;
-            continue;
+/* Make room for one more stack of @depth cells. Returns 0 or -1. */
+static int words_reserve(forth_prof_t *fp, uint32_t depth)
+{
+    if (fp->nstacks == fp->stacks_cap) {
+        size_t cap = fp->stacks_cap ? 2 * fp->stacks_cap : 256;
+        fstack_t *stacks = realloc(fp->stacks, cap * sizeof(*stacks));
+        if (!stacks)
+            return -1;
+        fp->stacks = stacks;
+        fp->stacks_cap = cap;
+    }
+    if (fp->ncells + depth > fp->cells_cap) {
+        size_t cap = fp->cells_cap ? 2 * fp->cells_cap : 4096;
+        uint16_t *cells = realloc(fp->cells, cap * sizeof(*cells));
+        if (!cells)
+            return -1;
+        fp->cells = cells;
+        fp->cells_cap = cap;
+    }
+    if (2 * (fp->nstacks + 1) > fp->index_cap) { /* Rehash */
+        size_t cap = fp->index_cap ? 2 * fp->index_cap : 512;
+        uint32_t *index = calloc(cap, sizeof(*index));
+        if (!index)
+            return -1;
+        for (size_t i = 0; i < fp->nstacks; i++) {
+            const fstack_t *st = &fp->stacks[i];
+            size_t h = words_hash(fp->cells + st->off, st->depth) & (cap - 1);
+            while (index[h])
+                h = (h + 1) & (cap - 1);
+            index[h] = (uint32_t) i + 1;
         }
+        free(fp->index);
+        fp->index = index;
+        fp->index_cap = cap;
+    }
+    return 0;
+}
 
-        /* JMP: Unconditional jump */
-        uint16_t jmp_target = 0;
-        if (match_pattern(vm, i, mem, (int) scan_depth, "00!", &jmp_target)) {
-            if (jmp_target == i) { /* Check for infinite loop */
-                insn_mem[i].opcode = HALT;
-                opt->matches[HALT]++;
-            } else {
-                insn_mem[i].opcode = JMP;
-                insn_mem[i].dst = jmp_target;
-                /* var '0' is the address being zeroed by the JMP sequence */
-                insn_mem[i].src = MASK_ADDR(get_var(opt, '0'));
-                opt->matches[JMP]++;
-            }
-            continue;
+/* Record the Forth call stack @vm is in as one sample: ip, then the
+ * return stack from its top down to where it stood when located
+ */
+static void words_sample(vm_t *vm)
+{
+    forth_prof_t *fp = &vm->prof.forth;
+    uint16_t stack[WORDS_MAX_DEPTH + 1];
+    uint32_t depth = 0;
+
+    stack[depth++] = vm->mem[fp->ip];
+    uint16_t rp = vm->mem[fp->rp];
+    uint16_t used = (uint16_t) ((rp - fp->rp0) * fp->rdir);
+    uint16_t top = fp->push_first ? rp : (uint16_t) (rp - fp->rdir);
+    if (used >= SZ / 2) /* Below its base: another task's stack */
+        used = 0;
+    for (uint16_t k = 0; k < used && depth <= WORDS_MAX_DEPTH; k++)
+        stack[depth++] = vm->mem[(uint16_t) (top - k * fp->rdir)];
+
+    uint32_t h = words_hash(stack, depth);
+    for (size_t i = fp->index_cap ? h & (fp->index_cap - 1) : 0;
+         fp->index_cap && fp->index[i]; i = (i + 1) & (fp->index_cap - 1)) {
+        fstack_t *st = &fp->stacks[fp->index[i] - 1];
+        if (st->depth == depth &&
+            !memcmp(fp->cells + st->off, stack, depth * sizeof(*stack))) {
+            st->count++;
+            return;
         }
+    }
 
-        /* GET: Input character */
-        uint16_t get_dst = 0;
-        if (match_pattern(vm, i, mem, (int) scan_depth, "N!>", &get_dst)) {
-            insn_mem[i].opcode = GET;
-            insn_mem[i].dst = MASK_ADDR(get_dst);
-            opt->matches[GET]++;
-            continue;
-        }
+    if (fp->nstacks >= WORDS_MAX_STACKS || words_reserve(fp, depth) < 0) {
+        fp->dropped++;
+        return;
+    }
+    size_t i = h & (fp->index_cap - 1);
+    while (fp->index[i])
+        i = (i + 1) & (fp->index_cap - 1);
+    fp->index[i] = (uint32_t) fp->nstacks + 1;
+    fp->stacks[fp->nstacks++] = (fstack_t){
+        .count = 1,
+        .off = (uint32_t) fp->ncells,
+        .depth = depth,
+    };
+    memcpy(fp->cells + fp->ncells, stack, depth * sizeof(*stack));
+    fp->ncells += depth;
+}
 
-        /* PUT: Output character */
-        uint16_t put_src = 0;
-        if (match_pattern(vm, i, mem, (int) scan_depth, "!N>", &put_src)) {
-            insn_mem[i].opcode = PUT;
-            insn_mem[i].src = MASK_ADDR(put_src);
-            opt->matches[PUT]++;
-            continue;
-        }
+/* Pattern DSL symbol for word @w of a plain SUBLEQ, whose next word is
+ * at @next. Other values become variables numbered in order of first use.
+ */
+static char mine_symbol(const vm_t *vm,
+                        uint16_t w,
+                        uint64_t next,
+                        uint16_t *vars,
+                        unsigned *nvars)
+{
+    if (w == 0)
+        return 'Z';
+    if (w == vm->mask)
+        return 'N';
+    if (w == MASK_ADDR(next))
+        return '>';
+    for (unsigned v = 0; v < *nvars; v++) {
+        if (vars[v] == w)
+            return (char) ('0' + v);
+    }
+    if (*nvars == 10)
+        return '?';
+    vars[*nvars] = w;
+    return (char) ('0' + (*nvars)++);
+}
 
-        /* INC/DEC/SUB */
-        uint16_t sub_src = 0, sub_dst = 0;
-        if (match_pattern(vm, i, mem, (int) scan_depth, "!!>", &sub_src,
-                          &sub_dst) &&
-            sub_src != sub_dst) {
-            if (opt->neg1_reg[MASK_ADDR(sub_src)]) {
-                insn_mem[i].opcode = INC;
-                insn_mem[i].dst = MASK_ADDR(sub_dst);
-                opt->matches[INC]++;
-            } else if (opt->one_reg[MASK_ADDR(sub_src)]) {
-                insn_mem[i].opcode = DEC;
-                insn_mem[i].dst = MASK_ADDR(sub_dst);
-                opt->matches[DEC]++;
-            } else {
-                insn_mem[i].opcode = SUB;
-                insn_mem[i].dst = MASK_ADDR(sub_dst);
-                insn_mem[i].src = MASK_ADDR(sub_src);
-                opt->matches[SUB]++;
-            }
+/* Count the run of plain SUBLEQ instructions just ended by its pattern */
+static void mine_flush(vm_t *vm)
+{
+    miner_t *m = &vm->prof.mine;
+    char pattern[4 * MINE_MAX_LEN];
+    uint16_t vars[10];
+    unsigned nvars = 0;
+    size_t n = 0;
+
+    for (unsigned i = 0; i < m->len; i++) {
+        const insn_t *in = &vm->insn[m->run[i]];
+        uint16_t w[3] = {in->src, in->dst, in->aux};
+        if (i > 0)
+            pattern[n++] = ' ';
+        for (unsigned k = 0; k < 3; k++)
+            pattern[n++] = mine_symbol(vm, w[k], m->run[i] + k + 1, vars,
+                                       &nvars);
+    }
+    pattern[n] = '\0';
+
+    uint32_t h = 2166136261u; /* FNV-1a */
+    for (size_t k = 0; k < n; k++)
+        h = (h ^ (unsigned char) pattern[k]) * 16777619u;
+    for (unsigned probe = 0; probe < MINE_SLOTS; probe++) {
+        mine_seq_t *seq = &m->seqs[(h + probe) & (MINE_SLOTS - 1)];
+        if (!seq->pattern[0]) {
+            memcpy(seq->pattern, pattern, n + 1);
+            seq->len = m->len;
+        } else if (strcmp(seq->pattern, pattern)) {
             continue;
         }
-
-        /* Default to SUBLEQ */
-        insn_mem[i].opcode = SUBLEQ;
-        insn_mem[i].src = mem[MASK_ADDR(i)];
-        insn_mem[i].dst = mem[MASK_ADDR(i + 1)];
-        insn_mem[i].aux = mem[MASK_ADDR(i + 2)];
-        opt->matches[SUBLEQ]++;
+        seq->count++;
+        m->len = 0;
+        return;
     }
+    m->dropped++;
+    m->len = 0;
 }
 
-/* Generate hot spots analysis from PC heat map */
-static void profiler_analyze_hot_spots(vm_t *vm)
+/* Extend the current run of plain SUBLEQ instructions with the one at @pc,
+ * after ending the run at any other opcode, after a jump, or once it is
+ * MINE_MAX_LEN long
+ */
+COLD_PATH static void mine_step(vm_t *vm, uint64_t pc)
+{
+    miner_t *m = &vm->prof.mine;
+    bool plain = vm->insn[pc].opcode == SUBLEQ;
+
+    if (m->len > 0 &&
+        (!plain || pc != m->run[m->len - 1] + SUBLEQ_INSN_SIZE ||
+         m->len == MINE_MAX_LEN))
+        mine_flush(vm);
+    if (plain)
+        m->run[m->len++] = pc;
+}
+
+static inline void profiler_record_pc(vm_t *vm, uint64_t pc, uint8_t opcode)
 {
     profiler_t *prof = &vm->prof;
 
-    if (!prof->enabled || !prof->pc_heat_map)
+    if (!prof->hooked)
+        return;
+    if (UNLIKELY(prof->mining))
+        mine_step(vm, pc);
+    if (!prof->enabled)
         return;
 
-    prof->hot_spot_count = 0;
+    prof->total_instructions++;
+    prof->opcode = opcode;
 
-    /* Find hot spots and sort by execution count */
-    for (uint64_t pc = 0;
-         pc < vm->mem_size && prof->hot_spot_count < MAX_HOT_SPOTS; pc++) {
-        if (prof->pc_heat_map[pc] > 100) { /* Only significant hot spots */
-            hot_spot_t spot = {
-                .pc = pc,
-                .exec_count = prof->pc_heat_map[pc],
-                .opcode = vm->insn_mem[pc].opcode,
+    /* Record PC heat map every instruction */
+    if (prof->pc_heat_map)
+        prof->pc_heat_map[pc]++;
+
+    if (UNLIKELY(prof->forth.located && --prof->forth.countdown == 0)) {
+        prof->forth.countdown = WORDS_STRIDE;
+        words_sample(vm);
+    }
+}
+
+/* Kinds of memory access for profiler_record_memory_access() */
+#define MEM_READ false
+#define MEM_WRITE true
+
+static inline void profiler_record_memory_access(vm_t *vm,
+                                                 uint16_t addr,
+                                                 bool write)
+{
+    profiler_t *prof = &vm->prof;
+    if (prof->enabled)
+        prof->op_heat[OP_HEAT_ROW(prof->opcode, write) + addr]++;
+}
+
+static void trace_flush(vm_t *vm)
+{
+    trace_t *t = &vm->trace;
+    if (t->len > 0 && fwrite(t->buf, 1, t->len, t->out) != t->len) {
+        fprintf(stderr, "Warning: Failed to write trace, stopped recording\n");
+        t->on = false;
+    }
+    t->len = 0;
+}
+
+static void trace_put(vm_t *vm, uint64_t v)
+{
+    trace_t *t = &vm->trace;
+    if (t->len + 10 > TRACE_BUF_SIZE)
+        trace_flush(vm);
+    while (v >= 0x80) {
+        t->buf[t->len++] = (uint8_t) (v | 0x80);
+        v >>= 7;
+    }
+    t->buf[t->len++] = (uint8_t) v;
+}
+
+/* Signed distance as a varint-friendly unsigned: 0, -1, 1, -2, ... */
+static uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+/* Write the repeats of the last branch before any other record */
+static void trace_repeats(vm_t *vm)
+{
+    trace_t *t = &vm->trace;
+    if (t->repeats > 0) {
+        trace_put(vm, TRACE_REPEAT);
+        trace_put(vm, t->repeats);
+        t->repeats = 0;
+    }
+}
+
+/* Record the cells changed since the last checkpoint as runs: unchanged
+ * cells to skip, then changed cells and their values
+ */
+static void trace_mem(vm_t *vm, uint64_t pc)
+{
+    trace_t *t = &vm->trace;
+
+    trace_repeats(vm);
+    trace_put(vm, TRACE_MEM);
+    trace_put(vm, vm->insns);
+    trace_put(vm, pc);
+    for (uint32_t a = 0; a < SZ;) {
+        uint32_t same = a, diff;
+        while (same < SZ && vm->mem[same] == t->mem[same])
+            same++;
+        for (diff = same; diff < SZ && vm->mem[diff] != t->mem[diff]; diff++)
+            t->mem[diff] = vm->mem[diff];
+        trace_put(vm, same - a);
+        trace_put(vm, diff - same);
+        for (uint32_t k = same; k < diff; k++)
+            trace_put(vm, t->mem[k]);
+        a = diff;
+    }
+    t->next_mem = vm->insns + TRACE_MEM_INSNS;
+}
+
+/* Start the trace file at @path. Returns 0 or -1. */
+static int trace_open(vm_t *vm, const char *path)
+{
+    trace_t *t = &vm->trace;
+
+    t->out = fopen(path, "wb");
+    t->buf = malloc(TRACE_BUF_SIZE);
+    t->mem = calloc(SZ, sizeof(uint16_t));
+    if (!t->out || !t->buf || !t->mem)
+        return -1;
+    memcpy(t->buf, TRACE_MAGIC, 4);
+    t->len = 4;
+    trace_put(vm, TRACE_VERSION);
+    t->on = true;
+    return 0;
+}
+
+static void trace_close(vm_t *vm)
+{
+    trace_t *t = &vm->trace;
+    if (t->out) {
+        if (t->on)
+            trace_flush(vm);
+        if (fclose(t->out) < 0)
+            fprintf(stderr, "Warning: Failed to close trace file\n");
+    }
+    free(t->buf);
+    free(t->mem);
+    memset(t, 0, sizeof(*t));
+}
+
+/* A run starts at vm->pc; check memory first if it is due, as on the
+ * first run, or after a vm_reset()
+ */
+static void trace_run(vm_t *vm)
+{
+    trace_t *t = &vm->trace;
+
+    trace_put(vm, TRACE_RUN);
+    trace_put(vm, vm->pc);
+    trace_put(vm, vm->insns);
+    t->block = vm->pc;
+    t->insns = vm->insns;
+    if (vm->insns >= t->next_mem)
+        trace_mem(vm, vm->pc);
+    vm->insn_limit = 0;
+}
+
+/* The run stopped inside the block, at vm->pc */
+static void trace_end(vm_t *vm)
+{
+    trace_t *t = &vm->trace;
+
+    trace_repeats(vm);
+    trace_put(vm, TRACE_END);
+    trace_put(vm, vm->pc);
+    trace_put(vm, vm->insns - t->insns);
+    t->insns = vm->insns;
+    trace_flush(vm);
+}
+
+/* End the running basic block with a branch to @target. The branch is
+ * found by stepping through the block's decoded entries rather than
+ * passed in, which would keep the pc of every handler alive to here.
+ */
+COLD_PATH static void trace_branch(vm_t *vm, uint64_t target)
+{
+    trace_t *t = &vm->trace;
+    uint64_t insns = vm->insns - t->insns;
+    uint64_t pc = t->block;
+
+    for (uint64_t k = 1; k < insns; k++)
+        pc = MASK_ADDR(pc + insn_incr[vm->insn[pc].opcode]);
+
+    /* A block branching to itself as it did last time: count it */
+    if (target == t->block && t->last[0] == t->block && t->last[1] == pc &&
+        t->last[2] == insns) {
+        t->repeats++;
+    } else {
+        trace_repeats(vm);
+        trace_put(vm, zigzag((int64_t) (pc - t->block)) << 1);
+        trace_put(vm, zigzag((int64_t) (target - pc)));
+        trace_put(vm, insns);
+        t->last[0] = t->block;
+        t->last[1] = pc;
+        t->last[2] = insns;
+    }
+    t->block = target;
+    t->insns = vm->insns;
+    if (vm->insns >= t->next_mem)
+        trace_mem(vm, target);
+}
+
+static void perf_drain(vm_t *vm);
+static bool perf_start(vm_t *vm);
+static void perf_stop(vm_t *vm);
+static void perf_close(vm_t *vm);
+
+/* Clear @flag, set by a signal handler, and tell whether it was set. A
+ * plain load first keeps the locked exchange off a trace's every branch.
+ */
+static inline bool take_flag(bool *flag)
+{
+    return __atomic_load_n(flag, __ATOMIC_RELAXED) &&
+           __atomic_exchange_n(flag, false, __ATOMIC_RELAXED);
+}
+
+/* Slow path of BRANCH_CHECKPOINT: trace the branch, take the sample the
+ * profiler's timer asked for, drain the hardware counters' samples and
+ * print the live dump, if due, and tell whether the budget is spent.
+ */
+static inline bool branch_checkpoint(vm_t *vm, uint64_t target)
+{
+    profiler_t *prof = &vm->prof;
+    if (vm->trace.on)
+        trace_branch(vm, target);
+    if (take_flag(&vm->perf.pending))
+        perf_drain(vm);
+    if (take_flag(&prof->sample_pending)) {
+        prof->pc_heat_map[target]++;
+        prof->samples++;
+        if (prof->forth.located)
+            words_sample(vm);
+    }
+    if (vm->live_enabled && take_flag(&live_pending))
+        live_dump(vm);
+    vm->insn_limit = vm->trace.on ? 0 : vm->insn_end;
+    return vm->insns >= vm->insn_end;
+}
+
+/* Preemption point, placed only on taken branches so straight-line code
+ * pays nothing for it. Once the budget of vm_run() is spent, record where
+ * to resume and unwind to the caller. The sampling profiler drops the
+ * limit to 0 to be called here with the pc of a running VM, and a trace
+ * keeps it at 0 to see every taken branch.
+ */
+#define BRANCH_CHECKPOINT(target)                                 \
+    do {                                                          \
+        if (UNLIKELY(vm->insns >= vm->insn_limit) &&              \
+            branch_checkpoint(vm, (target))) {                    \
+            vm->pc = (target);                                    \
+            return;                                               \
+        }                                                         \
+    } while (0)
+
+/* Park the VM on the instruction at @pc, which found no input ready, and
+ * take back what executing it counted since it will run again on resume:
+ * its execution counts, its place in the miner's current run and its step
+ * of the words sampling countdown.
+ */
+static void input_suspend(vm_t *vm, uint64_t pc, uint8_t opcode)
+{
+    vm->pc = pc;
+    vm->need_input = true;
+    vm->insns--;
+    vm->opt.exec_count[opcode]--;
+    if (vm->prof.mining && vm->insn[pc].opcode == SUBLEQ)
+        vm->prof.mine.len--; /* mine_step() appended @pc */
+    if (vm->prof.enabled) {
+        vm->prof.total_instructions--;
+        if (vm->prof.pc_heat_map)
+            vm->prof.pc_heat_map[pc]--;
+        if (vm->prof.forth.located)
+            vm->prof.forth.countdown++;
+    }
+}
+
+/* Input or a device returned the failure @status. VM_IO_AGAIN suspends the
+ * VM on the current instruction; anything else stops it with an error.
+ */
+#define INPUT_FAILED(status)                         \
+    do {                                             \
+        if ((status) == VM_IO_AGAIN)                 \
+            input_suspend(vm, pc, insn->opcode);     \
+        else                                         \
+            vm->error = -1;                          \
+        return;                                      \
+    } while (0)
+
+/* Define instruction handlers.
+ * It accepts a pointer to the current instruction (@insn) to avoid redundant
+ * memory lookups for its operands. The tail call to dispatch passes NULL for
+ * the unused @insn parameter to maintain signature compatibility, which is
+ * required for the 'musttail' attribute.
+ */
+#define HANDLE(inst, body)                                    \
+    HOT_PATH HANDLER_SECTION static void handle_##inst(       \
+        vm_t *vm, uint64_t pc, const insn_t *insn)            \
+    {                                                         \
+        (void) pc;                                            \
+        (void) insn;                                          \
+                                                              \
+        /* Profiler hook - record PC execution */             \
+        profiler_record_pc(vm, pc, inst);                     \
+                                                              \
+        uint64_t next_pc = pc + INSN_INCR_##inst;             \
+        do                                                    \
+            body while (0);                                   \
+        if (UNLIKELY(vm->error))                              \
+            return;                                           \
+        MUST_TAIL return dispatch(vm, next_pc, NULL);         \
+    }
+
+/* SUBLEQ: Subtract and branch if less than or equal to zero */
+HANDLE(SUBLEQ, {
+    /* Operands are pre-fetched from memory by the optimizer */
+    uint16_t a = insn->src;
+    uint16_t b = insn->dst;
+    uint16_t c = insn->aux;
+
+    if (UNLIKELY(a == vm->mask)) { /* Input */
+        int ch = vm_getch(vm);
+        if (UNLIKELY(ch < 0))
+            INPUT_FAILED(ch);
+        vm->mem[MASK_ADDR(b)] = (uint16_t) ch;
+        profiler_record_memory_access(vm, MASK_ADDR(b), MEM_WRITE);
+    } else if (UNLIKELY(b == vm->mask)) { /* Output */
+        profiler_record_memory_access(vm, MASK_ADDR(a), MEM_READ);
+        if (vm->devices_enabled && MASK_ADDR(a) >= DEV_BASE) {
+            int status = dev_command(vm, MASK_ADDR(a));
+            if (UNLIKELY(status < 0))
+                INPUT_FAILED(status);
+        } else if (UNLIKELY(vm_putch(vm, vm->mem[MASK_ADDR(a)]) < 0)) {
+            vm->error = -1;
+            return;
+        }
+    } else { /* Standard SUBLEQ */
+        uint16_t la = MASK_ADDR(a);
+        uint16_t lb = MASK_ADDR(b);
+        profiler_record_memory_access(vm, la, MEM_READ);
+        profiler_record_memory_access(vm, lb, MEM_READ);
+        uint16_t result = vm->mem[lb] - vm->mem[la];
+        vm->mem[lb] = result;
+        profiler_record_memory_access(vm, lb, MEM_WRITE);
+        if (UNLIKELY(lb > vm->max_addr))
+            vm->max_addr = lb;
+        if (result == 0 || (result & (1U << (vm->nbits - 1)))) {
+            next_pc = c;
+            BRANCH_CHECKPOINT(next_pc);
+        }
+    }
+})
+
+/* ATOMIC: SUBLEQ as run by the CPUs of vm_run_smp(). The subtraction is
+ * an atomic fetch-sub on the shared memory, and DEV_CPU_ID reads as the
+ * number of the CPU running it.
+ */
+HANDLE(ATOMIC, {
+    uint16_t a = insn->src;
+    uint16_t b = insn->dst;
+    uint16_t c = insn->aux;
+
+    if (UNLIKELY(a == vm->mask)) { /* Input */
+        int ch = vm_getch(vm);
+        if (UNLIKELY(ch < 0))
+            INPUT_FAILED(ch);
+        __atomic_store_n(&vm->mem[MASK_ADDR(b)], (uint16_t) ch,
+                         __ATOMIC_SEQ_CST);
+    } else if (UNLIKELY(b == vm->mask)) { /* Output */
+        if (vm->devices_enabled && MASK_ADDR(a) >= DEV_BASE) {
+            int status = dev_command(vm, MASK_ADDR(a));
+            if (UNLIKELY(status < 0))
+                INPUT_FAILED(status);
+        } else if (UNLIKELY(vm_putch(vm, vm->mem[MASK_ADDR(a)]) < 0)) {
+            vm->error = -1;
+            return;
+        }
+    } else {
+        uint16_t la = MASK_ADDR(a);
+        uint16_t lb = MASK_ADDR(b);
+        uint16_t sub = la == DEV_CPU_ID
+                           ? (uint16_t) vm->cpu_id
+                           : __atomic_load_n(&vm->mem[la], __ATOMIC_RELAXED);
+        uint16_t result =
+            __atomic_sub_fetch(&vm->mem[lb], sub, __ATOMIC_SEQ_CST);
+        if (UNLIKELY(lb > vm->max_addr))
+            vm->max_addr = lb;
+        if (result == 0 || (result & (1U << (vm->nbits - 1)))) {
+            next_pc = c;
+            BRANCH_CHECKPOINT(next_pc);
+        }
+    }
+})
+
+/* JMP: Unconditional jump */
+HANDLE(JMP, {
+    uint16_t dst = insn->dst;
+    /* Often the address cleared to 0 by the JMP sequence */
+    uint16_t src = insn->src;
+    vm->mem[MASK_ADDR(src)] = 0;
+    profiler_record_memory_access(vm, MASK_ADDR(src), MEM_WRITE);
+    next_pc = dst;
+    BRANCH_CHECKPOINT(next_pc);
+})
+
+/* MOV: Move data */
+HANDLE(MOV, {
+    uint16_t dst = MASK_ADDR(insn->dst);
+    uint16_t src = MASK_ADDR(insn->src);
+    profiler_record_memory_access(vm, src, MEM_READ);
+    /* Avoid redundant move */
+    if (LIKELY(src != dst))
+        vm->mem[dst] = vm->mem[src];
+    profiler_record_memory_access(vm, dst, MEM_WRITE);
+})
+
+/* ADD: Addition */
+HANDLE(ADD, {
+    uint16_t dst = MASK_ADDR(insn->dst);
+    uint16_t src = MASK_ADDR(insn->src);
+    profiler_record_memory_access(vm, src, MEM_READ);
+    profiler_record_memory_access(vm, dst, MEM_READ);
+
+    /* Fast path for common values */
+    uint16_t src_val = vm->mem[src];
+    if (LIKELY(src_val != 0)) {
+        if (src_val == 1) {
+            vm->mem[dst]++;
+        } else {
+            vm->mem[dst] += src_val;
+        }
+    }
+    /* src_val == 0: no-op, skip write */
+    profiler_record_memory_access(vm, dst, MEM_WRITE);
+})
+
+/* SUB: Subtraction */
+HANDLE(SUB, {
+    uint16_t dst = MASK_ADDR(insn->dst);
+    uint16_t src = MASK_ADDR(insn->src);
+    profiler_record_memory_access(vm, src, MEM_READ);
+    profiler_record_memory_access(vm, dst, MEM_READ);
+
+    /* Fast path for common values */
+    uint16_t src_val = vm->mem[src];
+    if (LIKELY(src_val != 0)) {
+        if (src_val == 1) {
+            vm->mem[dst]--;
+        } else {
+            vm->mem[dst] -= src_val;
+        }
+    }
+    /* src_val == 0: no-op, skip write */
+    profiler_record_memory_access(vm, dst, MEM_WRITE);
+})
+
+/* ZERO: Clear memory location */
+HANDLE(ZERO, {
+    uint16_t dst = insn->dst;
+    vm->mem[MASK_ADDR(dst)] = 0;
+    profiler_record_memory_access(vm, MASK_ADDR(dst), MEM_WRITE);
+})
+
+/* PUT: Output character */
+HANDLE(PUT, {
+    uint16_t src = insn->src;
+    profiler_record_memory_access(vm, MASK_ADDR(src), MEM_READ);
+    if (UNLIKELY(vm_putch(vm, vm->mem[MASK_ADDR(src)]) < 0)) {
+        vm->error = -1;
+        return;
+    }
+})
+
+/* GET: Input character */
+HANDLE(GET, {
+    uint16_t dst = insn->dst;
+    int ch = vm_getch(vm);
+    if (UNLIKELY(ch < 0))
+        INPUT_FAILED(ch);
+    vm->mem[MASK_ADDR(dst)] = (uint16_t) ch;
+    profiler_record_memory_access(vm, MASK_ADDR(dst), MEM_WRITE);
+})
+
+/* DEV: Memory-mapped device command */
+HANDLE(DEV, {
+    int status = dev_command(vm, insn->src);
+    if (UNLIKELY(status < 0))
+        INPUT_FAILED(status);
+})
+
+/* HALT: Terminate program */
+HANDLE(HALT, {
+    /* Set PC beyond valid range to stop execution */
+    vm->pc = vm->mem_size / 2;
+    return;
+})
+
+/* IADD: Indirect addition */
+HANDLE(IADD, {
+    uint16_t dst = insn->dst;
+    uint16_t src = insn->src;
+    uint16_t addr = MASK_ADDR(vm->mem[MASK_ADDR(dst)]);
+    profiler_record_memory_access(vm, MASK_ADDR(dst), MEM_READ); /* Pointer */
+    profiler_record_memory_access(vm, MASK_ADDR(src), MEM_READ);
+    profiler_record_memory_access(vm, addr, MEM_READ);
+    vm->mem[addr] += vm->mem[MASK_ADDR(src)];
+    profiler_record_memory_access(vm, addr, MEM_WRITE);
+})
+
+/* ISUB: Indirect subtraction */
+HANDLE(ISUB, {
+    uint16_t dst = insn->dst;
+    uint16_t src = insn->src;
+    uint16_t addr = MASK_ADDR(vm->mem[MASK_ADDR(dst)]);
+    profiler_record_memory_access(vm, MASK_ADDR(dst), MEM_READ); /* Pointer */
+    profiler_record_memory_access(vm, MASK_ADDR(src), MEM_READ);
+    profiler_record_memory_access(vm, addr, MEM_READ);
+    vm->mem[addr] -= vm->mem[MASK_ADDR(src)];
+    profiler_record_memory_access(vm, addr, MEM_WRITE);
+})
+
+/* IJMP: Indirect jump */
+HANDLE(IJMP, {
+    uint16_t dst = insn->dst;
+    profiler_record_memory_access(vm, MASK_ADDR(dst), MEM_READ);
+    next_pc = vm->mem[MASK_ADDR(dst)];
+    BRANCH_CHECKPOINT(next_pc);
+})
+
+/* ILOAD: Indirect load */
+HANDLE(ILOAD, {
+    uint16_t src = MASK_ADDR(insn->src);
+    uint16_t dst = MASK_ADDR(insn->dst);
+    profiler_record_memory_access(vm, src, MEM_READ); /* Pointer */
+    uint16_t addr = vm->mem[src];
+
+    /* Special handling for input from I/O address (vm->mask) */
+    if (UNLIKELY(addr == vm->mask)) {
+        int ch = vm_getch(vm);
+        if (UNLIKELY(ch < 0))
+            INPUT_FAILED(ch);
+        vm->mem[dst] = (uint16_t) (-ch); /* Negated input value */
+    } else {
+        /* Optimized: pre-mask address for better performance */
+        profiler_record_memory_access(vm, MASK_ADDR(addr), MEM_READ);
+        vm->mem[dst] = vm->mem[MASK_ADDR(addr)];
+    }
+    profiler_record_memory_access(vm, dst, MEM_WRITE);
+})
+
+/* LDINC: D = m[m[S]], then m[S]++ */
+HANDLE(LDINC, {
+    uint16_t src_ptr = MASK_ADDR(insn->src); /* S */
+    uint16_t dst = MASK_ADDR(insn->dst);     /* D */
+    profiler_record_memory_access(vm, src_ptr, MEM_READ);
+    uint16_t addr = vm->mem[src_ptr];
+
+    /* Special handling for input from I/O address (vm->mask) */
+    if (UNLIKELY(addr == vm->mask)) {
+        int ch = vm_getch(vm);
+        if (UNLIKELY(ch < 0))
+            INPUT_FAILED(ch);
+        vm->mem[dst] = (uint16_t) (-ch); /* Negated input value */
+    } else {
+        profiler_record_memory_access(vm, MASK_ADDR(addr), MEM_READ);
+        vm->mem[dst] = vm->mem[MASK_ADDR(addr)];
+    }
+
+    /* Post-increment the source pointer */
+    vm->mem[src_ptr]++;
+    profiler_record_memory_access(vm, dst, MEM_WRITE);
+    profiler_record_memory_access(vm, src_ptr, MEM_WRITE);
+})
+
+/* ISTORE: Indirect store */
+HANDLE(ISTORE, {
+    uint16_t src = MASK_ADDR(insn->src);
+    uint16_t dst = MASK_ADDR(insn->dst);
+    profiler_record_memory_access(vm, src, MEM_READ);
+    profiler_record_memory_access(vm, dst, MEM_READ); /* Pointer */
+    uint16_t addr = MASK_ADDR(vm->mem[dst]);
+    vm->mem[addr] = vm->mem[src];
+    profiler_record_memory_access(vm, addr, MEM_WRITE);
+})
+
+/* INC: Increment by 1 */
+HANDLE(INC, {
+    uint16_t dst = MASK_ADDR(insn->dst);
+    profiler_record_memory_access(vm, dst, MEM_READ);
+    vm->mem[dst]++;
+    profiler_record_memory_access(vm, dst, MEM_WRITE);
+})
+
+/* DEC: Decrement by 1 */
+HANDLE(DEC, {
+    uint16_t dst = MASK_ADDR(insn->dst);
+    profiler_record_memory_access(vm, dst, MEM_READ);
+    vm->mem[dst]--;
+    profiler_record_memory_access(vm, dst, MEM_WRITE);
+})
+
+/* INV: Bitwise NOT */
+HANDLE(INV, {
+    uint16_t dst = insn->dst;
+    profiler_record_memory_access(vm, MASK_ADDR(dst), MEM_READ);
+    vm->mem[MASK_ADDR(dst)] = ~vm->mem[MASK_ADDR(dst)];
+    profiler_record_memory_access(vm, MASK_ADDR(dst), MEM_WRITE);
+})
+
+/* LSHIFT: Left shift by constant */
+HANDLE(LSHIFT, {
+    uint16_t src = insn->src; /* Shift count */
+    uint16_t dst = insn->dst; /* Value to be shifted */
+    profiler_record_memory_access(vm, MASK_ADDR(dst), MEM_READ);
+    vm->mem[MASK_ADDR(dst)] <<= src;
+    profiler_record_memory_access(vm, MASK_ADDR(dst), MEM_WRITE);
+})
+
+/* DOUBLE: Multiply by 2 (left shift by 1) */
+HANDLE(DOUBLE, {
+    uint16_t dst = insn->dst;
+    profiler_record_memory_access(vm, MASK_ADDR(dst), MEM_READ);
+    vm->mem[MASK_ADDR(dst)] <<= 1;
+    profiler_record_memory_access(vm, MASK_ADDR(dst), MEM_WRITE);
+})
+
+/* NEG: Two's complement negation (dst = 0 - src) */
+HANDLE(NEG, {
+    uint16_t dst = insn->dst;
+    uint16_t src = insn->src;
+    profiler_record_memory_access(vm, MASK_ADDR(src), MEM_READ);
+    vm->mem[MASK_ADDR(dst)] = 0 - vm->mem[MASK_ADDR(src)];
+    profiler_record_memory_access(vm, MASK_ADDR(dst), MEM_WRITE);
+})
+
+/* Pattern matching function for SUBLEQ instruction optimization.
+ * Matches instruction sequences against patterns using a compact
+ * domain-specific language.
+ *
+ * Pattern symbols:
+ * '0'-'9':
+ *   Variable capture/match. These symbols capture the value of the current
+ *   memory word (mem[pc + offset]) into a numbered variable. If the variable
+ *   is already bound, it asserts that the current value matches the bound
+ *   value. Example: '0' captures mem[i], subsequent '0's must match mem[i].
+ *
+ * 'Z':
+ *   Match Zero. Requires the current memory word to be exactly 0.
+ *   Example: "Z Z >" matches three consecutive zeros, where the third zero is
+ *   also the next PC address.
+ *
+ * 'N':
+ *   Match Negative One (All Bits Set). Requires the current memory word to be
+ *   equal to 'vm->mask' (e.g., 0xFFFF for a 16-bit VM). This is often used
+ *   for memory-mapped I/O addresses or special constant values.
+ *   Example: "N ! >" implies 'SUBLEQ 0xFFFF, addr, next_pc'.
+ *
+ * '>':
+ *   Match Next Program Counter Address. Requires the current memory word to be
+ *   '(pc + offset + 1)'. This is the address that SUBLEQ would jump to if the
+ *   preceding SUBLEQ instruction's result is zero or negative. Crucial for
+ *   matching linear code sequences that do not branch.
+ *   Example: "0 1 >" matches a SUBLEQ where the target address is the next
+ *   sequential instruction.
+ *
+ * '%':
+ *   Match Specific Constant (from 'va_arg'). Consumes an argument from the
+ *   'va_list' (expected to be a 'uint16_t'). Requires the current memory word
+ *   to match this provided constant.
+ *   Example: 'match_pattern(vm, ..., "%", 100)' would match if the current
+ *   memory word is 100.
+ *
+ * '!':
+ *   Capture Value to Pointer (from 'va_arg'). Consumes an argument from the
+ *   'va_list' (expected to be a 'uint16_t *'). Stores the value of the
+ *   current memory word into the provided pointer. Does not perform a match;
+ *   solely for extraction. Example: 'match_pattern(vm, ..., "!", &my_var)'
+ *   captures the current memory word into 'my_var'.
+ *
+ * '?':
+ *   Wildcard. Matches any value in the current memory word. Does not capture
+ *   or compare the value. Used to skip irrelevant words in a pattern.
+ *   Example: "0 ? >" matches '0' followed by any value, then the next PC
+ * address.
+ *
+ * 'P':
+ *   Match Positive (non-zero, MSB clear for signed interpretation).
+ *
+ * 'M':
+ *   Match Memory address within valid range.
+ *
+ * 'R':
+ *   Match Register/Variable reference (captured variable).
+ *
+ * @vm: Virtual machine context
+ * @ms: Matcher scratch of the calling thread
+ * @pc: The base program counter for the current instruction sequence
+ * being matched (usually 'i' from the optimizer loop)
+ * @mem: A pointer to the full main memory array of the VM (vm->mem)
+ * @max_len: The maximum number of words available for scanning from 'pc'
+ * @pattern: The string containing the DSL pattern to match
+ * @...: Variable arguments based on pattern symbols like '%' and '!'
+ *
+ * Return true if pattern matches, false otherwise
+ */
+static bool match_pattern(const vm_t *vm,
+                          match_scratch_t *ms,
+                          uint64_t pc,
+                          const uint16_t *mem,
+                          int max_len,
+                          const char *pattern,
+                          ...)
+{
+    va_list args;
+    uint64_t offset = 0;
+    unsigned version = ++ms->version;
+    bool result = true;
+
+    /* Early validation of input parameters */
+    if (UNLIKELY(!pattern || !mem || max_len <= 0))
+        return false;
+
+    va_start(args, pattern);
+
+    /* Iterate through each character in the pattern */
+    for (const char *p = pattern; *p && result; ++p) {
+        char sym = *p;
+
+        /* Skip whitespace characters for better pattern readability */
+        if (isspace(sym))
+            continue;
+
+        /* Check if we've exceeded the available memory range */
+        if (UNLIKELY(offset >= (uint64_t) max_len)) {
+            result = false;
+            break;
+        }
+
+        uint16_t val = mem[MASK_ADDR(pc + offset)];
+
+        switch (sym) {
+        case '0' ... '9': {
+            /* Variable capture and matching */
+            int var_idx = sym - '0';
+            if (ms->set[var_idx] == version) {
+                /* Variable already bound - verify it matches */
+                if (UNLIKELY(ms->vars[var_idx] != val)) {
+                    result = false;
+                }
+            } else {
+                /* First occurrence - capture the value */
+                ms->set[var_idx] = version;
+                ms->vars[var_idx] = val;
+            }
+            break;
+        }
+
+        case 'Z':
+            /* Match zero value */
+            if (UNLIKELY(val != 0)) {
+                result = false;
+            }
+            break;
+
+        case 'N':
+            /* Match negative one (all bits set) */
+            if (UNLIKELY(val != vm->mask)) {
+                result = false;
+            }
+            break;
+
+        case '>':
+            /* Match next program counter address */
+            if (UNLIKELY(val != pc + offset + 1)) {
+                result = false;
+            }
+            break;
+
+        case '%': {
+            /* Match specific constant from arguments */
+            uint16_t expected = (uint16_t) va_arg(args, int);
+            if (UNLIKELY(val != expected)) {
+                result = false;
+            }
+            break;
+        }
+
+        case '!': {
+            /* Capture value to pointer from arguments */
+            uint16_t *ptr = va_arg(args, uint16_t *);
+            if (ptr) {
+                *ptr = val;
+            }
+            break;
+        }
+
+        case '?':
+            /* Wildcard - matches any value, no operation needed */
+            break;
+
+        case 'P':
+            /* Match positive value (non-zero, MSB clear) */
+            if (UNLIKELY(val == 0 || (val & (1U << (vm->nbits - 1))))) {
+                result = false;
+            }
+            break;
+
+        case 'M':
+            /* Match valid memory address */
+            if (UNLIKELY(val >= vm->mem_size && val != vm->mask)) {
+                result = false;
+            }
+            break;
+
+        case 'R': {
+            /* Match previously captured variable reference */
+            char var_ref = (char) va_arg(args, int);
+            int var_idx = var_ref - '0';
+            if (UNLIKELY(var_idx < 0 || var_idx > 9 ||
+                         ms->set[var_idx] != version ||
+                         ms->vars[var_idx] != val)) {
+                result = false;
+            }
+            break;
+        }
+
+        default:
+            /* Unknown pattern symbol */
+            result = false;
+            break;
+        }
+
+        /* Move to next memory location */
+        offset++;
+    }
+
+    va_end(args);
+    return result;
+}
+
+/* Retrieve variables captured during pattern matching in the optimizer.
+ * Variables are identified by single digits '0'-'9' and must be set in the
+ * current optimizer version context to be considered valid.
+ *
+ * @ms: Matcher scratch containing variable bindings
+ * @var: Variable identifier character ('0' through '9')
+ * Return the captured variable value, or 0xFFFF if variable is invalid/unset
+ */
+static inline uint16_t get_var(const match_scratch_t *ms, char var)
+{
+#if HAS_BUILTIN_CONSTANT_P
+    /* Fast path: compile-time bounds check for literal constants */
+    if (IS_COMPILE_TIME_CONSTANT(var)) {
+        if (var < '0' || var > '9')
+            return (uint16_t) -1;
+        const int idx = var - '0';
+        return (ms->set[idx] == ms->version) ? ms->vars[idx] : (uint16_t) -1;
+    }
+#endif
+
+    /* Runtime path: single bounds check with early return */
+    const unsigned char uvar = (unsigned char) var;
+    if (UNLIKELY(uvar < '0' || uvar > '9'))
+        return (uint16_t) -1;
+
+    const int idx = (int) (uvar - '0');
+
+    /* Branchless version check and value retrieval */
+    const bool is_set = (ms->set[idx] == ms->version);
+    return is_set ? ms->vars[idx] : (uint16_t) -1;
+}
+
+/* Match patterns at every address in [@lo, @hi) of a program of @proglen
+ * words. Each entry depends only on memory and the constant register tables,
+ * so disjoint ranges may be matched concurrently.
+ */
+static void optimize_range(const vm_t *vm,
+                           match_scratch_t *ms,
+                           insn_t *insn_mem,
+                           uint64_t lo,
+                           uint64_t hi,
+                           uint64_t proglen)
+{
+    const optimizer_t *opt = &vm->opt;
+    const uint16_t *mem = vm->mem;
+
+    for (uint64_t i = lo; i < hi; i++) {
+        size_t scan_depth = (i + OPTIMIZER_SCAN_DEPTH > proglen)
+                                ? proglen - i
+                                : OPTIMIZER_SCAN_DEPTH;
+        if (scan_depth == 0)
+            continue;
+
+        /* ISTORE: m[m[D]] = S */
+        if (match_pattern(vm, ms, i, mem, (int) scan_depth,
+                          "0Z> 11> 22> Z3> Z4> ZZ> 56> 77> Z7> 6Z> ZZ> 66>")) {
+            insn_mem[i].opcode = ISTORE;
+            insn_mem[i].dst = MASK_ADDR(get_var(ms, '0'));
+            insn_mem[i].src = MASK_ADDR(get_var(ms, '5'));
+            ms->matches[ISTORE]++;
+            continue;
+        }
+
+        /* ILOAD and LDINC fusion */
+        uint16_t iload_src_ptr = 0;
+        if (match_pattern(vm, ms, i, mem, (int) scan_depth,
+                          "00> !Z> Z0> ZZ> 11> ?Z> Z1> ZZ>", &iload_src_ptr) &&
+            validate_jump_target(get_var(ms, '0'), i,
+                                 ILOAD_PATTERN_JUMP_OFFSET)) {
+            /* ILOAD pattern matched. Save its destination address before the
+             * next match_pattern call invalidates the optimizer version. */
+            uint16_t iload_dst = get_var(ms, '1');
+
+            uint16_t inc_src = 0, inc_dst = 0;
+
+            /* Check for a subsequent INC pattern. */
+            if (scan_depth >= INSN_INCR_LDINC &&
+                match_pattern(vm, ms, i + LDINC_INCREMENT_OFFSET, mem,
+                              (int) (scan_depth - LDINC_INCREMENT_OFFSET),
+                              "!!>", &inc_src, &inc_dst) &&
+                inc_src != inc_dst && opt->neg1_reg[MASK_ADDR(inc_src)] &&
+                inc_dst == iload_src_ptr) {
+                /* Success: Fuse into LDINC */
+                insn_mem[i].opcode = LDINC;
+                insn_mem[i].dst = MASK_ADDR(iload_dst);
+                insn_mem[i].src = MASK_ADDR(iload_src_ptr);
+                ms->matches[LDINC]++;
+                continue;
+            }
+
+            /* If not fused, fall back to a regular ILOAD */
+            insn_mem[i].opcode = ILOAD;
+            insn_mem[i].dst = MASK_ADDR(iload_dst);
+            insn_mem[i].src = MASK_ADDR(iload_src_ptr);
+            ms->matches[ILOAD]++;
+            continue;
+        }
+
+        /* LSHIFT: Left shift by constant */
+        uint16_t shift_count = 0;
+        uint16_t shift_dst = 0;
+        uint64_t shift_pos = 0;
+        while (shift_pos < scan_depth) {
+            uint16_t q0 = 0, q1 = 0;
+            if (scan_depth - shift_pos < 9)
+                break;
+            if (match_pattern(vm, ms, i + shift_pos, mem,
+                              (int) (scan_depth - shift_pos), "!Z> Z!> ZZ>",
+                              &q0, &q1) &&
+                q0 == q1) {
+                if (shift_count == 0)
+                    shift_dst = q0;
+                else if (shift_dst != q0)
+                    break;
+                shift_count++;
+                shift_pos += 9;
+            } else {
+                break;
+            }
+        }
+        if (shift_count >= 2) {
+            insn_mem[i].opcode = LSHIFT;
+            insn_mem[i].dst = MASK_ADDR(shift_dst);
+            insn_mem[i].src = shift_count;
+            ms->matches[LSHIFT]++;
+            continue;
+        }
+
+        /* IADD: m[m[D]] += S */
+        if (match_pattern(vm, ms, i, mem, (int) scan_depth,
+                          "01> 23> 44> 14> 3Z> 11> 33>")) {
+            insn_mem[i].opcode = IADD;
+            insn_mem[i].dst = MASK_ADDR(get_var(ms, '0'));
+            insn_mem[i].src = MASK_ADDR(get_var(ms, '2'));
+            ms->matches[IADD]++;
+            continue;
+        }
+
+        /* INV: Bitwise NOT */
+        uint16_t inv_temp = 0;
+        if (match_pattern(vm, ms, i, mem, (int) scan_depth,
+                          "00> 10> 11> 2Z> Z1> ZZ> !1>", &inv_temp) &&
+            opt->one_reg[inv_temp]) {
+            insn_mem[i].opcode = INV;
+            insn_mem[i].dst = MASK_ADDR(get_var(ms, '1'));
+            ms->matches[INV]++;
+            continue;
+        }
+
+        /* ISUB: m[m[D]] -= S */
+        if (match_pattern(vm, ms, i, mem, (int) scan_depth,
+                          "01> 33> 14> 5Z> 11>")) {
+            insn_mem[i].opcode = ISUB;
+            insn_mem[i].dst = MASK_ADDR(get_var(ms, '0'));
+            insn_mem[i].src = MASK_ADDR(get_var(ms, '5'));
+            ms->matches[ISUB]++;
+            continue;
+        }
+
+        /* IJMP: PC = m[D] */
+        uint16_t ijmp_temp = 0;
+        if (match_pattern(vm, ms, i, mem, (int) scan_depth,
+                          "00> !Z> Z0> ZZ> ZZ>", &ijmp_temp) &&
+            validate_jump_target(get_var(ms, '0'), i,
+                                 IJMP_PATTERN_JUMP_OFFSET)) {
+            insn_mem[i].opcode = IJMP;
+            insn_mem[i].dst = MASK_ADDR(ijmp_temp);
+            ms->matches[IJMP]++;
+            continue;
+        }
+
+        /* MOV: Copy data */
+        uint16_t mov_src = 0;
+        if (match_pattern(vm, ms, i, mem, (int) scan_depth, "00> !Z> Z0> ZZ>",
+                          &mov_src)) {
+            uint16_t dst = MASK_ADDR(get_var(ms, '0'));
+            uint16_t src = MASK_ADDR(mov_src);
+            if (dst != src) {
+                insn_mem[i].opcode = MOV;
+                insn_mem[i].dst = dst;
+                insn_mem[i].src = src;
+                ms->matches[MOV]++;
+                continue;
+            }
+        }
+
+        /* DOUBLE or ADD */
+        uint16_t arith_src = 0, arith_dst = 0;
+        if (match_pattern(vm, ms, i, mem, (int) scan_depth, "!Z> Z!> ZZ>",
+                          &arith_src, &arith_dst)) {
+            if (arith_src == arith_dst) {
+                insn_mem[i].opcode = DOUBLE;
+                insn_mem[i].dst = MASK_ADDR(arith_dst);
+                insn_mem[i].src = MASK_ADDR(arith_src);
+                ms->matches[DOUBLE]++;
+            } else {
+                insn_mem[i].opcode = ADD;
+                insn_mem[i].dst = MASK_ADDR(arith_dst);
+                insn_mem[i].src = MASK_ADDR(arith_src);
+                ms->matches[ADD]++;
+            }
+            continue;
+        }
+
+        /* NEG: Two's complement negation (dst = 0 - src)
+         * Pattern: SUBLEQ DST, DST, PC+3 (DST becomes 0)
+         *          SUBLEQ SRC, DST, PC+6 (DST becomes 0 - SRC)
+         * '0' is DST, '1' is SRC
+         */
+        if (match_pattern(vm, ms, i, mem, (int) scan_depth, "00> 10>")) {
+            insn_mem[i].opcode = NEG;
+            insn_mem[i].dst = MASK_ADDR(get_var(ms, '0'));
+            insn_mem[i].src = MASK_ADDR(get_var(ms, '1'));
+            ms->matches[NEG]++;
+            continue;
+        }
+
+        /* ZERO: Clear memory */
+        if (match_pattern(vm, ms, i, mem, (int) scan_depth, "00>")) {
+            insn_mem[i].opcode = ZERO;
+            insn_mem[i].dst = MASK_ADDR(get_var(ms, '0'));
+            ms->matches[ZERO]++;
+            continue;
+        }
+
+        /* HALT: Terminate */
+        uint16_t halt_addr = 0;
+        if (match_pattern(vm, ms, i, mem, (int) scan_depth, "ZZ!",
+                          &halt_addr) &&
+            halt_addr == vm->mask) {
+            insn_mem[i].opcode = HALT;
+            ms->matches[HALT]++;
+            continue;
+        }
+
+        /* JMP: Unconditional jump */
+        uint16_t jmp_target = 0;
+        if (match_pattern(vm, ms, i, mem, (int) scan_depth, "00!",
+                          &jmp_target)) {
+            if (jmp_target == i) { /* Check for infinite loop */
+                insn_mem[i].opcode = HALT;
+                ms->matches[HALT]++;
+            } else {
+                insn_mem[i].opcode = JMP;
+                insn_mem[i].dst = jmp_target;
+                /* var '0' is the address being zeroed by the JMP sequence */
+                insn_mem[i].src = MASK_ADDR(get_var(ms, '0'));
+                ms->matches[JMP]++;
+            }
+            continue;
+        }
+
+        /* GET: Input character */
+        uint16_t get_dst = 0;
+        if (match_pattern(vm, ms, i, mem, (int) scan_depth, "N!>", &get_dst)) {
+            insn_mem[i].opcode = GET;
+            insn_mem[i].dst = MASK_ADDR(get_dst);
+            ms->matches[GET]++;
+            continue;
+        }
+
+        /* PUT: Output character */
+        uint16_t put_src = 0;
+        if (match_pattern(vm, ms, i, mem, (int) scan_depth, "!N>", &put_src)) {
+            /* Output of a device command cell drives that device */
+            if (vm->devices_enabled && MASK_ADDR(put_src) >= DEV_BASE) {
+                insn_mem[i].opcode = DEV;
+                insn_mem[i].src = MASK_ADDR(put_src);
+                ms->matches[DEV]++;
+                continue;
+            }
+            insn_mem[i].opcode = PUT;
+            insn_mem[i].src = MASK_ADDR(put_src);
+            ms->matches[PUT]++;
+            continue;
+        }
+
+        /* INC/DEC/SUB */
+        uint16_t sub_src = 0, sub_dst = 0;
+        if (match_pattern(vm, ms, i, mem, (int) scan_depth, "!!>", &sub_src,
+                          &sub_dst) &&
+            sub_src != sub_dst) {
+            if (opt->neg1_reg[MASK_ADDR(sub_src)]) {
+                insn_mem[i].opcode = INC;
+                insn_mem[i].dst = MASK_ADDR(sub_dst);
+                ms->matches[INC]++;
+            } else if (opt->one_reg[MASK_ADDR(sub_src)]) {
+                insn_mem[i].opcode = DEC;
+                insn_mem[i].dst = MASK_ADDR(sub_dst);
+                ms->matches[DEC]++;
+            } else {
+                insn_mem[i].opcode = SUB;
+                insn_mem[i].dst = MASK_ADDR(sub_dst);
+                insn_mem[i].src = MASK_ADDR(sub_src);
+                ms->matches[SUB]++;
+            }
+            continue;
+        }
+
+        /* Default to SUBLEQ */
+        insn_mem[i].opcode = SUBLEQ;
+        insn_mem[i].src = mem[MASK_ADDR(i)];
+        insn_mem[i].dst = mem[MASK_ADDR(i + 1)];
+        insn_mem[i].aux = mem[MASK_ADDR(i + 2)];
+        ms->matches[SUBLEQ]++;
+    }
+}
+
+#ifdef PLAT_POSIX
+/* One thread's share of the matching pass */
+typedef struct {
+    const vm_t *vm;
+    insn_t *insn_mem;
+    uint64_t lo, hi, proglen;
+    match_scratch_t ms;
+    pthread_t thread;
+} optimize_job_t;
+
+static void *optimize_worker(void *arg)
+{
+    optimize_job_t *job = arg;
+    optimize_range(job->vm, &job->ms, job->insn_mem, job->lo, job->hi,
+                   job->proglen);
+    return NULL;
+}
+
+/* Split the matching pass over @threads threads, each taking a contiguous
+ * address range with its own scratch, then merge the match counts. Every
+ * entry is decoded exactly as the serial pass would, so the result is
+ * identical. Returns 0, or -1 if no thread could be started, in which case
+ * nothing has been matched.
+ */
+static int optimize_parallel(vm_t *vm,
+                             insn_t *insn_mem,
+                             uint64_t proglen,
+                             unsigned threads)
+{
+    optimize_job_t *jobs = calloc(threads, sizeof(*jobs));
+    if (!jobs)
+        return -1;
+
+    uint64_t chunk = (proglen + threads - 1) / threads;
+    unsigned started = 0;
+    for (; started < threads; started++) {
+        optimize_job_t *job = &jobs[started];
+        job->vm = vm;
+        job->insn_mem = insn_mem;
+        job->lo = started * chunk;
+        job->hi = job->lo + chunk < proglen ? job->lo + chunk : proglen;
+        job->proglen = proglen;
+        if (pthread_create(&job->thread, NULL, optimize_worker, job) != 0)
+            break;
+    }
+    if (started == 0) {
+        free(jobs);
+        return -1;
+    }
+
+    /* Ranges whose thread could not be started are matched here */
+    for (unsigned t = started; t < threads; t++)
+        optimize_worker(&jobs[t]);
+    for (unsigned t = 0; t < threads; t++) {
+        if (t < started)
+            pthread_join(jobs[t].thread, NULL);
+        for (int i = 0; i < IMAX; i++)
+            vm->opt.matches[i] += jobs[t].ms.matches[i];
+    }
+
+    free(jobs);
+    return 0;
+}
+#else
+static int optimize_parallel(vm_t *vm,
+                             insn_t *insn_mem,
+                             uint64_t proglen,
+                             unsigned threads)
+{
+    (void) vm;
+    (void) insn_mem;
+    (void) proglen;
+    (void) threads;
+    return -1;
+}
+#endif
+
+/* Identifies common SUBLEQ sequences and replaces them with single extended
+ * instructions. This optimization is crucial for improving the performance
+ * of programs compiled to SUBLEQ, especially for high-level languages like
+ * Forth which involve frequent stack, memory, and arithmetic operations that
+ * translate into many primitive SUBLEQ instructions.
+ *
+ * @vm: Virtual machine context
+ * @insn_mem: Decoded instruction array to fill
+ * @proglen: The total number of loaded SUBLEQ words in memory (vm->m)
+ */
+static void optimize(vm_t *vm, insn_t *insn_mem, uint64_t proglen)
+{
+    optimizer_t *opt = &vm->opt;
+    const uint16_t *mem = vm->mem;
+
+    memset(opt->matches, 0, sizeof(opt->matches));
+    memset(opt->zero_reg, 0, sizeof(opt->zero_reg));
+    memset(opt->one_reg, 0, sizeof(opt->one_reg));
+    memset(opt->neg1_reg, 0, sizeof(opt->neg1_reg));
+
+    for (uint64_t i = 0; i < proglen; i++) {
+        opt->zero_reg[i] = (mem[i] == 0);
+        opt->one_reg[i] = (mem[i] == 1);
+        opt->neg1_reg[i] = (mem[i] == vm->mask);
+
+        insn_mem[i].opcode = SUBLEQ;
+        insn_mem[i].src = mem[MASK_ADDR(i)];
+        insn_mem[i].dst = mem[MASK_ADDR(i + 1)];
+        insn_mem[i].aux = mem[MASK_ADDR(i + 2)];
+    }
+
+    unsigned threads = opt->threads;
+    if (threads > proglen / OPTIMIZER_MIN_CHUNK)
+        threads = (unsigned) (proglen / OPTIMIZER_MIN_CHUNK);
+
+    match_scratch_t ms = {0};
+    if (threads <= 1 || optimize_parallel(vm, insn_mem, proglen, threads) < 0)
+        optimize_range(vm, &ms, insn_mem, 0, proglen, proglen);
+
+    for (int i = 0; i < IMAX; i++)
+        opt->matches[i] += ms.matches[i];
+}
+
+/* Generate hot spots analysis from PC heat map */
+static void profiler_analyze_hot_spots(vm_t *vm)
+{
+    profiler_t *prof = &vm->prof;
+
+    /* Samples are rare, so every sampled pc is significant */
+    uint64_t min_count = prof->sampling ? 0 : 100;
+
+    if (!prof->pc_heat_map || !(prof->enabled || prof->sampling))
+        return;
+
+    prof->hot_spot_count = 0;
+
+    /* Find hot spots and sort by execution count */
+    for (uint64_t pc = 0; pc < vm->mem_size; pc++) {
+        if (prof->pc_heat_map[pc] > min_count) { /* Only significant ones */
+            hot_spot_t spot = {
+                .pc = pc,
+                .exec_count = prof->pc_heat_map[pc],
+                .opcode = vm->insn[pc].opcode,
             };
 
-            /* Insert in sorted order (simple insertion sort for small array) */
-            size_t insert_pos = prof->hot_spot_count;
-            for (size_t i = 0; i < prof->hot_spot_count; i++) {
-                if (spot.exec_count > prof->hot_spots[i].exec_count) {
-                    insert_pos = i;
-                    break;
-                }
+            /* Insert in sorted order (simple insertion sort for small array) */
+            size_t insert_pos = prof->hot_spot_count;
+            for (size_t i = 0; i < prof->hot_spot_count; i++) {
+                if (spot.exec_count > prof->hot_spots[i].exec_count) {
+                    insert_pos = i;
+                    break;
+                }
+            }
+
+            /* Shift existing entries */
+            for (size_t i = prof->hot_spot_count; i > insert_pos; i--) {
+                if (i < MAX_HOT_SPOTS)
+                    prof->hot_spots[i] = prof->hot_spots[i - 1];
+            }
+
+            /* Insert new hot spot */
+            if (insert_pos < MAX_HOT_SPOTS) {
+                prof->hot_spots[insert_pos] = spot;
+                if (prof->hot_spot_count < MAX_HOT_SPOTS)
+                    prof->hot_spot_count++;
+            }
+        }
+    }
+}
+
+/* Print the ten hottest spots, counted in @what out of @total */
+static void profiler_print_hot_spots(const vm_t *vm,
+                                     FILE *err,
+                                     const char *what,
+                                     uint64_t total)
+{
+    const profiler_t *prof = &vm->prof;
+
+    if (prof->hot_spot_count == 0)
+        return;
+
+    fprintf(err, "\nTop %zu Hot Spots:\n",
+            prof->hot_spot_count > 10 ? 10 : prof->hot_spot_count);
+    fprintf(err, "    PC   | %10s |   %%   | Opcode\n", what);
+    fprintf(err, "---------|------------|-------|-------\n");
+
+    for (size_t i = 0; i < prof->hot_spot_count && i < 10; i++) {
+        const hot_spot_t *spot = &prof->hot_spots[i];
+        double percent = total > 0 ? 100.0 * spot->exec_count / total : 0;
+
+        fprintf(err, " %6" PRIu64 "  | %10" PRIu64 " | %5.1f | %-6s\n",
+                spot->pc, spot->exec_count, percent,
+                spot->opcode < IMAX ? insn_names[spot->opcode] : "???");
+    }
+}
+
+/* Forth word found in the image dictionary */
+typedef struct {
+    uint16_t start; /* Link cell of its header */
+    uint16_t end;   /* Next header, or the end of memory */
+    char name[32];  /* Counted names are at most 31 characters */
+    uint64_t self;  /* Samples executing the word */
+    uint64_t total; /* Samples with the word anywhere on the stack */
+    size_t seen;    /* Last stack counted in @total, plus one */
+} fword_t;
+
+static unsigned char words_byte(const vm_t *vm, uint32_t b, bool swap)
+{
+    uint16_t cell = vm->mem[MASK_ADDR(b >> 1)];
+    return ((b & 1) ^ swap) ? cell >> 8 : cell & 0xFF;
+}
+
+/* Length of the name of a header whose link cell is @h, or 0 if it has
+ * none: a count byte of 1 to 31, whose upper bits hold flags, then that
+ * many printable characters. @swap puts the first byte in the high half.
+ */
+static unsigned words_name(const vm_t *vm, uint32_t h, bool swap, char *name)
+{
+    uint32_t b = 2 * (h + 1);
+    unsigned len = words_byte(vm, b, swap) & 0x1F;
+    if (len == 0 || b + len >= 2 * SZ)
+        return 0;
+    for (unsigned k = 1; k <= len; k++) {
+        unsigned char c = words_byte(vm, b + k, swap);
+        if (c <= ' ' || c > '~')
+            return 0;
+        if (name)
+            name[k - 1] = (char) c;
+    }
+    if (name)
+        name[len] = '\0';
+    return len;
+}
+
+/* Header a link in the header at @h points to, or 0 for none. @mode says
+ * how links are kept: bit 0 for byte rather than cell addresses, bit 1 for
+ * pointing at the name rather than at the link cell.
+ */
+static uint32_t words_link(const vm_t *vm, uint32_t h, unsigned mode)
+{
+    uint16_t link = vm->mem[h];
+    if ((mode & 1) && (link & 1))
+        return 0;
+    uint32_t t = (mode & 1) ? link / 2u : link;
+    if (mode & 2)
+        t = t ? t - 1 : 0;
+    return t < h ? t : 0;
+}
+
+/* Mark the headers of every dictionary chain, in memory read the way
+ * @mode says (bit 2 swaps the bytes of names), and count them. A chain is
+ * headers linked back to one with a null link, and only chains of at least
+ * WORDS_MIN_CHAIN headers are taken for a dictionary.
+ */
+static size_t words_chains(const vm_t *vm,
+                           unsigned mode,
+                           uint16_t *len,
+                           uint8_t *mark)
+{
+    size_t count = 0;
+
+    for (uint32_t h = 0; h < SZ - 1; h++) {
+        len[h] = 0;
+        if (!words_name(vm, h, mode & 4, NULL))
+            continue;
+        uint32_t t = words_link(vm, h, mode);
+        if (vm->mem[h] == 0)
+            len[h] = 1;
+        else if (t && len[t])
+            len[h] = len[t] < UINT16_MAX ? len[t] + 1 : UINT16_MAX;
+    }
+    len[SZ - 1] = 0;
+
+    memset(mark, 0, SZ);
+    for (uint32_t h = SZ; h-- > 0;) {
+        if (len[h] < WORDS_MIN_CHAIN)
+            continue;
+        for (uint32_t t = h; t && len[t] && !mark[t];
+             t = words_link(vm, t, mode)) {
+            mark[t] = 1;
+            count++;
+        }
+    }
+    return count;
+}
+
+/* Walk the dictionary in memory. Returns its words in address order, with
+ * one more entry for code outside any word, and their count in @count, or
+ * NULL if no dictionary was found.
+ */
+static fword_t *words_scan(const vm_t *vm, size_t *count)
+{
+    uint16_t *len = malloc(SZ * sizeof(*len));
+    uint8_t *mark = malloc(SZ);
+    fword_t *words = NULL;
+    size_t best = 0;
+    unsigned best_mode = 0;
+
+    if (!len || !mark)
+        goto out;
+    for (unsigned mode = 0; mode < 8; mode++) {
+        size_t n = words_chains(vm, mode, len, mark);
+        if (n > best) {
+            best = n;
+            best_mode = mode;
+        }
+    }
+    if (best == 0 || !(words = calloc(best + 1, sizeof(*words))))
+        goto out;
+
+    words_chains(vm, best_mode, len, mark);
+    size_t n = 0;
+    for (uint32_t h = 0; h < SZ; h++) {
+        if (!mark[h])
+            continue;
+        if (n > 0)
+            words[n - 1].end = (uint16_t) h;
+        words[n].start = (uint16_t) h;
+        words[n].end = SZ - 1;
+        words_name(vm, h, best_mode & 4, words[n].name);
+        n++;
+    }
+    strcpy(words[n].name, "(vm)");
+    *count = n;
+
+out:
+    free(len);
+    free(mark);
+    return words;
+}
+
+/* Word executing at a saved instruction pointer @ip, which points past the
+ * cell being run, or @count (the "(vm)" entry) if none does
+ */
+static size_t words_find(const fword_t *words, size_t count, uint16_t ip)
+{
+    uint16_t cell = (uint16_t) (ip - 1);
+    size_t lo = 0, hi = count;
+    while (lo < hi) { /* First word starting past @cell */
+        size_t mid = (lo + hi) / 2;
+        if (words[mid].start <= cell)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo > 0 && cell < words[lo - 1].end ? lo - 1 : count;
+}
+
+static int words_by_self(const void *a, const void *b)
+{
+    const fword_t *x = a, *y = b;
+    if (x->self != y->self)
+        return x->self < y->self ? 1 : -1;
+    return x->total < y->total ? 1 : x->total > y->total ? -1 : 0;
+}
+
+static int words_by_total(const void *a, const void *b)
+{
+    const fword_t *x = a, *y = b;
+    if (x->total != y->total)
+        return x->total < y->total ? 1 : -1;
+    return x->self < y->self ? 1 : x->self > y->self ? -1 : 0;
+}
+
+static void words_print(FILE *err,
+                        const fword_t *words,
+                        size_t count,
+                        const char *by,
+                        uint64_t total)
+{
+    size_t shown = 0;
+    for (size_t i = 0; i < count && shown < 10; i++)
+        shown += words[i].total > 0;
+    if (shown == 0)
+        return;
+
+    fprintf(err, "\nTop %zu Words by %s:\n", shown, by);
+    fprintf(err, " Word                 |  Exclusive |   %%   |  Inclusive |"
+                 "   %%\n");
+    fprintf(err, "----------------------|------------|-------|------------|"
+                 "------\n");
+    for (size_t i = 0; i < shown; i++) {
+        const fword_t *w = &words[i];
+        fprintf(err,
+                " %-20.20s | %10" PRIu64 " | %5.1f | %10" PRIu64
+                " | %5.1f\n",
+                w->name, w->self, 100.0 * w->self / total, w->total,
+                100.0 * w->total / total);
+    }
+}
+
+/* Attribute the sampled stacks to the words of the dictionary in memory
+ * now, when it holds everything the program defined. A sample counts as
+ * exclusive for the word ip is in and as inclusive for every word on its
+ * stack, once however deep it recurses. Each sample stands for @weight
+ * @what.
+ */
+static void words_report(const vm_t *vm,
+                         FILE *err,
+                         const char *what,
+                         uint64_t weight)
+{
+    const forth_prof_t *fp = &vm->prof.forth;
+    size_t count = 0;
+
+    fprintf(err, "\n=== Forth Word Profile ===\n");
+    if (!fp->located) {
+        fprintf(err, "No inner interpreter found in the decoded code\n");
+        return;
+    }
+    fword_t *words = words_scan(vm, &count);
+    if (!words) {
+        fprintf(err, "No eForth dictionary found in memory\n");
+        return;
+    }
+
+    uint64_t samples = 0;
+    for (size_t i = 0; i < fp->nstacks; i++) {
+        const fstack_t *st = &fp->stacks[i];
+        const uint16_t *cells = fp->cells + st->off;
+        uint64_t n = st->count * weight;
+
+        samples += st->count;
+        words[words_find(words, count, cells[0])].self += n;
+        for (uint32_t k = 0; k < st->depth; k++) {
+            size_t w = words_find(words, count, cells[k]);
+            if (words[w].seen == i + 1 || (k > 0 && w == count))
+                continue; /* Counted, or data saved on the return stack */
+            words[w].seen = i + 1;
+            words[w].total += n;
+        }
+    }
+
+    fprintf(err, "Dictionary: %zu words; ip in cell %u, rp in cell %u\n",
+            count, fp->ip, fp->rp);
+    fprintf(err, "Stacks: %" PRIu64 " samples, %zu distinct", samples,
+            fp->nstacks);
+    if (fp->dropped)
+        fprintf(err, ", %" PRIu64 " dropped", fp->dropped);
+    fprintf(err, "\n");
+
+    if (samples > 0) {
+        char by[64];
+        qsort(words, count + 1, sizeof(*words), words_by_self);
+        snprintf(by, sizeof(by), "Exclusive %s", what);
+        words_print(err, words, count + 1, by, samples * weight);
+        qsort(words, count + 1, sizeof(*words), words_by_total);
+        snprintf(by, sizeof(by), "Inclusive %s", what);
+        words_print(err, words, count + 1, by, samples * weight);
+    }
+    free(words);
+}
+
+/* Regions of the memory map of an eForth image, as laid out in manual.md.
+ * End is where execution stops, half the memory.
+ */
+enum {
+    REGION_ZERO, /* Permanent zeros, cells 0 and 1 */
+    REGION_BOOT, /* Boot vector, cell 2 */
+    REGION_CORE, /* Inner interpreter, up to the first dictionary header */
+    REGION_PRIM, /* Dictionary words up to the last one the VM ran code in */
+    REGION_DICT, /* The rest of the dictionary and its free space */
+    REGION_TASK, /* Task block with both stacks, the 512 cells below End */
+    REGION_HIGH, /* End and above, outside the map */
+    REGIONS
+};
+
+#define REGION_TASK_CELLS 512
+
+static const char *region_names[REGIONS] = {
+    "zero page", "boot", "VM core", "primitives",
+    "dictionary", "task block", "high",
+};
+
+static const char *region_keys[REGIONS] = {
+    "zero", "boot", "core", "prim", "dict", "task", "high",
+};
+
+/* Accesses to one region */
+typedef struct {
+    uint32_t lo, hi;           /* First and last cell; lo > hi if none */
+    uint64_t reads, writes;    /* Summed over its cells */
+    uint32_t hot;              /* Cell accessed the most */
+    uint64_t hot_count;        /* Its reads and writes */
+    uint64_t ops[IMAX];        /* Accesses per opcode */
+} region_t;
+
+/* Total the memory accesses of each opcode, and of all of them, from the
+ * counts by opcode and address. The interpreter only counts the latter.
+ */
+static void profiler_sum_accesses(profiler_t *prof)
+{
+    prof->memory_accesses = 0;
+    for (int i = 0; prof->op_heat && i < IMAX; i++) {
+        const uint64_t *row = prof->op_heat + OP_HEAT_ROW(i, 0);
+        uint64_t n = 0;
+        for (uint32_t a = 0; a < 2 * SZ; a++) /* Reads, then writes */
+            n += row[a];
+        prof->op_accesses[i] = n;
+        prof->memory_accesses += n;
+    }
+}
+
+/* Sum the counting profiler's accesses by region into @r. The dictionary
+ * is walked in memory as it is now; its words up to the last one holding
+ * an executed pc are the primitives. Returns 0, or -1 without the counts
+ * or on allocation failure.
+ */
+static int regions_sum(const vm_t *vm, region_t r[REGIONS])
+{
+    const profiler_t *prof = &vm->prof;
+    uint32_t end = (uint32_t) (vm->mem_size / 2);
+    uint32_t task = end > REGION_TASK_CELLS ? end - REGION_TASK_CELLS : 0;
+    uint32_t core = task, prim = task; /* Ends of VM core and primitives */
+    size_t count = 0;
+
+    if (!prof->op_heat)
+        return -1;
+    uint8_t *region = malloc(SZ);
+    uint64_t *cells = calloc(SZ, sizeof(*cells)); /* Accesses per cell */
+    if (!region || !cells) {
+        free(region);
+        free(cells);
+        return -1;
+    }
+
+    fword_t *words = words_scan(vm, &count);
+    if (words && words[0].start < task) {
+        core = prim = words[0].start > 3 ? words[0].start : 3;
+        for (size_t k = 0; k < count; k++) {
+            for (uint32_t a = words[k].start; a < words[k].end && a < task;
+                 a++) {
+                if (prof->pc_heat_map[a]) {
+                    prim = words[k].end < task ? words[k].end : task;
+                    break;
+                }
+            }
+        }
+    }
+    free(words);
+
+    memset(r, 0, REGIONS * sizeof(*r));
+    for (int g = 0; g < REGIONS; g++)
+        r[g].lo = UINT32_MAX;
+    for (uint32_t a = 0; a < SZ; a++) {
+        int g = a < 2      ? REGION_ZERO
+                : a == 2   ? REGION_BOOT
+                : a >= end ? REGION_HIGH
+                : a >= task ? REGION_TASK
+                : a < core ? REGION_CORE
+                : a < prim ? REGION_PRIM
+                           : REGION_DICT;
+        region[a] = (uint8_t) g;
+        if (r[g].lo > a)
+            r[g].lo = a;
+        r[g].hi = a;
+    }
+
+    for (int i = 0; i < IMAX; i++) {
+        if (prof->op_accesses[i] == 0)
+            continue; /* Never touched, leave its pages alone */
+        const uint64_t *reads = prof->op_heat + OP_HEAT_ROW(i, MEM_READ);
+        const uint64_t *writes = prof->op_heat + OP_HEAT_ROW(i, MEM_WRITE);
+        for (uint32_t a = 0; a < SZ; a++) {
+            region_t *g = &r[region[a]];
+            g->ops[i] += reads[a] + writes[a];
+            g->reads += reads[a];
+            g->writes += writes[a];
+            cells[a] += reads[a] + writes[a];
+        }
+    }
+    for (uint32_t a = 0; a < SZ; a++) {
+        region_t *g = &r[region[a]];
+        if (cells[a] > g->hot_count) {
+            g->hot = a;
+            g->hot_count = cells[a];
+        }
+    }
+    free(cells);
+    free(region);
+    return 0;
+}
+
+/* Print the counting profiler's reads and writes by region, then the
+ * share of each opcode's accesses that went to each region
+ */
+static void regions_report(const vm_t *vm, FILE *err)
+{
+    const profiler_t *prof = &vm->prof;
+    region_t r[REGIONS];
+
+    if (regions_sum(vm, r) < 0)
+        return;
+
+    fprintf(err, "\n=== Memory Regions ===\n");
+    fprintf(err, "   Region    | Start |  End  |    Reads    |   Writes    "
+                 "|   %%   | Hottest cell\n");
+    fprintf(err, "-------------|-------|-------|-------------|-------------"
+                 "|-------|-------------\n");
+    for (int g = 0; g < REGIONS; g++) {
+        uint64_t n = r[g].reads + r[g].writes;
+        if (r[g].lo > r[g].hi)
+            continue; /* No cells, such as primitives in a plain program */
+        fprintf(err,
+                " %-12s| %5u | %5u | %11" PRIu64 " | %11" PRIu64
+                " | %5.1f | ",
+                region_names[g], r[g].lo, r[g].hi, r[g].reads, r[g].writes,
+                prof->memory_accesses ? 100.0 * n / prof->memory_accesses
+                                      : 0.0);
+        if (r[g].hot_count > 0)
+            fprintf(err, "%u (%" PRIu64 ")\n", r[g].hot, r[g].hot_count);
+        else
+            fprintf(err, "-\n");
+    }
+
+    fprintf(err, "\nAccesses by opcode and region (%%):\n");
+    fprintf(err, " Opcode");
+    for (int g = 0; g < REGIONS; g++)
+        fprintf(err, " |  %s", region_keys[g]);
+    fprintf(err, "\n--------");
+    for (int g = 0; g < REGIONS; g++)
+        fprintf(err, g + 1 < REGIONS ? "|-------" : "|------");
+    fprintf(err, "\n");
+    for (int i = 0; i < IMAX; i++) {
+        if (prof->op_accesses[i] == 0)
+            continue;
+        fprintf(err, " %-6s", insn_names[i]);
+        for (int g = 0; g < REGIONS; g++)
+            fprintf(err, " | %5.1f",
+                    100.0 * r[g].ops[i] / prof->op_accesses[i]);
+        fprintf(err, "\n");
+    }
+}
+
+/* One line of folded stacks: frames from the outermost, and its count */
+typedef struct {
+    char *line;
+    uint64_t count;
+} folded_t;
+
+static int folded_by_line(const void *a, const void *b)
+{
+    return strcmp(((const folded_t *) a)->line, ((const folded_t *) b)->line);
+}
+
+int vm_report_folded(vm_t *vm, FILE *out)
+{
+    const forth_prof_t *fp = &vm->prof.forth;
+    uint64_t weight = vm->prof.enabled ? WORDS_STRIDE : 1;
+    size_t count = 0, nlines = 0;
+    int status = -1;
+
+    if (!fp->located) {
+        fprintf(stderr, "Error: No Forth call stacks were sampled\n");
+        return -1;
+    }
+    fword_t *words = words_scan(vm, &count);
+    folded_t *lines = calloc(fp->nstacks + 1, sizeof(*lines));
+    if (!words) {
+        fprintf(stderr, "Error: No eForth dictionary found in memory\n");
+        goto out;
+    }
+    if (!lines) {
+        fprintf(stderr, "Error: Out of memory\n");
+        goto out;
+    }
+
+    /* Name each stack from the root down; equal lines are merged below */
+    for (size_t i = 0; i < fp->nstacks; i++) {
+        const fstack_t *st = &fp->stacks[i];
+        const uint16_t *cells = fp->cells + st->off;
+        char *line = malloc(st->depth * sizeof(words->name) + 1);
+        if (!line) {
+            fprintf(stderr, "Error: Out of memory\n");
+            goto out;
+        }
+        size_t len = 0;
+        for (uint32_t k = st->depth; k-- > 0;) {
+            size_t w = words_find(words, count, cells[k]);
+            if (k > 0 && w == count)
+                continue; /* Data saved on the return stack */
+            len += (size_t) sprintf(line + len, "%s%s", len ? ";" : "",
+                                    words[w].name);
+        }
+        lines[nlines++] = (folded_t){.line = line, .count = st->count};
+    }
+    qsort(lines, nlines, sizeof(*lines), folded_by_line);
+
+    for (size_t i = 0; i < nlines; i++) {
+        uint64_t n = lines[i].count;
+        while (i + 1 < nlines && !strcmp(lines[i].line, lines[i + 1].line))
+            n += lines[++i].count;
+        if (fprintf(out, "%s %" PRIu64 "\n", lines[i].line, n * weight) < 0)
+            goto out;
+    }
+    status = 0;
+
+out:
+    for (size_t i = 0; lines && i < nlines; i++)
+        free(lines[i].line);
+    free(lines);
+    free(words);
+    return status;
+}
+
+static int mine_by_insns(const void *a, const void *b)
+{
+    const mine_seq_t *x = a, *y = b;
+    uint64_t nx = x->count * x->len, ny = y->count * y->len;
+    return nx < ny ? 1 : nx > ny ? -1 : 0;
+}
+
+/* Print the unfused runs that executed the most plain SUBLEQ
+ * instructions, the candidates for new fusion patterns
+ */
+static void mine_report(const vm_t *vm, FILE *err)
+{
+    const miner_t *m = &vm->prof.mine;
+    uint64_t plain = (uint64_t) vm->opt.exec_count[SUBLEQ];
+    size_t used = 0;
+
+    mine_seq_t *seqs = malloc(MINE_SLOTS * sizeof(*seqs));
+    if (!seqs)
+        return;
+    for (size_t i = 0; i < MINE_SLOTS; i++) {
+        if (m->seqs[i].pattern[0])
+            seqs[used++] = m->seqs[i];
+    }
+    qsort(seqs, used, sizeof(*seqs), mine_by_insns);
+
+    fprintf(err, "\n=== Unfused SUBLEQ Sequences ===\n");
+    fprintf(err, "%zu distinct sequences", used);
+    if (m->dropped)
+        fprintf(err, ", %" PRIu64 " runs not recorded", m->dropped);
+    fprintf(err, "\n");
+
+    size_t shown = used < m->top ? used : m->top;
+    if (shown > 0) {
+        fprintf(err, "\nTop %zu by plain SUBLEQ instructions executed:\n",
+                shown);
+        fprintf(err, "   Instrs    |   %%   |    Runs    | Pattern\n");
+        fprintf(err, "-------------|-------|------------|--------\n");
+    }
+    for (size_t i = 0; i < shown; i++) {
+        const mine_seq_t *seq = &seqs[i];
+        uint64_t n = seq->count * seq->len;
+        fprintf(err, " %11" PRIu64 " | %5.1f | %10" PRIu64 " | %s\n", n,
+                plain ? 100.0 * n / plain : 0.0, seq->count, seq->pattern);
+    }
+    free(seqs);
+}
+
+/* Print the border of the statistics table, which has a column for each
+ * hardware counter --perf samples
+ */
+static int stats_div(const vm_t *vm, FILE *err)
+{
+    if (fputs("+--------+---------------+--------------+----------+", err) < 0)
+        return -1;
+    for (unsigned e = 0; e < vm->perf.nevents; e++) {
+        if (fputs("-------------+", err) < 0)
+            return -1;
+    }
+    return fputs("\n", err) < 0 ? -1 : 0;
+}
+
+/* End a row of the statistics table with the hardware counter columns:
+ * their names for the @header, else the counts sampled in the handler of
+ * @op, or in total for -1. Counts are samples times the sample period.
+ */
+static int stats_perf(const vm_t *vm, FILE *err, int op, bool header)
+{
+    const perf_t *pf = &vm->perf;
+
+    for (unsigned e = 0; e < pf->nevents; e++) {
+        uint64_t n = 0;
+        for (int i = 0; i <= IMAX; i++) {
+            if (op < 0 || op == i)
+                n += pf->count[e][i];
+        }
+        if ((header ? fprintf(err, " %11s |", pf->name[e])
+                    : fprintf(err, " %11" PRIu64 " |", n * pf->period[e])) < 0)
+            return -1;
+    }
+    return fputs("\n", err) < 0 ? -1 : 0;
+}
+
+/* Report performance statistics */
+int vm_report_stats(vm_t *vm, FILE *err)
+{
+    optimizer_t *opt = &vm->opt;
+    profiler_t *prof = &vm->prof;
+    double elapsed = (double) (opt->end - opt->start) / CLOCKS_PER_SEC;
+    int64_t total_ops = 0, total_substitutions = 0;
+
+    for (int i = 0; i < IMAX; i++) {
+        total_ops += opt->exec_count[i];
+        if (i != SUBLEQ)
+            total_substitutions += opt->matches[i];
+    }
+
+    const char *div = "+--------+---------------+--------------+----------+\n";
+    if (stats_div(vm, err) < 0)
+        return -1;
+    if (fprintf(err,
+                "| Instr. | Substitutions | Instr. count | Instr. %% |") < 0 ||
+        stats_perf(vm, err, -1, true) < 0)
+        return -1;
+    if (stats_div(vm, err) < 0)
+        return -1;
+
+    if (fprintf(err, "| SUBLEQ | %13d | %12" PRId64 " | %7.1f%% |",
+                opt->matches[SUBLEQ], opt->exec_count[SUBLEQ],
+                total_ops ? 100.0 * opt->exec_count[SUBLEQ] / total_ops : 0.0) <
+            0 ||
+        stats_perf(vm, err, SUBLEQ, false) < 0)
+        return -1;
+
+    for (int i = 1; i < IMAX; i++) {
+        if (opt->matches[i] == 0 && opt->exec_count[i] == 0)
+            continue;
+        if (fprintf(err, "| %-6s | %13d | %12" PRId64 " | %7.1f%% |",
+                    insn_names[i], opt->matches[i], opt->exec_count[i],
+                    total_ops ? 100.0 * opt->exec_count[i] / total_ops : 0.0) <
+                0 ||
+            stats_perf(vm, err, i, false) < 0)
+            return -1;
+    }
+    if (vm->perf.nevents > 0 &&
+        (fprintf(err, "| Other  |               |              |          |") <
+             0 ||
+         stats_perf(vm, err, IMAX, false) < 0))
+        return -1;
+
+    if (stats_div(vm, err) < 0)
+        return -1;
+    if (fprintf(err, "| Totals | %13" PRId64 " | %12" PRId64 " |          |",
+                total_substitutions, total_ops) < 0 ||
+        stats_perf(vm, err, -1, false) < 0)
+        return -1;
+    if (stats_div(vm, err) < 0)
+        return -1;
+    if (fprintf(err, "|         Execution time %.3f seconds             |\n",
+                elapsed) < 0)
+        return -1;
+    if (fputs(div, err) < 0)
+        return -1;
+    if (vm->perf.lost > 0 &&
+        fprintf(err, "Hardware counters: %" PRIu64 " samples lost\n",
+                vm->perf.lost) < 0)
+        return -1;
+
+    if (fprintf(err, "\n     Phase     |  Wall ms   |   CPU ms\n") < 0 ||
+        fprintf(err, "---------------|------------|-----------\n") < 0)
+        return -1;
+    for (int i = 0; i < PHASES; i++) {
+        if (fprintf(err, " %-14s| %10.3f | %10.3f\n", phase_names[i],
+                    1e3 * vm->phase[i].wall, 1e3 * vm->phase[i].cpu) < 0)
+            return -1;
+    }
+
+    /* Profiler report */
+    if (vm->profiler_enabled && prof->enabled) {
+        prof->end_time = clock();
+        double prof_elapsed =
+            (double) (prof->end_time - prof->start_time) / CLOCKS_PER_SEC;
+
+        profiler_sum_accesses(prof);
+        fprintf(err, "\n=== Lightweight Profiler Report ===\n");
+        fprintf(err, "Total instructions executed: %" PRIu64 "\n",
+                prof->total_instructions);
+        fprintf(err, "Memory accesses: %" PRIu64 "\n", prof->memory_accesses);
+        fprintf(err, "Instructions per second: %.0f\n",
+                prof_elapsed > 0 ? prof->total_instructions / prof_elapsed : 0);
+
+        if (prof->total_instructions > 0) {
+            fprintf(err, "Memory accesses per instruction: %.2f\n",
+                    (double) prof->memory_accesses / prof->total_instructions);
+        }
+        regions_report(vm, err);
+
+        /* Hot spots analysis */
+        profiler_analyze_hot_spots(vm);
+        profiler_print_hot_spots(vm, err, "Exec Count",
+                                 prof->total_instructions);
+        words_report(vm, err, "Instructions", WORDS_STRIDE);
+
+        /* Export profiler data to file */
+        FILE *prof_file = fopen("profiler_report.txt", "w");
+        if (prof_file) {
+            fprintf(prof_file, "SUBLEQ VM Lightweight Profiler Report\n");
+            fprintf(prof_file, "=====================================\n");
+            fprintf(prof_file, "Execution time: %.3f seconds\n", prof_elapsed);
+            fprintf(prof_file, "Total instructions: %" PRIu64 "\n",
+                    prof->total_instructions);
+            fprintf(prof_file, "Memory accesses: %" PRIu64 "\n",
+                    prof->memory_accesses);
+            fprintf(
+                prof_file, "Instructions per second: %.0f\n",
+                prof_elapsed > 0 ? prof->total_instructions / prof_elapsed : 0);
+
+            fprintf(prof_file, "\nInstruction Mix:\n");
+            for (int i = 0; i < IMAX; i++) {
+                if (opt->exec_count[i] > 0) {
+                    fprintf(prof_file, "  %-8s: %12" PRId64 " (%6.2f%%)\n",
+                            insn_names[i], opt->exec_count[i],
+                            total_ops > 0
+                                ? 100.0 * opt->exec_count[i] / total_ops
+                                : 0);
+                }
+            }
+
+            if (prof->hot_spot_count > 0) {
+                fprintf(prof_file,
+                        "\nHot Spots (PC addresses with highest execution "
+                        "counts):\n");
+                for (size_t i = 0; i < prof->hot_spot_count; i++) {
+                    hot_spot_t *spot = &prof->hot_spots[i];
+                    double percent = prof->total_instructions > 0
+                                         ? 100.0 * spot->exec_count /
+                                               prof->total_instructions
+                                         : 0;
+
+                    fprintf(prof_file,
+                            "  PC %6" PRIu64 ": %10" PRIu64
+                            " executions (%5.1f%%) [%s]\n",
+                            spot->pc, spot->exec_count, percent,
+                            spot->opcode < IMAX ? insn_names[spot->opcode]
+                                                : "unknown");
+                }
+            }
+
+            fclose(prof_file);
+            fprintf(
+                err,
+                "\nDetailed profiler report saved to: profiler_report.txt\n");
+        }
+    }
+
+    if (prof->sampling) {
+        fprintf(err, "\n=== Sampling Profiler Report ===\n");
+        fprintf(err, "Samples: %" PRIu64 " over %.3f seconds of CPU time\n",
+                prof->samples, elapsed);
+        profiler_analyze_hot_spots(vm);
+        profiler_print_hot_spots(vm, err, "Samples", prof->samples);
+        words_report(vm, err, "Samples", 1);
+    }
+
+    if (prof->mining)
+        mine_report(vm, err);
+
+    return 0;
+}
+
+/* Write the samples of every hardware counter in the handler of @op, or
+ * in host code outside the handlers for IMAX, as a JSON object
+ */
+static void json_perf(const vm_t *vm, FILE *out, int op)
+{
+    const perf_t *pf = &vm->perf;
+
+    fputs("{", out);
+    for (unsigned e = 0; e < pf->nevents; e++)
+        fprintf(out, "%s\"%s\": %" PRIu64, e ? ", " : "", pf->name[e],
+                pf->count[e][op] * pf->period[e]);
+    fputs("}", out);
+}
+
+int vm_report_json(vm_t *vm, FILE *out)
+{
+    const optimizer_t *opt = &vm->opt;
+    profiler_t *prof = &vm->prof;
+    double elapsed = (double) (opt->end - opt->start) / CLOCKS_PER_SEC;
+    bool counting = vm->profiler_enabled && prof->enabled;
+    int64_t total_ops = 0, total_substitutions = 0;
+
+    for (int i = 0; i < IMAX; i++) {
+        total_ops += opt->exec_count[i];
+        if (i != SUBLEQ)
+            total_substitutions += opt->matches[i];
+    }
+    if (counting)
+        profiler_sum_accesses(prof);
+
+    fprintf(out, "{\n  \"schema\": \"subleq-stats\",\n");
+    fprintf(out, "  \"version\": %d,\n", VM_STATS_JSON_VERSION);
+    fprintf(out, "  \"optimized\": %s,\n",
+            vm->optimize_enabled ? "true" : "false");
+    fprintf(out, "  \"instructions\": %" PRId64 ",\n", total_ops);
+    fprintf(out, "  \"substitutions\": %" PRId64 ",\n",
+            total_substitutions);
+    fprintf(out, "  \"cpu_seconds\": %.6f,\n", elapsed);
+    fprintf(out, "  \"instructions_per_second\": %.0f,\n",
+            elapsed > 0 ? total_ops / elapsed : 0.0);
+
+    fprintf(out, "  \"opcodes\": [");
+    for (int i = 0; i < IMAX; i++) {
+        fprintf(out,
+                "%s\n    {\"name\": \"%s\", \"substitutions\": %d, "
+                "\"executed\": %" PRId64,
+                i ? "," : "", insn_names[i], opt->matches[i],
+                opt->exec_count[i]);
+        if (counting)
+            fprintf(out, ", \"memory_accesses\": %" PRIu64,
+                    prof->op_accesses[i]);
+        if (vm->perf.nevents > 0) {
+            fputs(", \"counters\": ", out);
+            json_perf(vm, out, i);
+        }
+        fputs("}", out);
+    }
+    fprintf(out, "\n  ],\n");
+
+    fputs("  \"phases\": {", out);
+    for (int i = 0; i < PHASES; i++)
+        fprintf(out,
+                "%s\n    \"%s\": {\"wall_seconds\": %.6f, "
+                "\"cpu_seconds\": %.6f}",
+                i ? "," : "", phase_keys[i], vm->phase[i].wall,
+                vm->phase[i].cpu);
+    fprintf(out, "\n  },\n");
+
+    if (vm->perf.nevents > 0) {
+        fputs("  \"counters_other\": ", out);
+        json_perf(vm, out, IMAX);
+        fprintf(out, ",\n  \"counters_lost\": %" PRIu64 ",\n",
+                vm->perf.lost);
+    }
+
+    fputs("  \"profiler\": ", out);
+    if (counting || prof->sampling) {
+        profiler_analyze_hot_spots(vm);
+        fprintf(out, "{\n    \"mode\": \"%s\",\n",
+                counting ? "counting" : "sampling");
+        if (counting)
+            fprintf(out,
+                    "    \"instructions\": %" PRIu64 ",\n"
+                    "    \"memory_accesses\": %" PRIu64 ",\n",
+                    prof->total_instructions, prof->memory_accesses);
+        else
+            fprintf(out, "    \"samples\": %" PRIu64 ",\n", prof->samples);
+        region_t r[REGIONS];
+        if (counting && regions_sum(vm, r) == 0) {
+            fputs("    \"regions\": [", out);
+            for (int g = 0, n = 0; g < REGIONS; g++) {
+                if (r[g].lo > r[g].hi)
+                    continue;
+                fprintf(out,
+                        "%s\n      {\"name\": \"%s\", \"start\": %u, "
+                        "\"end\": %u, \"reads\": %" PRIu64
+                        ", \"writes\": %" PRIu64 ", \"opcodes\": {",
+                        n++ ? "," : "", region_keys[g], r[g].lo, r[g].hi,
+                        r[g].reads, r[g].writes);
+                for (int i = 0, m = 0; i < IMAX; i++) {
+                    if (r[g].ops[i])
+                        fprintf(out, "%s\"%s\": %" PRIu64, m++ ? ", " : "",
+                                insn_names[i], r[g].ops[i]);
+                }
+                fputs("}}", out);
+            }
+            fputs("\n    ],\n", out);
+        }
+        fputs("    \"hot_spots\": [", out);
+        for (size_t i = 0; i < prof->hot_spot_count; i++) {
+            const hot_spot_t *spot = &prof->hot_spots[i];
+            fprintf(out,
+                    "%s\n      {\"pc\": %" PRIu64 ", \"count\": %" PRIu64
+                    ", \"opcode\": \"%s\"}",
+                    i ? "," : "", spot->pc, spot->exec_count,
+                    spot->opcode < IMAX ? insn_names[spot->opcode] : "???");
+        }
+        fprintf(out, "%s]\n  }\n", prof->hot_spot_count ? "\n    " : "");
+    } else {
+        fputs("null\n", out);
+    }
+    fputs("}\n", out);
+
+    return ferror(out) ? -1 : 0;
+}
+
+/* Trace reader: the bytes of a trace file, and where decoding is */
+typedef struct {
+    const uint8_t *p, *end;
+} trace_in_t;
+
+/* Decode a varint into @v. Returns false at the end of the data. */
+static bool trace_get(trace_in_t *in, uint64_t *v)
+{
+    *v = 0;
+    for (unsigned shift = 0; in->p < in->end && shift < 64; shift += 7) {
+        uint8_t b = *in->p++;
+        *v |= (uint64_t) (b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+/* Basic block or branch found in a trace, keyed by two 16-bit pcs */
+typedef struct {
+    uint32_t key;   /* First pc << 16 | second pc */
+    bool used;
+    uint64_t count; /* Times executed or taken */
+    uint64_t insns; /* Instructions executed in the block */
+} trace_entry_t;
+
+typedef struct {
+    trace_entry_t *slot;
+    size_t cap, count;
+} trace_table_t;
+
+/* Entry for @key in @tab, added if new. Returns NULL if out of memory. */
+static trace_entry_t *trace_table_get(trace_table_t *tab, uint32_t key)
+{
+    if (2 * (tab->count + 1) > tab->cap) {
+        size_t cap = tab->cap ? 2 * tab->cap : 4096;
+        trace_entry_t *slot = calloc(cap, sizeof(*slot));
+        if (!slot)
+            return NULL;
+        for (size_t i = 0; i < tab->cap; i++) {
+            if (!tab->slot[i].used)
+                continue;
+            size_t h = (tab->slot[i].key * 2654435761u) & (cap - 1);
+            while (slot[h].used)
+                h = (h + 1) & (cap - 1);
+            slot[h] = tab->slot[i];
+        }
+        free(tab->slot);
+        tab->slot = slot;
+        tab->cap = cap;
+    }
+
+    size_t h = (key * 2654435761u) & (tab->cap - 1);
+    while (tab->slot[h].used && tab->slot[h].key != key)
+        h = (h + 1) & (tab->cap - 1);
+    if (!tab->slot[h].used) {
+        tab->slot[h].used = true;
+        tab->slot[h].key = key;
+        tab->count++;
+    }
+    return &tab->slot[h];
+}
+
+/* Pack the used entries of @tab at its start, sorted by @cmp */
+static void trace_table_sort(trace_table_t *tab,
+                             int (*cmp)(const void *, const void *))
+{
+    size_t n = 0;
+    for (size_t i = 0; i < tab->cap; i++) {
+        if (tab->slot[i].used)
+            tab->slot[n++] = tab->slot[i];
+    }
+    if (n > 0)
+        qsort(tab->slot, n, sizeof(*tab->slot), cmp);
+}
+
+static int trace_by_insns(const void *a, const void *b)
+{
+    const trace_entry_t *x = a, *y = b;
+    return (x->insns < y->insns) - (x->insns > y->insns);
+}
+
+static int trace_by_count(const void *a, const void *b)
+{
+    const trace_entry_t *x = a, *y = b;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+/* Read the whole file at @path. Returns its bytes, or NULL. */
+static uint8_t *trace_slurp(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    uint8_t *data = NULL;
+    size_t len = 0, cap = 0;
+
+    if (!file)
+        return NULL;
+    for (;;) {
+        if (len == cap) {
+            size_t ncap = cap ? 2 * cap : 1 << 16;
+            uint8_t *ndata = realloc(data, ncap);
+            if (!ndata) {
+                free(data);
+                fclose(file);
+                return NULL;
+            }
+            data = ndata;
+            cap = ncap;
+        }
+        size_t n = fread(data + len, 1, cap - len, file);
+        len += n;
+        if (n == 0)
+            break;
+    }
+    if (ferror(file)) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    *size = len;
+    return data;
+}
+
+/* Print the hot path: from the hottest block, follow the branch taken
+ * most often out of each block to the hottest block at its target, until
+ * a block repeats. @blocks and @branches are sorted.
+ */
+static void trace_hot_path(const trace_table_t *blocks,
+                           const trace_table_t *branches,
+                           FILE *out)
+{
+    uint32_t seen[16];
+    size_t nseen = 0;
+
+    if (blocks->count == 0)
+        return;
+    fprintf(out, "\nHot path:\n ");
+    uint32_t key = blocks->slot[0].key;
+    for (;;) {
+        uint16_t start = (uint16_t) (key >> 16), end = (uint16_t) key;
+        for (size_t i = 0; i < nseen; i++) {
+            if (seen[i] == key) {
+                fprintf(out, " (loop)\n");
+                return;
+            }
+        }
+        if (nseen == 16) {
+            fprintf(out, " ...\n");
+            return;
+        }
+        seen[nseen++] = key;
+        fprintf(out, "%s %u-%u", nseen > 1 ? " ->" : "", start, end);
+
+        const trace_entry_t *next = NULL;
+        for (size_t i = 0; i < branches->count && !next; i++) {
+            if ((uint16_t) (branches->slot[i].key >> 16) == end)
+                next = &branches->slot[i];
+        }
+        const trace_entry_t *block = NULL;
+        for (size_t i = 0; next && i < blocks->count && !block; i++) {
+            if (blocks->slot[i].key >> 16 == (uint16_t) next->key)
+                block = &blocks->slot[i];
+        }
+        if (!block) {
+            fprintf(out, "\n");
+            return;
+        }
+        key = block->key;
+    }
+}
+
+int vm_trace_stats(const char *path, FILE *out)
+{
+    trace_table_t blocks = {0}, branches = {0};
+    uint64_t runs = 0, checkpoints = 0, taken = 0, backward = 0, insns = 0;
+    uint64_t v, block = 0;
+    bool partial = true; /* Until the last record is read whole */
+    size_t size;
+    int status = -1;
+
+    uint8_t *data = trace_slurp(path, &size);
+    if (!data) {
+        fprintf(stderr, "Error: Failed to read trace '%s'\n", path);
+        return -1;
+    }
+    trace_in_t in = {data + 4, data + size};
+    if (size < 4 || memcmp(data, TRACE_MAGIC, 4) || !trace_get(&in, &v) ||
+        v != TRACE_VERSION) {
+        fprintf(stderr, "Error: '%s' is not a version %d trace\n", path,
+                TRACE_VERSION);
+        goto out;
+    }
+
+    trace_entry_t *blk = NULL, *br = NULL; /* Of the last branch */
+    uint64_t last = 0;                     /* Its instructions */
+    while (in.p < in.end) {
+        uint64_t a, b, c;
+        if (!trace_get(&in, &v) || !trace_get(&in, &a) ||
+            (v != TRACE_REPEAT && !trace_get(&in, &b)))
+            goto report;
+        if (v == TRACE_REPEAT) {
+            if (!blk) {
+                fprintf(stderr, "Error: Repeat without a branch\n");
+                goto out;
+            }
+            blk->count += a;
+            blk->insns += a * last;
+            br->count += a;
+            taken += a;
+            backward += (br->key >> 16 >= (br->key & 0xFFFF)) * a;
+            insns += a * last;
+        } else if (v == TRACE_RUN) {
+            block = a;
+            runs++;
+        } else if (v == TRACE_END) {
+            insns += b;
+        } else if (v == TRACE_MEM) {
+            for (uint64_t cells = 0; cells < SZ;) {
+                uint64_t same, diff;
+                if (!trace_get(&in, &same) || !trace_get(&in, &diff))
+                    goto report;
+                for (uint64_t k = 0; k < diff; k++) {
+                    if (!trace_get(&in, &c))
+                        goto report;
+                }
+                cells += same + diff;
+            }
+            checkpoints++;
+        } else if (!(v & 1)) {
+            uint16_t from = (uint16_t) (block + unzigzag(v >> 1));
+            uint16_t to = (uint16_t) (from + unzigzag(a));
+            blk = trace_table_get(&blocks,
+                                  (uint32_t) (uint16_t) block << 16 | from);
+            br = blk ? trace_table_get(&branches, (uint32_t) from << 16 | to)
+                     : NULL;
+            if (!blk || !br) {
+                fprintf(stderr, "Error: Out of memory\n");
+                goto out;
+            }
+            blk->count++;
+            blk->insns += b;
+            br->count++;
+            taken++;
+            backward += to <= from;
+            insns += b;
+            last = b;
+            block = to;
+        } else {
+            fprintf(stderr, "Error: Unknown trace record %" PRIu64 "\n", v);
+            goto out;
+        }
+    }
+    partial = false;
+
+report:
+    if (partial)
+        fprintf(stderr, "Warning: Trace ends in a partial record\n");
+
+    fprintf(out, "=== Trace Statistics ===\n");
+    fprintf(out, "Runs: %" PRIu64 ", memory checkpoints: %" PRIu64 "\n",
+            runs, checkpoints);
+    fprintf(out, "Instructions: %" PRIu64 "\n", insns);
+    fprintf(out,
+            "Taken branches: %" PRIu64 " (%" PRIu64 " backward), "
+            "%.1f instructions per branch\n",
+            taken, backward, taken ? (double) insns / taken : 0.0);
+    fprintf(out, "Trace size: %zu bytes, %.2f per branch\n", size,
+            taken ? (double) size / taken : 0.0);
+    fprintf(out, "Basic blocks: %zu, branch edges: %zu\n", blocks.count,
+            branches.count);
+
+    trace_table_sort(&blocks, trace_by_insns);
+    trace_table_sort(&branches, trace_by_count);
+
+    size_t shown = blocks.count < 10 ? blocks.count : 10;
+    if (shown > 0) {
+        fprintf(out, "\nTop %zu basic blocks by instructions:\n", shown);
+        fprintf(out, " Start |  End  |    Runs    |   Instrs    |   %%\n");
+        fprintf(out, "-------|-------|------------|-------------|------\n");
+    }
+    for (size_t i = 0; i < shown; i++) {
+        const trace_entry_t *e = &blocks.slot[i];
+        fprintf(out,
+                " %5u | %5u | %10" PRIu64 " | %11" PRIu64 " | %5.1f\n",
+                e->key >> 16, e->key & 0xFFFF, e->count, e->insns,
+                insns ? 100.0 * e->insns / insns : 0.0);
+    }
+
+    shown = branches.count < 10 ? branches.count : 10;
+    if (shown > 0) {
+        fprintf(out, "\nTop %zu taken branches:\n", shown);
+        fprintf(out, "  From |   To  |   Count    |   %%\n");
+        fprintf(out, "-------|-------|------------|------\n");
+    }
+    for (size_t i = 0; i < shown; i++) {
+        const trace_entry_t *e = &branches.slot[i];
+        fprintf(out, " %5u | %5u | %10" PRIu64 " | %5.1f\n", e->key >> 16,
+                e->key & 0xFFFF, e->count,
+                taken ? 100.0 * e->count / taken : 0.0);
+    }
+
+    trace_hot_path(&blocks, &branches, out);
+    status = ferror(out) ? -1 : 0;
+
+out:
+    free(blocks.slot);
+    free(branches.slot);
+    free(data);
+    return status;
+}
+
+#ifdef PLAT_POSIX
+/* The VM the profiling timer samples. One VM is sampled at a time. */
+static vm_t *sampled_vm;
+static struct sigaction sampler_saved;
+
+/* SIGPROF handler: flag a sample and make the VM take it at its next taken
+ * branch, where its pc is known
+ */
+static void sampler_signal(int sig)
+{
+    (void) sig;
+    vm_t *vm = __atomic_load_n(&sampled_vm, __ATOMIC_ACQUIRE);
+    if (!vm)
+        return;
+    __atomic_store_n(&vm->prof.sample_pending, true, __ATOMIC_RELAXED);
+    __atomic_store_n(&vm->insn_limit, 0, __ATOMIC_RELAXED);
+}
+
+/* Start sampling @vm. Returns false if another VM is being sampled or the
+ * timer cannot be set up.
+ */
+static bool sampler_start(vm_t *vm)
+{
+    vm_t *none = NULL;
+    if (!__atomic_compare_exchange_n(&sampled_vm, &none, vm, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        if (!vm->prof.sample_busy)
+            fprintf(stderr, "Warning: Another VM is being sampled, "
+                            "this one is not\n");
+        vm->prof.sample_busy = true;
+        return false;
+    }
+
+    struct sigaction sa = {.sa_handler = sampler_signal};
+    struct itimerval it = {
+        .it_interval = {.tv_sec = 0, .tv_usec = SAMPLE_USEC},
+        .it_value = {.tv_sec = 0, .tv_usec = SAMPLE_USEC},
+    };
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, &sampler_saved) < 0)
+        goto fail;
+    if (setitimer(ITIMER_PROF, &it, NULL) < 0) {
+        sigaction(SIGPROF, &sampler_saved, NULL);
+        goto fail;
+    }
+    return true;
+
+fail:
+    __atomic_store_n(&sampled_vm, NULL, __ATOMIC_RELEASE);
+    return false;
+}
+
+static void sampler_stop(vm_t *vm)
+{
+    struct itimerval it = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_PROF, &it, NULL);
+    __atomic_store_n(&sampled_vm, NULL, __ATOMIC_RELEASE);
+    sigaction(SIGPROF, &sampler_saved, NULL);
+    vm->prof.sample_pending = false;
+}
+#else
+static bool sampler_start(vm_t *vm)
+{
+    (void) vm;
+    return false;
+}
+
+static void sampler_stop(vm_t *vm)
+{
+    (void) vm;
+}
+#endif
+
+/* Print where @vm stands to stderr and carry on: instructions and rates,
+ * overall and since the last dump, the opcode mix and the hot spots so far
+ */
+static void live_dump(vm_t *vm)
+{
+    const optimizer_t *opt = &vm->opt;
+    profiler_t *prof = &vm->prof;
+    double wall =
+        vm->phase[PHASE_EXECUTE].wall + stamp_now().wall - vm->run_start.wall;
+    double span = wall - vm->live_wall;
+    uint64_t recent = vm->insns - vm->live_insns;
+
+    fprintf(stderr, "\n=== Live Statistics ===\n");
+    fprintf(stderr, "Instructions: %" PRIu64 " in %.3f seconds, %.0f/s\n",
+            vm->insns, wall, wall > 0 ? vm->insns / wall : 0.0);
+    fprintf(stderr, "Since last dump: %" PRIu64 " in %.3f seconds, %.0f/s\n",
+            recent, span, span > 0 ? recent / span : 0.0);
+    vm->live_insns = vm->insns;
+    vm->live_wall = wall;
+
+    fprintf(stderr, "\n Instr. | Instr. count | Instr. %%\n");
+    fprintf(stderr, "--------|--------------|---------\n");
+    for (int i = 0; i < IMAX; i++) {
+        if (opt->exec_count[i] == 0)
+            continue;
+        fprintf(stderr, " %-6s | %12" PRId64 " | %6.1f%%\n", insn_names[i],
+                opt->exec_count[i],
+                vm->insns ? 100.0 * opt->exec_count[i] / vm->insns : 0.0);
+    }
+
+    if (prof->enabled) {
+        profiler_sum_accesses(prof);
+        fprintf(stderr, "\nMemory accesses: %" PRIu64 "\n",
+                prof->memory_accesses);
+        profiler_analyze_hot_spots(vm);
+        profiler_print_hot_spots(vm, stderr, "Exec Count",
+                                 prof->total_instructions);
+    } else if (prof->sampling) {
+        fprintf(stderr, "\nSamples: %" PRIu64 "\n", prof->samples);
+        profiler_analyze_hot_spots(vm);
+        profiler_print_hot_spots(vm, stderr, "Samples", prof->samples);
+    }
+    fflush(stderr);
+}
+
+#ifdef PLAT_POSIX
+static struct sigaction live_saved; /* SIGUSR1 disposition outside runs */
+
+/* SIGUSR1 handler: flag a dump and have the running VM take it at its
+ * next taken branch
+ */
+static void live_signal(int sig)
+{
+    (void) sig;
+    __atomic_store_n(&live_pending, true, __ATOMIC_RELAXED);
+    vm_t *vm = __atomic_load_n(&live_vm, __ATOMIC_ACQUIRE);
+    if (vm)
+        __atomic_store_n(&vm->insn_limit, 0, __ATOMIC_RELAXED);
+}
+
+/* Make @vm the one SIGUSR1 dumps while it runs, installing the handler
+ * until live_stop() puts the previous one back. It restarts no system
+ * call, so a VM blocked on input sees EINTR and dumps at once. Returns
+ * false if another VM holds the signal.
+ */
+static bool live_start(vm_t *vm)
+{
+    vm_t *none = NULL;
+    if (!__atomic_compare_exchange_n(&live_vm, &none, vm, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        if (!vm->live_busy)
+            fprintf(stderr, "Warning: Another VM takes SIGUSR1, "
+                            "this one does not dump\n");
+        vm->live_busy = true;
+        return false;
+    }
+
+    struct sigaction sa = {.sa_handler = live_signal};
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR1, &sa, &live_saved) < 0) {
+        __atomic_store_n(&live_vm, NULL, __ATOMIC_RELEASE);
+        return false;
+    }
+    return true;
+}
+
+static void live_stop(vm_t *vm)
+{
+    (void) vm;
+    sigaction(SIGUSR1, &live_saved, NULL);
+    __atomic_store_n(&live_vm, NULL, __ATOMIC_RELEASE);
+    __atomic_store_n(&live_pending, false, __ATOMIC_RELAXED);
+}
+#else
+static bool live_start(vm_t *vm)
+{
+    (void) vm;
+    return false;
+}
+
+static void live_stop(vm_t *vm)
+{
+    (void) vm;
+}
+#endif
+
+/* Execute the virtual machine */
+int vm_run(vm_t *vm, uint64_t budget)
+{
+    if (!vm->code)
+        return VM_ERROR; /* Not decoded yet */
+    if (vm->error)
+        return VM_ERROR;
+    if (vm->pc >= vm->mem_size / 2)
+        return VM_HALTED;
+    vm->need_input = false;
+
+    vm->insn_end = budget && budget <= UINT64_MAX - vm->insns
+                       ? vm->insns + budget
+                       : UINT64_MAX;
+    vm->insn_limit = vm->insn_end;
+    if ((vm->prof.enabled || vm->prof.sampling) && !vm->prof.forth.searched) {
+        vm->prof.forth.searched = true;
+        words_locate(vm);
+    }
+    vm->prof.hooked = vm->prof.enabled || vm->prof.mining;
+    bool sampling = vm->prof.sampling && sampler_start(vm);
+    bool counting = vm->perf.enabled && perf_start(vm);
+    bool live = vm->live_enabled && live_start(vm);
+
+    if (vm->trace.on)
+        trace_run(vm);
+
+    vm->run_start = stamp_now();
+    clock_t start = clock();
+    if (vm->insns == 0)
+        vm->opt.start = start;
+    else /* Resuming: keep only the time spent running */
+        vm->opt.start += start - vm->opt.end;
+
+    /* Initial call to dispatch, passing NULL for the unused insn pointer. */
+    dispatch(vm, vm->pc, NULL);
+    vm->opt.end = clock();
+    phase_add(vm, PHASE_EXECUTE, vm->run_start);
+    if (live)
+        live_stop(vm);
+    if (vm->trace.on)
+        trace_end(vm);
+    if (sampling)
+        sampler_stop(vm);
+    /* A slice that yields or waits for input leaves its run open */
+    bool stopped = vm->error || (!vm->need_input &&
+                                 vm->pc >= vm->mem_size / 2);
+    if (vm->prof.mining && vm->prof.mine.len > 0 && stopped)
+        mine_flush(vm);
+    if (counting)
+        perf_stop(vm);
+
+    if (output_flush(vm) < 0)
+        vm->error = -1;
+    if (vm->error)
+        return VM_ERROR;
+    if (vm->need_input)
+        return VM_NEED_INPUT;
+    return vm->pc < vm->mem_size / 2 ? VM_YIELD : VM_HALTED;
+}
+
+typedef void (*handler_func_t)(vm_t *vm, uint64_t pc, const insn_t *insn);
+/* The dispatch table, mapping opcodes to their handler functions */
+static handler_func_t const dispatch_table[IMAX] = {
+#define _(inst, inc) [inst] = handle_##inst,
+    INSN_LIST
+#undef _
+};
+
+/* Dispatch to instruction handlers. */
+HOT_PATH static void dispatch(vm_t *vm, uint64_t pc, const insn_t *unused_insn)
+{
+    (void) unused_insn;
+
+    if (UNLIKELY(pc >= vm->mem_size / 2 || vm->error)) {
+        vm->pc = pc;
+        return;
+    }
+
+    /* Read the instruction once, and pass a pointer to the handler. */
+    const insn_t *insn = &vm->insn[pc];
+    uint8_t opcode = insn->opcode;
+    vm->opt.exec_count[opcode]++;
+    vm->insns++;
+
+    /* Use the dispatch table for a direct function call. The handler
+     * will then tail-call back to this dispatch function, continuing the
+     * execution cycle without growing the stack.
+     */
+    MUST_TAIL return dispatch_table[opcode](vm, pc, insn);
+}
+
+#ifdef PLAT_LINUX
+/* Events --perf samples, each recording the host pc every @period counts */
+typedef struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    uint64_t period;
+} perf_event_t;
+
+static const perf_event_t perf_events[PERF_EVENTS] = {
+    {"Cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 100003},
+    {"Host ins", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 100003},
+    {"Br. miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, 1009},
+    {"L1d miss", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+     1009},
+};
+
+/* Sampled alone, in nanoseconds, where there are no hardware counters */
+static const perf_event_t perf_fallback = {
+    "CPU ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, 100000};
+
+/* The VM whose counters are running. One VM is counted at a time. */
+static vm_t *perf_vm;
+static struct sigaction perf_saved;
+
+/* SIGIO handler: the sample buffer is half full, have the VM drain it at
+ * its next taken branch
+ */
+static void perf_signal(int sig)
+{
+    (void) sig;
+    vm_t *vm = __atomic_load_n(&perf_vm, __ATOMIC_ACQUIRE);
+    if (!vm)
+        return;
+    __atomic_store_n(&vm->perf.pending, true, __ATOMIC_RELAXED);
+    __atomic_store_n(&vm->insn_limit, 0, __ATOMIC_RELAXED);
+}
+
+/* Open @ev in the group of the events already open. Returns 0 or -1. */
+static int perf_add(vm_t *vm, const perf_event_t *ev, long page)
+{
+    perf_t *pf = &vm->perf;
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = ev->type;
+    attr.config = ev->config;
+    attr.sample_period = ev->period;
+    attr.sample_type = PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_IP;
+    attr.disabled = pf->nevents == 0; /* The others follow the leader */
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.watermark = 1;
+    attr.wakeup_watermark = (uint32_t) (PERF_RING_PAGES * page / 2);
+
+    int fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1,
+                           pf->nevents ? pf->fd[0] : -1, 0);
+    if (fd < 0)
+        return -1;
+    unsigned n = pf->nevents;
+    if (ioctl(fd, PERF_EVENT_IOC_ID, &pf->id[n]) < 0 ||
+        (n > 0 && ioctl(fd, PERF_EVENT_IOC_SET_OUTPUT, pf->fd[0]) < 0)) {
+        close(fd);
+        return -1;
+    }
+    pf->fd[n] = fd;
+    pf->name[n] = ev->name;
+    pf->period[n] = ev->period;
+    pf->nevents++;
+    return 0;
+}
+
+static void perf_close(vm_t *vm)
+{
+    perf_t *pf = &vm->perf;
+    if (pf->ring)
+        munmap(pf->ring, pf->ring_size);
+    pf->ring = NULL;
+    for (unsigned i = pf->nevents; i-- > 0;)
+        close(pf->fd[i]);
+    pf->nevents = 0;
+}
+
+/* Open the counters on the running thread, falling back to sampling CPU
+ * time when the machine has no hardware counters (as in most VMs), and
+ * map their sample buffer. Leaves nevents 0 if none can be had.
+ */
+static void perf_open(vm_t *vm)
+{
+    perf_t *pf = &vm->perf;
+    long page = sysconf(_SC_PAGESIZE);
+
+    pf->opened = true;
+    for (unsigned i = 0; i < PERF_EVENTS; i++)
+        perf_add(vm, &perf_events[i], page);
+    if (pf->nevents == 0) {
+        if (perf_add(vm, &perf_fallback, page) < 0) {
+            fprintf(stderr, "Warning: perf_event_open failed: %s\n",
+                    strerror(errno));
+            return;
+        }
+        fprintf(stderr, "Warning: No hardware counters, sampling CPU time\n");
+    }
+
+    pf->ring_size = (size_t) (1 + PERF_RING_PAGES) * (size_t) page;
+    pf->ring = mmap(NULL, pf->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    pf->fd[0], 0);
+    if (pf->ring == MAP_FAILED ||
+        fcntl(pf->fd[0], F_SETOWN, getpid()) < 0 ||
+        fcntl(pf->fd[0], F_SETFL, fcntl(pf->fd[0], F_GETFL) | O_ASYNC) < 0) {
+        fprintf(stderr, "Warning: Failed to map perf sample buffer\n");
+        if (pf->ring == MAP_FAILED)
+            pf->ring = NULL;
+        perf_close(vm);
+    }
+}
+
+/* Opcode whose handler holds host address @ip, or IMAX for other code */
+static unsigned perf_opcode(uint64_t ip)
+{
+    uint64_t best = 0;
+    unsigned op = IMAX;
+
+    if (ip < (uintptr_t) __start_subleq_handlers ||
+        ip >= (uintptr_t) __stop_subleq_handlers)
+        return IMAX;
+    for (unsigned i = 0; i < IMAX; i++) {
+        uint64_t start = (uintptr_t) dispatch_table[i];
+        if (start <= ip && start >= best) {
+            best = start;
+            op = i;
+        }
+    }
+    return op;
+}
+
+/* Copy @len bytes at @off of the sample ring @data of @size bytes */
+static void perf_copy(const uint8_t *data,
+                      uint64_t size,
+                      uint64_t off,
+                      void *dst,
+                      size_t len)
+{
+    for (size_t k = 0; k < len; k++)
+        ((uint8_t *) dst)[k] = data[(off + k) & (size - 1)];
+}
+
+/* Attribute every sample in the buffer to its event and opcode */
+static void perf_drain(vm_t *vm)
+{
+    perf_t *pf = &vm->perf;
+    struct perf_event_mmap_page *meta = pf->ring;
+    if (!meta)
+        return;
+
+    const uint8_t *data = (const uint8_t *) meta + meta->data_offset;
+    uint64_t size = meta->data_size;
+    uint64_t head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = meta->data_tail;
+
+    while (tail < head) {
+        struct perf_event_header hdr;
+        uint64_t rec[2]; /* Sample: id, ip; lost: id, count */
+
+        perf_copy(data, size, tail, &hdr, sizeof(hdr));
+        if (hdr.size < sizeof(hdr))
+            break;
+        if (hdr.size >= sizeof(hdr) + sizeof(rec))
+            perf_copy(data, size, tail + sizeof(hdr), rec, sizeof(rec));
+        if (hdr.type == PERF_RECORD_SAMPLE) {
+            for (unsigned i = 0; i < pf->nevents; i++) {
+                if (pf->id[i] == rec[0])
+                    pf->count[i][perf_opcode(rec[1])]++;
             }
+        } else if (hdr.type == PERF_RECORD_LOST) {
+            pf->lost += rec[1];
+        }
+        tail += hdr.size;
+    }
+    __atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+}
 
-            /* Shift existing entries */
-            for (size_t i = prof->hot_spot_count; i > insert_pos; i--) {
-                if (i < MAX_HOT_SPOTS)
-                    prof->hot_spots[i] = prof->hot_spots[i - 1];
+/* Count the run of @vm. Returns false if another VM is being counted or
+ * no counters are available.
+ */
+static bool perf_start(vm_t *vm)
+{
+    perf_t *pf = &vm->perf;
+    if (!pf->opened)
+        perf_open(vm);
+    if (pf->nevents == 0)
+        return false;
+
+    vm_t *none = NULL;
+    if (!__atomic_compare_exchange_n(&perf_vm, &none, vm, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        if (!pf->busy)
+            fprintf(stderr, "Warning: Another VM is being counted, "
+                            "this one is not\n");
+        pf->busy = true;
+        return false;
+    }
+
+    struct sigaction sa = {.sa_handler = perf_signal};
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGIO, &sa, &perf_saved) < 0) {
+        __atomic_store_n(&perf_vm, NULL, __ATOMIC_RELEASE);
+        return false;
+    }
+    ioctl(pf->fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+}
+
+static void perf_stop(vm_t *vm)
+{
+    perf_t *pf = &vm->perf;
+    ioctl(pf->fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    __atomic_store_n(&perf_vm, NULL, __ATOMIC_RELEASE);
+    sigaction(SIGIO, &perf_saved, NULL);
+    pf->pending = false;
+    perf_drain(vm);
+}
+#else
+static void perf_drain(vm_t *vm)
+{
+    (void) vm;
+}
+
+static bool perf_start(vm_t *vm)
+{
+    if (!vm->perf.opened)
+        fprintf(stderr, "Warning: No performance counters on this system\n");
+    vm->perf.opened = true;
+    return false;
+}
+
+static void perf_stop(vm_t *vm)
+{
+    (void) vm;
+}
+
+static void perf_close(vm_t *vm)
+{
+    (void) vm;
+}
+#endif
+
+/* Lockstep lanes.
+ *
+ * VMs cloned from one template run the same decoded code, so while their
+ * pcs agree they can execute each instruction together. Their memories are
+ * transposed into one array holding the lanes of every cell side by side,
+ * and an instruction becomes a loop across lanes that the compiler turns
+ * into SIMD operations. Lanes are padded to whole groups of LANE_GROUP, and
+ * each group is worked on in local arrays, so these loops have a constant
+ * trip count and no aliasing to rule out. Indirect accesses and I/O are done
+ * lane by lane. When a branch sends the lanes different ways, or an
+ * instruction needs a device, the memories are transposed back and every VM
+ * carries on alone.
+ */
+
+/* Lanes per vector loop: 256 bits of 16-bit cells */
+#define LANE_GROUP 16
+
+typedef struct {
+    vm_t *const *vms;
+    size_t count;         /* Real lanes */
+    size_t stride;        /* Lanes per cell, padded to LANE_GROUP */
+    uint16_t *cells;      /* Cell @a of lane @k is cells[a * stride + k] */
+    uint64_t *pc;         /* Where each lane continues on its own */
+    bool *failed;         /* Lane's I/O failed in the current instruction */
+    size_t nfailed;       /* Number of lanes in @failed */
+    int64_t counts[IMAX]; /* Instructions executed by every lane */
+    uint64_t insns;       /* Instructions executed in lockstep */
+    uint64_t max_addr;    /* Highest address written by SUBLEQ */
+} lanes_t;
+
+static inline uint16_t *lane_cell(const lanes_t *l, uint16_t addr)
+{
+    return &l->cells[(size_t) MASK_ADDR(addr) * l->stride];
+}
+
+/* dst = expr for every lane, where expr combines d[k] and s[k] */
+#define LANE_OP2(name, expr)                                              \
+    static inline void lanes_##name(const lanes_t *l, uint16_t *dst,     \
+                                    const uint16_t *src)                 \
+    {                                                                     \
+        for (size_t g = 0; g < l->stride; g += LANE_GROUP) {              \
+            uint16_t d[LANE_GROUP], s[LANE_GROUP];                        \
+            memcpy(d, dst + g, sizeof(d));                                \
+            memcpy(s, src + g, sizeof(s));                                \
+            for (size_t k = 0; k < LANE_GROUP; k++)                       \
+                d[k] = (uint16_t) (expr);                                 \
+            memcpy(dst + g, d, sizeof(d));                                \
+        }                                                                 \
+    }
+
+/* dst = expr for every lane, where expr combines d[k] and the scalar v */
+#define LANE_OP1(name, expr)                                              \
+    static inline void lanes_##name(const lanes_t *l, uint16_t *dst,     \
+                                    unsigned v)                           \
+    {                                                                     \
+        (void) v;                                                         \
+        for (size_t g = 0; g < l->stride; g += LANE_GROUP) {              \
+            uint16_t d[LANE_GROUP];                                       \
+            memcpy(d, dst + g, sizeof(d));                                \
+            for (size_t k = 0; k < LANE_GROUP; k++)                       \
+                d[k] = (uint16_t) (expr);                                 \
+            memcpy(dst + g, d, sizeof(d));                                \
+        }                                                                 \
+    }
+
+LANE_OP2(add, d[k] + s[k])
+LANE_OP2(sub, d[k] - s[k])
+LANE_OP2(mov, s[k])
+LANE_OP2(neg, 0 - s[k])
+LANE_OP1(set, v)
+LANE_OP1(addc, d[k] + v)
+LANE_OP1(shl, d[k] << v)
+LANE_OP1(inv, ~d[k])
+
+/* Lane @k could not do its I/O: it stops on this instruction, failed for
+ * good unless the host merely had no input ready yet.
+ */
+static void lane_fail(lanes_t *l, size_t k, int status)
+{
+    if (status != VM_IO_AGAIN)
+        l->vms[k]->error = -1;
+    l->failed[k] = true;
+    l->nfailed++;
+}
+
+/* Read a character for every lane into @dst, negated if @negate */
+static void lanes_input(lanes_t *l, uint16_t *dst, bool negate)
+{
+    for (size_t k = 0; k < l->count; k++) {
+        int ch = vm_getch(l->vms[k]);
+        if (ch < 0)
+            lane_fail(l, k, ch);
+        else
+            dst[k] = (uint16_t) (negate ? -ch : ch);
+    }
+}
+
+static void lanes_output(lanes_t *l, const uint16_t *src)
+{
+    for (size_t k = 0; k < l->count; k++) {
+        if (vm_putch(l->vms[k], src[k]) < 0)
+            lane_fail(l, k, -1);
+    }
+}
+
+/* Indirect load for every lane, from the input if the pointer is -1 */
+static void lanes_load(lanes_t *l, uint16_t *dst, const uint16_t *ptr)
+{
+    uint16_t mask = l->vms[0]->mask;
+    for (size_t k = 0; k < l->count; k++) {
+        uint16_t addr = ptr[k];
+        if (addr == mask) {
+            int ch = vm_getch(l->vms[k]);
+            if (ch < 0)
+                lane_fail(l, k, ch);
+            else
+                dst[k] = (uint16_t) -ch;
+        } else {
+            dst[k] = lane_cell(l, addr)[k];
+        }
+    }
+}
+
+/* Only VMs in exactly the same state of the same code can run together */
+static bool lanes_compatible(vm_t *const *vms, size_t count)
+{
+    const vm_t *vm0 = vms[0];
+    for (size_t k = 0; k < count; k++) {
+        const vm_t *vm = vms[k];
+        if (!vm->code || vm->code != vm0->code || vm->pc != vm0->pc ||
+            vm->devices_enabled != vm0->devices_enabled || vm->error ||
+            vm->prof.enabled || vm->prof.sampling || vm->prof.mining ||
+            vm->perf.enabled || vm->trace.on || vm->pc >= vm->mem_size / 2)
+            return false;
+        for (unsigned p = 0; p < CODE_PAGES; p++) {
+            if (vm->code_dirty[p])
+                return false;
+        }
+    }
+    return true;
+}
+
+static int lanes_gather(lanes_t *l)
+{
+    size_t n = l->count;
+
+    l->stride = (n + LANE_GROUP - 1) / LANE_GROUP * LANE_GROUP;
+    l->cells = malloc(SZ * l->stride * sizeof(uint16_t));
+    l->pc = calloc(n, sizeof(*l->pc));
+    l->failed = calloc(n, sizeof(*l->failed));
+    if (!l->cells || !l->pc || !l->failed)
+        return -1;
+
+    /* Padding lanes mirror lane 0; their results are never looked at */
+    for (size_t a = 0; a < SZ; a++) {
+        uint16_t *cell = &l->cells[a * l->stride];
+        for (size_t k = 0; k < l->stride; k++)
+            cell[k] = l->vms[k < n ? k : 0]->mem[a];
+    }
+    return 0;
+}
+
+/* Hand the lanes back to their VMs. Only cells that changed are stored, so
+ * pages the lanes merely read stay shared with the VM's snapshot.
+ */
+static void lanes_scatter(lanes_t *l)
+{
+    for (size_t a = 0; a < SZ; a++) {
+        const uint16_t *cell = &l->cells[a * l->stride];
+        for (size_t k = 0; k < l->count; k++) {
+            uint16_t *mem = &l->vms[k]->mem[a];
+            if (*mem != cell[k])
+                *mem = cell[k];
+        }
+    }
+
+    for (size_t k = 0; k < l->count; k++) {
+        vm_t *vm = l->vms[k];
+        vm->pc = l->pc[k];
+        vm->insns += l->insns;
+        for (int i = 0; i < IMAX; i++)
+            vm->opt.exec_count[i] += l->counts[i];
+        if (l->max_addr > vm->max_addr)
+            vm->max_addr = l->max_addr;
+        if (output_flush(vm) < 0)
+            vm->error = -1;
+    }
+}
+
+/* Every lane continues at @pc */
+static void lanes_park(lanes_t *l, uint64_t pc)
+{
+    for (size_t k = 0; k < l->count; k++)
+        l->pc[k] = pc;
+}
+
+/* Run in lockstep until the lanes part ways, halt, need a device or spend
+ * @budget instructions (0 for no limit). Sets where every lane continues.
+ */
+static void lanes_execute(lanes_t *l, uint64_t budget)
+{
+    const vm_t *vm0 = l->vms[0];
+    const insn_t *code = vm0->insn;
+    const uint64_t end = vm0->mem_size / 2;
+    const uint16_t sign = (uint16_t) (1U << (vm0->nbits - 1));
+    uint64_t limit = budget ? budget : UINT64_MAX;
+    uint64_t pc = vm0->pc;
+
+    while (pc < end) {
+        const insn_t *insn = &code[pc];
+        uint8_t opcode = insn->opcode;
+        uint64_t next = pc + insn_incr[opcode];
+        bool taken = false;
+
+        switch (opcode) {
+        case SUBLEQ: {
+            uint16_t a = insn->src, b = insn->dst;
+            if (a == vm0->mask) {
+                lanes_input(l, lane_cell(l, b), false);
+                break;
+            }
+            if (b == vm0->mask) {
+                if (vm0->devices_enabled && MASK_ADDR(a) >= DEV_BASE) {
+                    lanes_park(l, pc);
+                    return;
+                }
+                lanes_output(l, lane_cell(l, a));
+                break;
             }
 
-            /* Insert new hot spot */
-            if (insert_pos < MAX_HOT_SPOTS) {
-                prof->hot_spots[insert_pos] = spot;
-                if (prof->hot_spot_count < MAX_HOT_SPOTS)
-                    prof->hot_spot_count++;
+            uint16_t *pb = lane_cell(l, b);
+            lanes_sub(l, pb, lane_cell(l, a));
+            if (MASK_ADDR(b) > l->max_addr)
+                l->max_addr = MASK_ADDR(b);
+
+            size_t le = 0;
+            for (size_t k = 0; k < l->count; k++)
+                le += pb[k] == 0 || (pb[k] & sign);
+            if (le == l->count) {
+                next = insn->aux;
+                taken = true;
+            } else if (le != 0) { /* The lanes part ways here */
+                l->counts[opcode]++;
+                l->insns++;
+                for (size_t k = 0; k < l->count; k++)
+                    l->pc[k] = pb[k] == 0 || (pb[k] & sign) ? insn->aux : next;
+                return;
+            }
+            break;
+        }
+        case JMP:
+            lanes_set(l, lane_cell(l, insn->src), 0);
+            next = insn->dst;
+            taken = true;
+            break;
+        case ADD:
+            lanes_add(l, lane_cell(l, insn->dst), lane_cell(l, insn->src));
+            break;
+        case SUB:
+            lanes_sub(l, lane_cell(l, insn->dst), lane_cell(l, insn->src));
+            break;
+        case MOV:
+            if (insn->src != insn->dst)
+                lanes_mov(l, lane_cell(l, insn->dst), lane_cell(l, insn->src));
+            break;
+        case ZERO:
+            lanes_set(l, lane_cell(l, insn->dst), 0);
+            break;
+        case PUT:
+            lanes_output(l, lane_cell(l, insn->src));
+            break;
+        case GET:
+            lanes_input(l, lane_cell(l, insn->dst), false);
+            break;
+        case HALT:
+            next = end;
+            break;
+        case IADD:
+        case ISUB: {
+            const uint16_t *ptr = lane_cell(l, insn->dst);
+            const uint16_t *src = lane_cell(l, insn->src);
+            for (size_t k = 0; k < l->count; k++) {
+                uint16_t *cell = &lane_cell(l, ptr[k])[k];
+                *cell = opcode == IADD ? *cell + src[k] : *cell - src[k];
+            }
+            break;
+        }
+        case IJMP: {
+            const uint16_t *target = lane_cell(l, insn->dst);
+            size_t same = 1;
+            while (same < l->count && target[same] == target[0])
+                same++;
+            l->counts[opcode]++;
+            l->insns++;
+            if (same < l->count) { /* The lanes part ways here */
+                for (size_t k = 0; k < l->count; k++)
+                    l->pc[k] = target[k];
+                return;
+            }
+            next = target[0];
+            taken = true;
+            if (l->insns >= limit) {
+                lanes_park(l, next);
+                return;
+            }
+            pc = next;
+            continue;
+        }
+        case ILOAD:
+            lanes_load(l, lane_cell(l, insn->dst), lane_cell(l, insn->src));
+            break;
+        case ISTORE: {
+            const uint16_t *ptr = lane_cell(l, insn->dst);
+            const uint16_t *src = lane_cell(l, insn->src);
+            for (size_t k = 0; k < l->count; k++)
+                lane_cell(l, ptr[k])[k] = src[k];
+            break;
+        }
+        case INC:
+            lanes_addc(l, lane_cell(l, insn->dst), 1);
+            break;
+        case DEC:
+            lanes_addc(l, lane_cell(l, insn->dst), 0xFFFF);
+            break;
+        case INV:
+            lanes_inv(l, lane_cell(l, insn->dst), 0);
+            break;
+        case NEG:
+            lanes_neg(l, lane_cell(l, insn->dst), lane_cell(l, insn->src));
+            break;
+        case LSHIFT:
+            lanes_shl(l, lane_cell(l, insn->dst), insn->src);
+            break;
+        case DOUBLE:
+            lanes_shl(l, lane_cell(l, insn->dst), 1);
+            break;
+        case LDINC: {
+            uint16_t *ptr = lane_cell(l, insn->src);
+            lanes_load(l, lane_cell(l, insn->dst), ptr);
+            for (size_t k = 0; k < l->count; k++) {
+                if (!l->failed[k])
+                    ptr[k]++;
+            }
+            break;
+        }
+        default: /* DEV and anything else needs a whole VM */
+            lanes_park(l, pc);
+            return;
+        }
+
+        if (UNLIKELY(l->nfailed)) {
+            /* Lanes whose I/O failed stay on this instruction, which only
+             * counts as executed if it stopped them with an error.
+             */
+            for (size_t k = 0; k < l->count; k++) {
+                l->pc[k] = l->failed[k] ? pc : next;
+                if (!l->failed[k] || l->vms[k]->error) {
+                    l->vms[k]->opt.exec_count[opcode]++;
+                    l->vms[k]->insns++;
+                }
             }
+            return;
+        }
+
+        l->counts[opcode]++;
+        l->insns++;
+        if (taken && l->insns >= limit) {
+            lanes_park(l, next);
+            return;
         }
+        pc = next;
     }
+    lanes_park(l, pc);
 }
 
-/* Report performance statistics */
-static int report_stats(vm_t *vm)
+int vm_run_lanes(vm_t *const *vms, size_t count, uint64_t budget, int *status)
 {
-    optimizer_t *opt = &vm->opt;
-    profiler_t *prof = &vm->prof;
-    double elapsed = (double) (opt->end - opt->start) / CLOCKS_PER_SEC;
-    int64_t total_ops = 0, total_substitutions = 0;
-    FILE *err = stderr;
+    lanes_t l = {.vms = vms, .count = count};
+    int ret = 0;
+
+    if (count > 1 && lanes_compatible(vms, count) && lanes_gather(&l) == 0) {
+        stamp_t phase = stamp_now();
+        clock_t start = clock();
+        for (size_t k = 0; k < count; k++) {
+            if (vms[k]->insns == 0)
+                vms[k]->opt.start = start;
+        }
+        lanes_execute(&l, budget);
+        lanes_scatter(&l);
+        for (size_t k = 0; k < count; k++) {
+            vms[k]->opt.end = clock();
+            phase_add(vms[k], PHASE_EXECUTE, phase);
+        }
+    } else {
+        ret = count > 1 ? -1 : 0;
+    }
 
-    for (int i = 0; i < IMAX; i++) {
-        total_ops += opt->exec_count[i];
-        if (i != SUBLEQ)
-            total_substitutions += opt->matches[i];
+    /* Whatever is left, each VM does alone */
+    for (size_t k = 0; k < count; k++) {
+        if (budget && l.insns >= budget && !vms[k]->error &&
+            vms[k]->pc < vms[k]->mem_size / 2)
+            status[k] = VM_YIELD;
+        else
+            status[k] = vm_run(vms[k], budget ? budget - l.insns : 0);
     }
 
-    const char *div = "+--------+---------------+--------------+----------+\n";
-    if (fputs(div, err) < 0)
-        return -1;
-    if (fprintf(err,
-                "| Instr. | Substitutions | Instr. count | Instr. %% |\n") < 0)
-        return -1;
-    if (fputs(div, err) < 0)
-        return -1;
+    free(l.cells);
+    free(l.pc);
+    free(l.failed);
+    return ret;
+}
 
-    if (fprintf(err, "| SUBLEQ | %13d | %12" PRId64 " | %7.1f%% |\n",
-                opt->matches[SUBLEQ], opt->exec_count[SUBLEQ],
-                total_ops ? 100.0 * opt->exec_count[SUBLEQ] / total_ops : 0.0) <
-        0)
-        return -1;
+#ifdef PLAT_POSIX
+/* A machine of CPUs sharing the memory of one VM. Each CPU is a VM context
+ * of its own, with its own pc, counters and I/O buffers, whose memory is
+ * the host's.
+ */
+struct smp {
+    vm_t *host;           /* VM whose memory the CPUs share */
+    vm_t *cpu[SMP_MAX_CPUS]; /* CPU 0 runs on the calling thread */
+    pthread_t thread[SMP_MAX_CPUS];
+    bool started[SMP_MAX_CPUS]; /* CPU was given an entry point */
+    unsigned count;       /* Number of CPUs */
+    bool stop;            /* CPU 0 finished; the others must stop */
+    pthread_mutex_t lock; /* Guards @started, @stop and host output */
+    pthread_cond_t wake;  /* Signalled on start and on stop */
+};
 
-    for (int i = 1; i < IMAX; i++) {
-        if (opt->matches[i] == 0 && opt->exec_count[i] == 0)
-            continue;
-        if (fprintf(err, "| %-6s | %13d | %12" PRId64 " | %7.1f%% |\n",
-                    insn_names[i], opt->matches[i], opt->exec_count[i],
-                    total_ops ? 100.0 * opt->exec_count[i] / total_ops : 0.0) <
-            0)
-            return -1;
+/* Only CPU 0 reads input, straight from the host. The CPUs cannot be
+ * suspended together, so a read that would wait stops the machine.
+ */
+static long smp_read(void *ctx, void *buf, size_t len)
+{
+    struct smp *smp = ctx;
+    long n = smp->host->io.read(smp->host->io.ctx, buf, len);
+    if (n == VM_IO_AGAIN) {
+        fprintf(stderr, "Error: SMP mode needs blocking input\n");
+        smp->cpu[0]->error = -1;
+        return -1;
     }
+    return n;
+}
 
-    if (fputs(div, err) < 0)
-        return -1;
-    if (fprintf(err, "| Totals | %13" PRId64 " | %12" PRId64 " |          |\n",
-                total_substitutions, total_ops) < 0)
-        return -1;
-    if (fputs(div, err) < 0)
-        return -1;
-    if (fprintf(err, "|         Execution time %.3f seconds             |\n",
-                elapsed) < 0)
-        return -1;
-    if (fputs(div, err) < 0)
+/* The secondary CPUs see end of input */
+static long smp_no_input(void *ctx, void *buf, size_t len)
+{
+    (void) ctx;
+    (void) buf;
+    (void) len;
+    return 0;
+}
+
+/* Every CPU writes through the host, one buffer flush at a time */
+static int smp_write(void *ctx, const void *buf, size_t len)
+{
+    struct smp *smp = ctx;
+    pthread_mutex_lock(&smp->lock);
+    int r = smp->host->io.write(smp->host->io.ctx, buf, len);
+    pthread_mutex_unlock(&smp->lock);
+    return r;
+}
+
+static int smp_start(vm_t *vm, uint16_t num, uint16_t pc)
+{
+    struct smp *smp = vm->smp;
+    int status = -1;
+
+    if (!smp || num == 0 || num >= smp->count)
         return -1;
 
-    /* Profiler report */
-    if (vm->profiler_enabled && prof->enabled) {
-        prof->end_time = clock();
-        double prof_elapsed =
-            (double) (prof->end_time - prof->start_time) / CLOCKS_PER_SEC;
+    pthread_mutex_lock(&smp->lock);
+    if (!smp->started[num]) {
+        smp->cpu[num]->pc = pc;
+        smp->started[num] = true;
+        pthread_cond_broadcast(&smp->wake);
+        status = 0;
+    }
+    pthread_mutex_unlock(&smp->lock);
+    return status;
+}
 
-        fprintf(err, "\n=== Lightweight Profiler Report ===\n");
-        fprintf(err, "Total instructions executed: %" PRIu64 "\n",
-                prof->total_instructions);
-        fprintf(err, "Memory accesses: %" PRIu64 "\n", prof->memory_accesses);
-        fprintf(err, "Instructions per second: %.0f\n",
-                prof_elapsed > 0 ? prof->total_instructions / prof_elapsed : 0);
+/* Run @cpu in slices until it stops or the machine is shut down */
+static int smp_cpu_run(vm_t *cpu)
+{
+    int status;
+    while ((status = vm_run(cpu, SMP_SLICE)) == VM_YIELD &&
+           !__atomic_load_n(&cpu->smp->stop, __ATOMIC_ACQUIRE))
+        ;
+    return status;
+}
 
-        if (prof->total_instructions > 0) {
-            fprintf(err, "Memory accesses per instruction: %.2f\n",
-                    (double) prof->memory_accesses / prof->total_instructions);
-        }
+/* Thread of a secondary CPU: wait for an entry point, then run */
+static void *smp_cpu_main(void *arg)
+{
+    vm_t *cpu = arg;
+    struct smp *smp = cpu->smp;
+
+    pthread_mutex_lock(&smp->lock);
+    while (!smp->started[cpu->cpu_id] && !smp->stop)
+        pthread_cond_wait(&smp->wake, &smp->lock);
+    bool run = !smp->stop;
+    pthread_mutex_unlock(&smp->lock);
+
+    if (run && smp_cpu_run(cpu) == VM_ERROR)
+        fprintf(stderr, "Error: CPU %u failed\n", cpu->cpu_id);
+    return NULL;
+}
 
-        /* Hot spots analysis */
-        profiler_analyze_hot_spots(vm);
-        if (prof->hot_spot_count > 0) {
-            fprintf(err, "\nTop %zu Hot Spots:\n",
-                    prof->hot_spot_count > 10 ? 10 : prof->hot_spot_count);
-            fprintf(err, "    PC   | Exec Count |   %%   | Opcode\n");
-            fprintf(err, "---------|------------|-------|-------\n");
-
-            for (size_t i = 0; i < prof->hot_spot_count && i < 10; i++) {
-                hot_spot_t *spot = &prof->hot_spots[i];
-                double percent =
-                    prof->total_instructions > 0
-                        ? 100.0 * spot->exec_count / prof->total_instructions
-                        : 0;
-
-                fprintf(err, " %6" PRIu64 "  | %10" PRIu64 " | %5.1f | %-6s\n",
-                        spot->pc, spot->exec_count, percent,
-                        spot->opcode < IMAX ? insn_names[spot->opcode] : "???");
-            }
-        }
+/* Copy of the host's decoding for the CPUs to share. Every entry decoded
+ * from a single SUBLEQ, such as INC or JMP, becomes ATOMIC so that it
+ * subtracts atomically. So does any fused entry built from a word naming
+ * DEV_CPU_ID, since only ATOMIC reads that cell per CPU.
+ */
+static code_t *smp_decode(const vm_t *host)
+{
+    code_t *code = code_alloc();
+    if (!code)
+        return NULL;
+    memcpy(code->insn, host->insn, SZ * sizeof(insn_t));
+
+    for (uint64_t i = 0; i < host->mem_size / 2; i++) {
+        insn_t *insn = &code->insn[i];
+        bool plain = insn_span(insn) == SUBLEQ_INSN_SIZE;
+        for (unsigned w = 0; !plain && w < insn_span(insn); w++)
+            plain = host->mem[MASK_ADDR(i + w)] == DEV_CPU_ID;
+        if (!plain)
+            continue;
 
-        /* Export profiler data to file */
-        FILE *prof_file = fopen("profiler_report.txt", "w");
-        if (prof_file) {
-            fprintf(prof_file, "SUBLEQ VM Lightweight Profiler Report\n");
-            fprintf(prof_file, "=====================================\n");
-            fprintf(prof_file, "Execution time: %.3f seconds\n", prof_elapsed);
-            fprintf(prof_file, "Total instructions: %" PRIu64 "\n",
-                    prof->total_instructions);
-            fprintf(prof_file, "Memory accesses: %" PRIu64 "\n",
-                    prof->memory_accesses);
-            fprintf(
-                prof_file, "Instructions per second: %.0f\n",
-                prof_elapsed > 0 ? prof->total_instructions / prof_elapsed : 0);
+        insn->opcode = ATOMIC;
+        insn->src = host->mem[MASK_ADDR(i)];
+        insn->dst = host->mem[MASK_ADDR(i + 1)];
+        insn->aux = host->mem[MASK_ADDR(i + 2)];
+    }
+    return code;
+}
 
-            fprintf(prof_file, "\nInstruction Mix:\n");
-            for (int i = 0; i < IMAX; i++) {
-                if (opt->exec_count[i] > 0) {
-                    fprintf(prof_file, "  %-8s: %12" PRId64 " (%6.2f%%)\n",
-                            insn_names[i], opt->exec_count[i],
-                            total_ops > 0
-                                ? 100.0 * opt->exec_count[i] / total_ops
-                                : 0);
-                }
-            }
+/* Create CPU @id of @smp, running @code on the host's memory */
+static vm_t *smp_cpu_create(struct smp *smp, code_t *code, unsigned id)
+{
+    vm_t *host = smp->host;
+    vm_io_t io = {
+        .read = id == 0 ? smp_read : smp_no_input,
+        .write = smp_write,
+        .ctx = smp,
+        .unbuffered = host->io.unbuffered,
+    };
+    vm_config_t cfg = {
+        .optimize = host->optimize_enabled,
+        .stats = host->stats_enabled,
+        .devices = true, /* Needed to start the other CPUs */
+        .io = &io,
+    };
 
-            if (prof->hot_spot_count > 0) {
-                fprintf(prof_file,
-                        "\nHot Spots (PC addresses with highest execution "
-                        "counts):\n");
-                for (size_t i = 0; i < prof->hot_spot_count; i++) {
-                    hot_spot_t *spot = &prof->hot_spots[i];
-                    double percent = prof->total_instructions > 0
-                                         ? 100.0 * spot->exec_count /
-                                               prof->total_instructions
-                                         : 0;
+    vm_t *cpu = vm_create(&cfg);
+    if (!cpu)
+        return NULL;
+
+    cpu->mem = host->mem;
+    cpu->smp = smp;
+    cpu->cpu_id = id;
+    cpu->load_size = host->load_size;
+    cpu->max_addr = host->max_addr;
+    if (code_attach(cpu, code) < 0 ||
+        (id == 0 && host->blk.fd >= 0 && blk_share(cpu, host) < 0)) {
+        vm_destroy(cpu);
+        return NULL;
+    }
+    if (id == 0) { /* CPU 0 carries on from the host */
+        cpu->pc = host->pc;
+        cpu->input = host->input;
+        cpu->line_done = host->line_done;
+    }
+    return cpu;
+}
 
-                    fprintf(prof_file,
-                            "  PC %6" PRIu64 ": %10" PRIu64
-                            " executions (%5.1f%%) [%s]\n",
-                            spot->pc, spot->exec_count, percent,
-                            spot->opcode < IMAX ? insn_names[spot->opcode]
-                                                : "unknown");
-                }
-            }
+int vm_run_smp(vm_t *vm, unsigned cpus)
+{
+    if (!vm->code || vm->error)
+        return VM_ERROR;
+    if (cpus == 0 || cpus > SMP_MAX_CPUS) {
+        fprintf(stderr, "Error: SMP mode supports 1 to %d CPUs\n",
+                SMP_MAX_CPUS);
+        return VM_ERROR;
+    }
+    if (output_flush(vm) < 0)
+        return VM_ERROR;
+
+    struct smp *smp = calloc(1, sizeof(*smp));
+    code_t *code = smp_decode(vm);
+    if (!smp || !code) {
+        fprintf(stderr, "Error: Failed to allocate SMP state\n");
+        free(smp);
+        if (code)
+            code_free(code);
+        return VM_ERROR;
+    }
+    smp->host = vm;
+    pthread_mutex_init(&smp->lock, NULL);
+    pthread_cond_init(&smp->wake, NULL);
+
+    int status = VM_ERROR;
+    unsigned threads = 1;
+    for (; smp->count < cpus; smp->count++) {
+        smp->cpu[smp->count] = smp_cpu_create(smp, code, smp->count);
+        if (!smp->cpu[smp->count]) {
+            fprintf(stderr, "Error: Failed to create CPU %u\n", smp->count);
+            goto out;
+        }
+    }
+    vm->mem[DEV_CPU_COUNT] = (uint16_t) cpus;
 
-            fclose(prof_file);
-            fprintf(
-                err,
-                "\nDetailed profiler report saved to: profiler_report.txt\n");
+    for (; threads < cpus; threads++) {
+        if (pthread_create(&smp->thread[threads], NULL, smp_cpu_main,
+                           smp->cpu[threads]) != 0) {
+            fprintf(stderr, "Error: Failed to start CPU %u\n", threads);
+            goto out;
         }
     }
 
-    return 0;
-}
+    stamp_t phase = stamp_now();
+    clock_t start = clock();
+    if (vm->insns == 0)
+        vm->opt.start = start;
+    else
+        vm->opt.start += start - vm->opt.end;
+    status = smp_cpu_run(smp->cpu[0]);
+    vm->opt.end = clock();
+    phase_add(vm, PHASE_EXECUTE, phase);
+
+out:
+    pthread_mutex_lock(&smp->lock);
+    __atomic_store_n(&smp->stop, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&smp->wake);
+    pthread_mutex_unlock(&smp->lock);
+    for (unsigned k = 1; k < threads; k++)
+        pthread_join(smp->thread[k], NULL);
+
+    /* Fold the CPUs back into the host */
+    for (unsigned k = 0; k < smp->count; k++) {
+        vm_t *cpu = smp->cpu[k];
+        vm->insns += cpu->insns;
+        for (int i = 0; i < IMAX; i++)
+            vm->opt.exec_count[i] += cpu->opt.exec_count[i];
+        if (cpu->max_addr > vm->max_addr)
+            vm->max_addr = cpu->max_addr;
+        if (cpu->error)
+            status = VM_ERROR;
+        if (k == 0) {
+            vm->pc = cpu->pc;
+            vm->input = cpu->input;
+            vm->line_done = cpu->line_done;
+        }
+        vm_destroy(cpu);
+    }
+    if (status == VM_ERROR)
+        vm->error = -1;
 
-/* Execute the virtual machine */
-static int execute_vm(vm_t *vm)
+    if (__atomic_sub_fetch(&code->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        code_free(code);
+    pthread_cond_destroy(&smp->wake);
+    pthread_mutex_destroy(&smp->lock);
+    free(smp);
+    return status;
+}
+#else
+static int smp_start(vm_t *vm, uint16_t num, uint16_t pc)
 {
-    vm->opt.start = clock();
-    /* Initial call to dispatch, passing NULL for the unused insn pointer. */
-    dispatch(vm, vm->pc, NULL);
-    vm->opt.end = clock();
-    return vm->error;
+    (void) vm;
+    (void) num;
+    (void) pc;
+    return -1;
 }
 
-typedef void (*handler_func_t)(vm_t *vm, uint64_t pc, const insn_t *insn);
-/* The dispatch table, mapping opcodes to their handler functions */
-static handler_func_t const dispatch_table[IMAX] = {
-#define _(inst, inc) [inst] = handle_##inst,
-    INSN_LIST
-#undef _
-};
+int vm_run_smp(vm_t *vm, unsigned cpus)
+{
+    (void) vm;
+    (void) cpus;
+    fprintf(stderr, "Error: SMP mode is not supported on this platform\n");
+    return VM_ERROR;
+}
+#endif
 
-/* Dispatch to instruction handlers. */
-HOT_PATH static void dispatch(vm_t *vm, uint64_t pc, const insn_t *unused_insn)
+vm_t *vm_create(const vm_config_t *cfg)
 {
-    (void) unused_insn;
+    stamp_t start = stamp_now();
+    vm_t *vm = pool_get(&vm_pool);
+    if (!vm) {
+        fprintf(stderr, "Error: Failed to allocate VM.\n");
+        return NULL;
+    }
 
-    if (UNLIKELY(pc >= vm->mem_size / 2 || vm->error))
-        return;
+    vm->nbits = 16;
+    vm->mask = MASK_BITS(vm->nbits);
+    vm->mem_size = SZ;
+    vm->stats_enabled = cfg->stats;
+    vm->optimize_enabled = cfg->optimize;
+    vm->opt.threads = cfg->opt_threads;
+    vm->profiler_enabled = cfg->profiler;
+    vm->sampler_enabled = cfg->sampler;
+    vm->prof.mine.top = cfg->mine;
+    vm->live_enabled = cfg->live;
+    vm->perf.enabled = cfg->perf;
+    vm->devices_enabled = cfg->devices || cfg->block_file;
+    vm->blk.fd = -1;
+    vm->snap.fd = -1;
+
+    if (cfg->io) {
+        vm->io = *cfg->io;
+    } else {
+        vm->io.read = stdio_read;
+        vm->io.write = stdio_write;
+        vm->io.unbuffered = stdio_is_tty();
+    }
 
-    /* Read the instruction once, and pass a pointer to the handler. */
-    const insn_t *insn = &vm->insn_mem[pc];
-    uint8_t opcode = insn->opcode;
-    vm->opt.exec_count[opcode]++;
+    vm->mem = (uint16_t *) ((uint8_t *) vm + VM_MEM_OFFSET);
 
-    /* Use the dispatch table for a direct function call. The handler
-     * will then tail-call back to this dispatch function, continuing the
-     * execution cycle without growing the stack.
-     */
-    MUST_TAIL return dispatch_table[opcode](vm, pc, insn);
+    if (cfg->block_file && blk_open(vm, cfg->block_file) < 0) {
+        fprintf(stderr, "Error: Failed to open block file '%s'\n",
+                cfg->block_file);
+        vm_destroy(vm);
+        return NULL;
+    }
+    if (cfg->trace_file && trace_open(vm, cfg->trace_file) < 0) {
+        fprintf(stderr, "Error: Failed to open trace file '%s'\n",
+                cfg->trace_file);
+        vm_destroy(vm);
+        return NULL;
+    }
+
+    phase_add(vm, PHASE_CREATE, start);
+
+    /* Initialize profiler */
+    start = stamp_now();
+    profiler_init(vm);
+    phase_add(vm, PHASE_PROFILER, start);
+    return vm;
 }
 
-int main(int argc, char **argv)
-{
-    vm_t vm = {
-        .in = stdin,
-        .out = stdout,
-        .nbits = 16,
-        .mem_size = SZ,
-        .pc = 0,
-        .load_size = 0,
-        .max_addr = 0,
-        .error = 0,
-        .stats_enabled = false,
-        .optimize_enabled = true,
-        .profiler_enabled = false,
+vm_t *vm_clone(const vm_t *src, const vm_io_t *io)
+{
+    vm_config_t cfg = {
+        .optimize = src->optimize_enabled,
+        .opt_threads = src->opt.threads,
+        .stats = src->stats_enabled,
+        .profiler = src->profiler_enabled,
+        .sampler = src->sampler_enabled,
+        .perf = src->perf.enabled,
+        .mine = src->prof.mine.top,
+        .live = src->live_enabled,
+        .devices = src->devices_enabled,
+        .block_file = NULL,
+        .trace_file = NULL,
+        .io = io,
     };
-    vm.mask = MASK_BITS(vm.nbits);
-
-    vm.mem = calloc(SZ, sizeof(uint16_t));
-    if (!vm.mem) {
-        fprintf(stderr, "Error: Failed to allocate main memory.\n");
-        return 1;
-    }
 
-    vm.insn_mem = calloc(SZ, sizeof(insn_t));
-    if (!vm.insn_mem) {
-        fprintf(stderr, "Error: Failed to allocate instruction memory.\n");
-        free(vm.mem);
-        return 1;
-    }
-
-    const char *image_file = NULL;
-    for (int i = 1; i < argc; ++i) {
-        if (!strcmp(argv[i], "-O")) /* Disable optimization */
-            vm.optimize_enabled = false;
-        else if (!strcmp(argv[i], "-s")) /* Enable statistics */
-            vm.stats_enabled = true;
-        else if (!strcmp(argv[i], "-p")) /* Enable lightweight profiler */
-            vm.profiler_enabled = true;
-        else if (!image_file) /* Image file path */
-            image_file = argv[i];
-        else
-            fprintf(stderr, "Warning: Ignoring extra argument '%s'\n", argv[i]);
+    vm_t *vm = vm_create(&cfg);
+    if (!vm)
+        return NULL;
+
+    memcpy(vm->mem, src->mem, SZ * sizeof(uint16_t));
+    if (src->code) {
+        /* Share the decoded code; only pages @src changed are copied */
+        if (code_attach(vm, src->code) < 0) {
+            fprintf(stderr, "Error: Failed to map instruction memory.\n");
+            vm_destroy(vm);
+            return NULL;
+        }
+        for (unsigned p = 0; p < CODE_PAGES; p++) {
+            if (!src->code_dirty[p])
+                continue;
+            memcpy(&vm->insn[p << CODE_PAGE_BITS],
+                   &src->insn[p << CODE_PAGE_BITS],
+                   CODE_PAGE_SIZE * sizeof(insn_t));
+            vm->code_dirty[p] = true;
+        }
     }
-
-    if (!image_file) {
-        fprintf(stderr, "Usage: %s <subleq.dec> [-O] [-s] [-p]\n", argv[0]);
-        fprintf(stderr, "  -O    Disable optimization\n");
-        fprintf(stderr, "  -s    Enable statistics\n");
-        fprintf(stderr, "  -p    Enable lightweight profiler\n");
-        free(vm.mem);
-        free(vm.insn_mem);
-        return 1;
+    memcpy(vm->opt.matches, src->opt.matches, sizeof(vm->opt.matches));
+    vm->phase[PHASE_PARSE] = src->phase[PHASE_PARSE];
+    vm->phase[PHASE_OPTIMIZE] = src->phase[PHASE_OPTIMIZE];
+    vm->pc = src->pc;
+    vm->load_size = src->load_size;
+    vm->max_addr = src->max_addr;
+
+    if (src->blk.fd >= 0 && blk_share(vm, src) < 0) {
+        fprintf(stderr, "Error: Failed to share block file\n");
+        vm_destroy(vm);
+        return NULL;
     }
+    return vm;
+}
 
-    FILE *file = fopen(image_file, "r");
+static int load_image(vm_t *vm, const char *path)
+{
+    FILE *file = fopen(path, "r");
     if (!file) {
-        fprintf(stderr, "Error: Failed to open file '%s'\n", image_file);
-        free(vm.mem);
-        free(vm.insn_mem);
-        return 1;
+        fprintf(stderr, "Error: Failed to open file '%s'\n", path);
+        return -1;
     }
 
     long val;
@@ -1447,13 +5620,11 @@ int main(int argc, char **argv)
                     " exceeds 16-bit signed limit\n",
                     val, count);
             fclose(file);
-            free(vm.mem);
-            free(vm.insn_mem);
-            return 1;
+            return -1;
         }
 
-        vm.mem[MASK_ADDR(vm.load_size)] = (uint16_t) val;
-        vm.load_size++;
+        vm->mem[MASK_ADDR(vm->load_size)] = (uint16_t) val;
+        vm->load_size++;
         count++;
 
         /* Check for separator */
@@ -1466,44 +5637,153 @@ int main(int argc, char **argv)
     }
 
     if (ferror(file) && !feof(file)) {
-        fprintf(stderr, "Error: Failed to read '%s'\n", image_file);
+        fprintf(stderr, "Error: Failed to read '%s'\n", path);
         fclose(file);
-        free(vm.mem);
-        free(vm.insn_mem);
-        return 1;
+        return -1;
     }
     if (fclose(file) < 0) {
-        fprintf(stderr, "Error: Failed to close file '%s'\n", image_file);
-        free(vm.mem);
-        free(vm.insn_mem);
-        return 2;
+        fprintf(stderr, "Error: Failed to close file '%s'\n", path);
+        return -2;
     }
-    vm.max_addr = vm.load_size; /* Max address initialized to loaded size */
+    vm->max_addr = vm->load_size; /* Max address initialized to loaded size */
+    return 0;
+}
 
-    /* Initialize profiler */
-    profiler_init(&vm);
+int vm_load_image(vm_t *vm, const char *path)
+{
+    stamp_t start = stamp_now();
+    int status = load_image(vm, path);
+    phase_add(vm, PHASE_PARSE, start);
+    return status;
+}
+
+int vm_load_cells(vm_t *vm, const uint16_t *cells, size_t count)
+{
+    if (count > vm->mem_size)
+        return -1;
+
+    stamp_t start = stamp_now();
+    memcpy(vm->mem, cells, count * sizeof(uint16_t));
+    vm->load_size = count;
+    vm->max_addr = vm->load_size;
+    phase_add(vm, PHASE_PARSE, start);
+    return 0;
+}
+
+int vm_optimize(vm_t *vm)
+{
+    stamp_t start = stamp_now();
+    code_t *code = code_alloc();
+    if (!code) {
+        fprintf(stderr, "Error: Failed to allocate instruction memory.\n");
+        return -1;
+    }
 
-    if (vm.optimize_enabled) {
-        optimize(&vm, vm.load_size);
+    /* Decode into fresh code; clones of the old decoding keep theirs */
+    if (vm->optimize_enabled) {
+        optimize(vm, code->insn, vm->load_size);
     } else {
-        fprintf(stderr,
-                "Optimizations disabled. Running as basic interpreter.\n");
-        for (uint64_t i = 0; i < vm.load_size; i++) {
-            vm.insn_mem[MASK_ADDR(i)].opcode = SUBLEQ;
-            vm.insn_mem[MASK_ADDR(i)].src = vm.mem[MASK_ADDR(i)];
-            vm.insn_mem[MASK_ADDR(i)].dst = vm.mem[MASK_ADDR(i + 1)];
-            vm.insn_mem[MASK_ADDR(i)].aux = vm.mem[MASK_ADDR(i + 2)];
+        for (uint64_t i = 0; i < vm->load_size; i++) {
+            code->insn[MASK_ADDR(i)].opcode = SUBLEQ;
+            code->insn[MASK_ADDR(i)].src = vm->mem[MASK_ADDR(i)];
+            code->insn[MASK_ADDR(i)].dst = vm->mem[MASK_ADDR(i + 1)];
+            code->insn[MASK_ADDR(i)].aux = vm->mem[MASK_ADDR(i + 2)];
         }
     }
 
-    int status = execute_vm(&vm);
-    if (vm.stats_enabled && report_stats(&vm) < 0)
-        status = -1; /* Indicate error if stats reporting fails */
+    code_detach(vm);
+    int status = code_attach(vm, code);
+    if (__atomic_sub_fetch(&code->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        code_free(code); /* Only the allocation referenced it */
+    if (status < 0) {
+        fprintf(stderr, "Error: Failed to map instruction memory.\n");
+        return -1;
+    }
+    phase_add(vm, PHASE_OPTIMIZE, start);
+    return 0;
+}
 
-    /* Cleanup profiler */
-    profiler_cleanup(&vm);
+int vm_snapshot(vm_t *vm)
+{
+    if (code_rebase(vm) < 0 || mem_snapshot(vm) < 0) {
+        fprintf(stderr, "Error: Failed to take snapshot\n");
+        return -1;
+    }
+    vm->snap.taken = true;
+    vm->snap.pc = vm->pc;
+    vm->snap.load_size = vm->load_size;
+    vm->snap.max_addr = vm->max_addr;
+    return 0;
+}
 
-    free(vm.mem);
-    free(vm.insn_mem);
-    return status;
+int vm_reset(vm_t *vm)
+{
+    if (!vm->snap.taken)
+        return -1;
+    if (mem_restore(vm) < 0 || (vm->code && code_restore(vm) < 0)) {
+        fprintf(stderr, "Error: Failed to restore snapshot\n");
+        vm->error = -1;
+        return -1;
+    }
+
+    vm->pc = vm->snap.pc;
+    vm->load_size = vm->snap.load_size;
+    vm->max_addr = vm->snap.max_addr;
+    vm->insns = 0;
+    memset(vm->opt.exec_count, 0, sizeof(vm->opt.exec_count));
+    vm->opt.start = vm->opt.end = 0;
+    vm->phase[PHASE_EXECUTE] = (stamp_t){0, 0};
+    vm->live_insns = 0;
+    vm->live_wall = 0;
+    vm->trace.next_mem = 0; /* Checkpoint the restored memory */
+    vm->input.head = vm->input.tail = 0;
+    vm->line_done = 0;
+    vm->need_input = false;
+    vm->output.len = 0;
+    vm->error = 0;
+
+    profiler_t *prof = &vm->prof;
+    prof->total_instructions = 0;
+    profiler_sum_accesses(prof);
+    prof->memory_accesses = 0;
+    for (int i = 0; prof->op_heat && i < IMAX; i++) {
+        if (prof->op_accesses[i]) /* Leave untouched rows unbacked */
+            memset(prof->op_heat + OP_HEAT_ROW(i, 0), 0,
+                   2 * SZ * sizeof(*prof->op_heat));
+    }
+    memset(prof->op_accesses, 0, sizeof(prof->op_accesses));
+    prof->hot_spot_count = 0;
+    prof->samples = 0;
+    prof->start_time = clock();
+    if (prof->pc_heat_map)
+        memset(prof->pc_heat_map, 0, vm->mem_size * sizeof(uint64_t));
+    memset(vm->perf.count, 0, sizeof(vm->perf.count));
+    if (prof->mine.seqs)
+        memset(prof->mine.seqs, 0, MINE_SLOTS * sizeof(*prof->mine.seqs));
+    prof->mine.len = 0;
+    prof->mine.dropped = 0;
+    vm->perf.lost = 0;
+    prof->forth.nstacks = prof->forth.ncells = 0;
+    prof->forth.dropped = 0;
+    prof->forth.countdown = WORDS_STRIDE;
+    if (prof->forth.index)
+        memset(prof->forth.index, 0,
+               prof->forth.index_cap * sizeof(*prof->forth.index));
+    return 0;
+}
+
+void vm_destroy(vm_t *vm)
+{
+    if (!vm)
+        return;
+
+    /* Cleanup profiler */
+    profiler_cleanup(vm);
+    perf_close(vm);
+    blk_close(vm);
+    trace_close(vm);
+
+    code_detach(vm);
+    mem_release(vm);
+    pool_put(&vm_pool, vm);
 }
@@ -0,0 +1,239 @@
+/*
+ * subleq.h - Embeddable 16-bit SUBLEQ virtual machine (libsubleq).
+ *
+ * Each vm_t is an independent interpreter: it owns its memory, statistics
+ * and I/O callbacks. Decoded instructions are shared read-only between
+ * clones. A host may create as many VMs as it likes and drive each from
+ * whichever thread it chooses, as long as a single VM is only used by one
+ * thread at a time. The signals behind the sampling profiler, hardware
+ * counters and live dumps are process-wide, so only one running VM at a
+ * time gets each of them; the others run without it and warn once.
+ *
+ * Typical use:
+ *
+ *     vm_t *vm = vm_create(&cfg);
+ *     vm_load_image(vm, "stage0.dec");
+ *     vm_optimize(vm);
+ *     int status = vm_run(vm, 0);    (or a budget per slice)
+ *     vm_destroy(vm);
+ */
+
+#ifndef SUBLEQ_H
+#define SUBLEQ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Opaque virtual machine instance */
+typedef struct vm vm_t;
+
+/* Host I/O callbacks. The VM buffers both directions itself, so @read is
+ * asked for as much as fits in its input ring and @write receives whole runs
+ * of output.
+ */
+typedef struct {
+    /* Read up to @len bytes into @buf. Return the number of bytes read, 0 at
+     * end of input, or -1 on error. May block until input is available, or
+     * return VM_IO_AGAIN instead to suspend the VM until the host has some.
+     */
+    long (*read)(void *ctx, void *buf, size_t len);
+
+    /* Write all @len bytes of @buf. Return 0 on success or -1 on error. */
+    int (*write)(void *ctx, const void *buf, size_t len);
+
+    void *ctx;       /* Passed to every callback */
+    bool unbuffered; /* Hand output to @write as soon as it is produced */
+} vm_io_t;
+
+/* Instance configuration for vm_create() */
+typedef struct {
+    bool optimize;          /* Fuse instruction sequences (else plain SUBLEQ) */
+    unsigned opt_threads;   /* Threads for vm_optimize(), 0 or 1 for serial */
+    bool stats;             /* Collect data for vm_report_stats() */
+    bool profiler;          /* Enable lightweight profiler */
+    bool sampler;           /* Sample the pc on a timer instead of counting */
+    bool perf;              /* Sample hardware counters per opcode */
+    unsigned mine;          /* Report this many hottest unfused runs */
+    bool live;              /* Dump counters to stderr on SIGUSR1 */
+    bool devices;           /* Enable memory-mapped devices */
+    const char *block_file; /* Block device backing file (implies devices) */
+    const char *trace_file; /* Record the taken branches of vm_run() here */
+    const vm_io_t *io;      /* I/O callbacks, NULL for stdin/stdout */
+} vm_config_t;
+
+/* vm_io_t.read result: no input is ready yet */
+#define VM_IO_AGAIN (-2)
+
+/* vm_run() results */
+#define VM_HALTED 0     /* Program halted */
+#define VM_YIELD 1      /* Instruction budget spent; call vm_run() to resume */
+#define VM_NEED_INPUT 2 /* Read returned VM_IO_AGAIN; resume once ready */
+#define VM_ERROR (-1)   /* I/O error, end of input or invalid request */
+
+/* Create a VM with zeroed memory. Returns NULL on allocation failure or if
+ * the block file cannot be opened; a message is printed to stderr.
+ */
+vm_t *vm_create(const vm_config_t *cfg);
+
+/* Create a VM that starts from a copy of @src's memory and configuration,
+ * with @io as its I/O callbacks (NULL for stdin/stdout). The decoded
+ * instructions are not copied but shared with @src; a VM takes a private
+ * copy of a 512-entry page only when a device writes code in it. Cloning a
+ * loaded and decoded template is much cheaper than loading and optimizing
+ * the image again. @src is only read, so several threads may clone the same
+ * template concurrently. Returns NULL on failure.
+ */
+vm_t *vm_clone(const vm_t *src, const vm_io_t *io);
+
+/* Load a decimal image (comma or whitespace separated cells) from @path.
+ * Returns 0 on success, -1 on failure to open, read or parse it, or -2 if
+ * the file could not be closed.
+ */
+int vm_load_image(vm_t *vm, const char *path);
+
+/* Load @count cells from @cells at address 0. Returns 0, or -1 if the image
+ * does not fit in memory.
+ */
+int vm_load_cells(vm_t *vm, const uint16_t *cells, size_t count);
+
+/* Decode the loaded image for execution, fusing common instruction
+ * sequences unless optimization was disabled. Large images are split over
+ * the configured optimizer threads; the result does not depend on their
+ * number. Must be called after loading and before vm_run(). VMs cloned
+ * earlier keep the previous decoding. Returns 0, or -1 on allocation
+ * failure.
+ */
+int vm_optimize(vm_t *vm);
+
+/* Run the program until it halts or fails, or, if @budget is not 0, until
+ * about @budget instructions have executed. The budget is only checked at
+ * taken branches, so a slice may overrun it by a few instructions. On
+ * VM_YIELD the VM stops at a branch target and the next vm_run() carries on
+ * from there, which lets a host time-slice many VMs on a few threads.
+ *
+ * If the read callback returns VM_IO_AGAIN, the VM stops on the instruction
+ * that wanted input and returns VM_NEED_INPUT. Calling vm_run() again
+ * retries that instruction, so a host can wait for input with poll() or
+ * epoll() and serve many interactive VMs from one thread.
+ *
+ * With vm_config_t.live on POSIX systems, SIGUSR1 makes the running VM
+ * print its instruction count and rates, overall and since the last dump,
+ * its opcode mix and, with a profiler, its hot spots to stderr, then carry
+ * on. The dump happens at the next taken branch, or at once if the VM is
+ * blocked reading standard input. The handler is installed for the run
+ * only, and the previous one is restored when vm_run() returns. While it
+ * is installed it restarts no interrupted system call. One VM per process
+ * dumps at a time.
+ *
+ * Returns VM_HALTED, VM_YIELD, VM_NEED_INPUT or VM_ERROR; a halted VM stays
+ * halted.
+ */
+int vm_run(vm_t *vm, uint64_t budget);
+
+/* Run @count VMs cloned from the same decoded template, such as one per
+ * input of a parameter sweep, in SIMD lockstep while they follow the same
+ * path, then let each finish alone with vm_run(). @budget applies to every
+ * VM as in vm_run(), and each VM's result is stored in @status. Lockstep
+ * needs the VMs to be at the same pc, with no device-loaded code and none
+ * of the profiler, miner or hardware counters on; otherwise they only run
+ * one after another. Returns 0, or -1 if lockstep was not possible.
+ */
+int vm_run_lanes(vm_t *const *vms, size_t count, uint64_t budget, int *status);
+
+/* Experimental: run @vm as a shared-memory machine of @cpus SUBLEQ CPUs,
+ * each on its own host thread with its own pc. CPU 0 continues from @vm's
+ * pc; the others wait until a program starts them through the CPU device
+ * (devices are always on in this mode). SUBLEQ subtracts atomically, and
+ * the device cell DEV_CPU_ID reads as the number of the CPU reading it.
+ * Fused instructions are not atomic. Only CPU 0 reads input; all CPUs
+ * write output. Input must block: a read returning VM_IO_AGAIN fails the
+ * machine, so this never returns VM_NEED_INPUT, and there is no
+ * instruction budget. The machine stops when CPU 0 halts or fails, and the
+ * counters of all CPUs are added to @vm's statistics. Returns CPU 0's
+ * result, or VM_ERROR if any CPU failed.
+ */
+int vm_run_smp(vm_t *vm, unsigned cpus);
+
+/* Record @vm's memory, decoded code and pc as the state vm_reset() returns
+ * to, e.g. right after loading and decoding an image. The memory is then
+ * mapped copy-on-write from the snapshot, so the pages a run writes are
+ * tracked by the kernel at no cost to the interpreter. Returns 0, or -1 on
+ * failure.
+ */
+int vm_snapshot(vm_t *vm);
+
+/* Return @vm to its last snapshot, restoring only the memory and code pages
+ * written since, and clear its counters, buffered I/O and error state. The
+ * I/O callbacks and the block file are kept. A reset is far cheaper than
+ * loading and decoding the image again, so a host can reuse one VM for a
+ * stream of small jobs. Returns 0, or -1 without a snapshot or on failure.
+ */
+int vm_reset(vm_t *vm);
+
+/* Print execution statistics to @err: instructions substituted and
+ * executed by opcode, then the wall and CPU time of each phase so far,
+ * summed over every vm_run(). A clone inherits the parse and decode times
+ * of its template. The reports of the profiler, hardware counters and
+ * sequence miner follow when they are enabled; README.md describes them.
+ * Returns 0 on success or -1 on output error.
+ */
+int vm_report_stats(vm_t *vm, FILE *err);
+
+/* Write the Forth call stacks the profiler sampled to @out in the folded
+ * format of flamegraph.pl: one line per distinct stack, its words from the
+ * outermost caller to the one executing separated by semicolons, then its
+ * count. Counts are samples with the sampler and estimated instructions
+ * with the counting profiler. Needs either profiler and an eForth image
+ * (see README.md). Returns 0, or -1 if there is nothing to write or on
+ * error.
+ */
+int vm_report_folded(vm_t *vm, FILE *out);
+
+/* Version of the vm_report_json() schema, raised when a field changes
+ * meaning or goes away; new fields may appear without a change
+ */
+#define VM_STATS_JSON_VERSION 1
+
+/* Write the statistics of vm_report_stats() to @out as one JSON object,
+ * for tools to read instead of the tables. "schema" is "subleq-stats" and
+ * "version" is VM_STATS_JSON_VERSION. "instructions", "substitutions",
+ * "cpu_seconds" and "instructions_per_second" sum up the run, and
+ * "opcodes" has an entry for every opcode, in opcode order, with its
+ * "substitutions" and "executed" counts. With the counting profiler each
+ * entry also has its "memory_accesses", and with hardware counters its
+ * "counters" by event name, next to "counters_other" and "counters_lost".
+ * "phases" has the wall and CPU seconds of each phase vm_report_stats()
+ * lists, keyed "create", "parse", "optimize", "profiler_init" and
+ * "execute". "profiler" is null without a profiler, else its "mode"
+ * ("counting" or "sampling"), its totals and up to 64 "hot_spots" ordered
+ * by "count". A counting profiler adds "regions", each with its "name",
+ * first and last cell ("start", "end"), "reads", "writes" and accesses by
+ * opcode name in "opcodes".
+ * Returns 0, or -1 on output error.
+ */
+int vm_report_json(vm_t *vm, FILE *out);
+
+/* Print statistics of the trace file at @path, as recorded with
+ * vm_config_t.trace_file, to @out: instructions and taken branches, the
+ * basic blocks that ran the most instructions, the branches taken most
+ * often, and the hot path, found by following the most taken branch out
+ * of each block from the hottest one. Clones do not inherit the trace, and
+ * vm_run_lanes() runs a traced VM alone.
+ * Returns 0, or -1 if the file cannot be read or is not a trace.
+ */
+int vm_trace_stats(const char *path, FILE *out);
+
+/* Release the VM and everything it owns; flushes the block device */
+void vm_destroy(vm_t *vm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SUBLEQ_H */